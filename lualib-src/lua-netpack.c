@@ -310,9 +310,9 @@ filter_data_(lua_State *L, int fd, uint8_t * buffer, int size) {
 static inline int
 filter_data(lua_State *L, int fd, uint8_t * buffer, int size) {
 	int ret = filter_data_(L, fd, buffer, size);
-	// buffer is the data of socket message, it malloc at socket_server.c : function forward_message .
+	// buffer is the data of socket message, it's allocated from the socket pool at socket_server.c : function forward_message_tcp .
 	// it should be free before return,
-	skynet_free(buffer);
+	skynet_socket_free_buffer(buffer);
 	return ret;
 }
 
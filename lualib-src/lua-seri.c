@@ -8,6 +8,7 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
@@ -30,82 +31,172 @@
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
 #define TYPE_TABLE 6
+#define TYPE_EXTEND 7
+// hibits of TYPE_EXTEND, only in the compact stream (see luaseri_packcompact)
+#define EXTEND_COMPACT 0
+// the first byte of the compact stream
+#define EXTEND_STRING 1
+// a string follows, append it to the string table
+#define EXTEND_STRING_REF 2
+// index
+#define EXTEND_SHAPE 3
+// n, n keys and n values, append the keys to the shape table
+#define EXTEND_SHAPE_REF 4
+// index, n values
 
 #define MAX_COOKIE 32
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
-#define BLOCK_SIZE 128
 #define MAX_DEPTH 32
+#define MAX_SHAPE 32
 
-struct block {
-	struct block * next;
-	char buffer[BLOCK_SIZE];
+/*
+	The message is packed into a growable scratch buffer of the thread, so the result is made by one allocation
+	and one memcpy (packstring needs no allocation). The scratch buffer is taken from the thread while packing,
+	because a __pairs metamethod may pack another message.
+	Only the initial size is kept : the memory is charged to the service which allocates it, a grown buffer
+	kept by the worker thread would be charged to a service which doesn't own it any more.
+ */
+#define SCRATCH_SIZE 4096
+
+struct scratch {
+	int cap;
+	char buffer[1];
+};
+
+/*
+	The compact stream replaces the repeated strings and table shapes (the string keys of a record in order)
+	by the indexes of them. The first one is packed as usual, the second one is added to the table of the stream
+	(both packer and unpacker), and the later ones are the references, so the unique ones cost nothing.
+	The strings are identified by the address, the short strings of lua are interned, so it's exact for them.
+	The interned strings are anchored in a table while packing, a __pairs metamethod may drop the references
+	to them (and run the gc), so the address of a collected string could be reused by another one.
+ */
+#define INTERN_NEW (-2)
+#define INTERN_SEEN (-1)
+
+struct intern_slot {
+	const void * key;	// the string, or the first key of shape. NULL : empty
+	uint32_t hash;
+	int offset;	// the keys of shape in the key pool
+	int n;	// the number of keys of shape
+	int index;	// INTERN_NEW, INTERN_SEEN, or the index in the table of stream
+};
+
+struct intern_map {
+	int cap;
+	int n;
+	int index;
+	struct intern_slot *slot;
+};
+
+struct intern {
+	struct intern_map string;
+	struct intern_map shape;
+	int key_n;
+	int key_cap;
+	const void ** key;	// the key pool of shapes
+	int anchor;	// the stack index of the anchor table, the interned strings are kept in it
+	int anchor_n;
 };
 
 struct write_block {
-	struct block * head;
-	struct block * current;
+	struct scratch * s;
+	char * buffer;
 	int len;
-	int ptr;
+	int cap;
+	struct intern * intern;
 };
 
 struct read_block {
 	char * buffer;
 	int len;
 	int ptr;
+	int strings;	// the stack index of string table of the compact stream, 0 : not compact
+	int string_n;
+	int shapes;
+	int shape_n;
 };
 
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_release(void *s) {
+	skynet_free(s);
+}
+
+static void
+scratch_init(void) {
+	pthread_key_create(&scratch_key, scratch_release);
 }
 
-inline static void
-wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-	if (b->ptr == BLOCK_SIZE) {
-_again:
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
+static void
+wb_init(struct write_block *wb) {
+	pthread_once(&scratch_once, scratch_init);
+	struct scratch *s = pthread_getspecific(scratch_key);
+	if (s) {
+		pthread_setspecific(scratch_key, NULL);
 	} else {
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;
+		s = skynet_malloc(sizeof(*s) + SCRATCH_SIZE);
+		s->cap = SCRATCH_SIZE;
 	}
+	wb->s = s;
+	wb->buffer = s->buffer;
+	wb->len = 0;
+	wb->cap = s->cap;
+	wb->intern = NULL;
 }
 
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
-	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+intern_free(struct intern *in) {
+	if (in) {
+		skynet_free(in->string.slot);
+		skynet_free(in->shape.slot);
+		skynet_free(in->key);
+		skynet_free(in);
+	}
 }
 
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	intern_free(wb->intern);
+	wb->intern = NULL;
+	struct scratch *s = wb->s;
+	if (s == NULL)
+		return;
+	if (s->cap > SCRATCH_SIZE || pthread_getspecific(scratch_key)) {
+		// grown, or the nested one put back its scratch already
+		skynet_free(s);
+	} else {
+		pthread_setspecific(scratch_key, s);
+	}
+	wb->s = NULL;
+	wb->buffer = NULL;
 	wb->len = 0;
+	wb->cap = 0;
+}
+
+static void
+wb_grow(struct write_block *wb, int sz) {
+	int cap = wb->cap;
+	while (cap - wb->len < sz) {
+		cap *= 2;
+	}
+	struct scratch *s = skynet_realloc(wb->s, sizeof(*s) + cap);
+	s->cap = cap;
+	wb->s = s;
+	wb->buffer = s->buffer;
+	wb->cap = cap;
+}
+
+inline static void
+wb_push(struct write_block *b, const void *buf, int sz) {
+	if (b->cap - b->len < sz) {
+		wb_grow(b, sz);
+	}
+	memcpy(b->buffer + b->len, buf, sz);
+	b->len += sz;
 }
 
 static void
@@ -113,6 +204,134 @@ rball_init(struct read_block * rb, char * buffer, int size) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->strings = 0;
+	rb->string_n = 0;
+	rb->shapes = 0;
+	rb->shape_n = 0;
+}
+
+static void
+intern_map_init(struct intern_map *m, int cap) {
+	m->cap = cap;
+	m->n = 0;
+	m->index = 0;
+	m->slot = skynet_malloc(cap * sizeof(struct intern_slot));
+	int i;
+	for (i=0;i<cap;i++) {
+		m->slot[i].key = NULL;
+	}
+}
+
+static struct intern *
+intern_new(int anchor) {
+	struct intern *in = skynet_malloc(sizeof(*in));
+	intern_map_init(&in->string, 64);
+	intern_map_init(&in->shape, 16);
+	in->key_n = 0;
+	in->key_cap = 64;
+	in->key = skynet_malloc(in->key_cap * sizeof(const void *));
+	in->anchor = anchor;
+	in->anchor_n = 0;
+	return in;
+}
+
+static inline uint32_t
+intern_hash(const void *p) {
+	uintptr_t x = (uintptr_t)p;
+	return (uint32_t)((x >> 4) ^ (x >> 20)) * 2654435761u;
+}
+
+static void
+intern_map_grow(struct intern_map *m) {
+	struct intern_slot *old = m->slot;
+	int cap = m->cap;
+	int index = m->index;
+	intern_map_init(m, cap * 2);
+	m->index = index;
+	int i;
+	for (i=0;i<cap;i++) {
+		if (old[i].key) {
+			uint32_t mask = m->cap - 1;
+			uint32_t h = old[i].hash & mask;
+			while (m->slot[h].key) {
+				h = (h + 1) & mask;
+			}
+			m->slot[h] = old[i];
+			++m->n;
+		}
+	}
+	skynet_free(old);
+}
+
+// find the slot of a string, or create a new one (INTERN_NEW)
+static struct intern_slot *
+intern_string(struct intern *in, const char *str) {
+	struct intern_map *m = &in->string;
+	if (m->n * 2 >= m->cap) {
+		intern_map_grow(m);
+	}
+	uint32_t hash = intern_hash(str);
+	uint32_t mask = m->cap - 1;
+	uint32_t h = hash & mask;
+	while (m->slot[h].key) {
+		if (m->slot[h].key == str)
+			return &m->slot[h];
+		h = (h + 1) & mask;
+	}
+	struct intern_slot *slot = &m->slot[h];
+	slot->key = str;
+	slot->hash = hash;
+	slot->offset = 0;
+	slot->n = 0;
+	slot->index = INTERN_NEW;
+	++m->n;
+	return slot;
+}
+
+static struct intern_slot *
+intern_shape(struct intern *in, const void *keys[], int n) {
+	struct intern_map *m = &in->shape;
+	if (m->n * 2 >= m->cap) {
+		intern_map_grow(m);
+	}
+	uint32_t hash = n;
+	int i;
+	for (i=0;i<n;i++) {
+		hash = hash * 31 + intern_hash(keys[i]);
+	}
+	uint32_t mask = m->cap - 1;
+	uint32_t h = hash & mask;
+	while (m->slot[h].key) {
+		struct intern_slot *slot = &m->slot[h];
+		if (slot->hash == hash && slot->n == n
+			&& memcmp(in->key + slot->offset, keys, n * sizeof(const void *)) == 0) {
+			return slot;
+		}
+		h = (h + 1) & mask;
+	}
+	if (in->key_n + n > in->key_cap) {
+		while (in->key_n + n > in->key_cap) {
+			in->key_cap *= 2;
+		}
+		in->key = skynet_realloc(in->key, in->key_cap * sizeof(const void *));
+	}
+	memcpy(in->key + in->key_n, keys, n * sizeof(const void *));
+	struct intern_slot *slot = &m->slot[h];
+	slot->key = keys[0];
+	slot->hash = hash;
+	slot->offset = in->key_n;
+	slot->n = n;
+	slot->index = INTERN_NEW;
+	in->key_n += n;
+	++m->n;
+	return slot;
+}
+
+// keep the string at index alive until the end of packing
+static inline void
+intern_anchor(lua_State *L, struct intern *in, int index) {
+	lua_pushvalue(L, index);
+	lua_rawseti(L, in->anchor, ++in->anchor_n);
 }
 
 static const void *
@@ -212,8 +431,94 @@ wb_string(struct write_block *wb, const char *str, int len) {
 	}
 }
 
+static inline void
+wb_index(struct write_block *wb, int type, int index) {
+	uint8_t n = COMBINE_TYPE(TYPE_EXTEND, type);
+	wb_push(wb, &n, 1);
+	if (index < 0xff) {
+		uint8_t x = (uint8_t)index;
+		wb_push(wb, &x, 1);
+	} else {
+		uint8_t x = 0xff;
+		wb_push(wb, &x, 1);
+		uint32_t v = (uint32_t)index;
+		wb_push(wb, &v, 4);
+	}
+}
+
+static void
+wb_string_compact(lua_State *L, struct write_block *wb, int index, const char *str, int len) {
+	struct intern_slot *slot = intern_string(wb->intern, str);
+	if (slot->index >= 0) {
+		wb_index(wb, EXTEND_STRING_REF, slot->index);
+		return;
+	}
+	if (slot->index == INTERN_SEEN) {
+		slot->index = wb->intern->string.index++;
+		uint8_t n = COMBINE_TYPE(TYPE_EXTEND, EXTEND_STRING);
+		wb_push(wb, &n, 1);
+	} else {
+		slot->index = INTERN_SEEN;
+		intern_anchor(L, wb->intern, index);
+	}
+	wb_string(wb, str, len);
+}
+
 static void pack_one(lua_State *L, struct write_block *b, int index, int depth);
 
+// pack the record (1 ~ MAX_SHAPE string keys) by its shape, return 0 if it's not a record
+static int
+wb_table_shape(lua_State *L, struct write_block *wb, int index, int depth) {
+	if (lua_rawlen(L, index) != 0 || !lua_checkstack(L, MAX_SHAPE * 2 + 2))
+		return 0;
+	const void * keys[MAX_SHAPE];
+	int top = lua_gettop(L);
+	int n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		if (n == MAX_SHAPE || lua_type(L, -2) != LUA_TSTRING) {
+			lua_settop(L, top);
+			return 0;
+		}
+		keys[n++] = lua_tostring(L, -2);
+		lua_pushvalue(L, -2);
+	}
+	if (n == 0)
+		return 0;
+	// the slot may be moved by the nested records, so don't use it after packing them
+	struct intern_slot *slot = intern_shape(wb->intern, keys, n);
+	int i;
+	if (slot->index >= 0) {
+		wb_index(wb, EXTEND_SHAPE_REF, slot->index);
+	} else if (slot->index == INTERN_NEW) {
+		slot->index = INTERN_SEEN;
+		for (i=0;i<n;i++) {
+			intern_anchor(L, wb->intern, top + i * 2 + 1);
+		}
+		uint8_t t = COMBINE_TYPE(TYPE_TABLE, 0);
+		wb_push(wb, &t, 1);
+		for (i=0;i<n;i++) {
+			pack_one(L, wb, top + i * 2 + 1, depth);
+			pack_one(L, wb, top + i * 2 + 2, depth);
+		}
+		wb_nil(wb);
+		lua_settop(L, top);
+		return 1;
+	} else {
+		slot->index = wb->intern->shape.index++;
+		uint8_t t[2] = { COMBINE_TYPE(TYPE_EXTEND, EXTEND_SHAPE), (uint8_t)n };
+		wb_push(wb, t, 2);
+		for (i=0;i<n;i++) {
+			pack_one(L, wb, top + i * 2 + 1, depth);
+		}
+	}
+	for (i=0;i<n;i++) {
+		pack_one(L, wb, top + i * 2 + 2, depth);
+	}
+	lua_settop(L, top);
+	return 1;
+}
+
 static int
 wb_table_array(lua_State *L, struct write_block * wb, int index, int depth) {
 	int array_size = lua_rawlen(L,index);
@@ -294,6 +599,8 @@ wb_table(lua_State *L, struct write_block *wb, int index, int depth) {
 	if (luaL_getmetafield(L, index, "__pairs") != LUA_TNIL) {
 		return wb_table_metapairs(L, wb, index, depth);
 	} else {
+		if (wb->intern && wb_table_shape(L, wb, index, depth))
+			return 0;
 		int array_size = wb_table_array(L, wb, index, depth);
 		wb_table_hash(L, wb, index, depth, array_size);
 		return 0;
@@ -327,7 +634,11 @@ pack_one(lua_State *L, struct write_block *b, int index, int depth) {
 	case LUA_TSTRING: {
 		size_t sz = 0;
 		const char *str = lua_tolstring(L,index,&sz);
-		wb_string(b, str, (int)sz);
+		if (b->intern && sz >= 2) {
+			wb_string_compact(L, b, index, str, (int)sz);
+		} else {
+			wb_string(b, str, (int)sz);
+		}
 		break;
 	}
 	case LUA_TLIGHTUSERDATA:
@@ -440,6 +751,7 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 }
 
 static void unpack_one(lua_State *L, struct read_block *rb);
+static void push_value(lua_State *L, struct read_block *rb, int type, int cookie);
 
 static void
 unpack_table(lua_State *L, struct read_block *rb, int array_size) {
@@ -474,6 +786,92 @@ unpack_table(lua_State *L, struct read_block *rb, int array_size) {
 	}
 }
 
+static int
+get_index(lua_State *L, struct read_block *rb, int n) {
+	const uint8_t * p = (const uint8_t *)rb_read(rb, 1);
+	if (p == NULL) {
+		invalid_stream(L,rb);
+	}
+	uint32_t index = *p;
+	if (index == 0xff) {
+		const void * pv = rb_read(rb, 4);
+		if (pv == NULL) {
+			invalid_stream(L,rb);
+		}
+		memcpy(&index, pv, sizeof(index));
+	}
+	if (index >= (uint32_t)n) {
+		invalid_stream(L,rb);
+	}
+	return (int)index;
+}
+
+// the keys are on the top of stack, replace them by the record
+static void
+unpack_record(lua_State *L, struct read_block *rb, int n) {
+	lua_createtable(L, 0, n);
+	int i;
+	for (i=1;i<=n;i++) {
+		lua_rawgeti(L, -2, i);
+		unpack_one(L, rb);
+		lua_rawset(L, -3);
+	}
+	lua_remove(L, -2);
+}
+
+static void
+unpack_extend(lua_State *L, struct read_block *rb, int cookie) {
+	if (rb->strings == 0) {
+		// not a compact stream
+		invalid_stream(L,rb);
+	}
+	switch (cookie) {
+	case EXTEND_STRING: {
+		const uint8_t * t = (const uint8_t *)rb_read(rb, 1);
+		if (t == NULL || ((*t & 7) != TYPE_SHORT_STRING && (*t & 7) != TYPE_LONG_STRING)) {
+			invalid_stream(L,rb);
+		}
+		push_value(L, rb, *t & 7, *t >> 3);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, rb->strings, ++rb->string_n);
+		break;
+	}
+	case EXTEND_STRING_REF:
+		lua_rawgeti(L, rb->strings, get_index(L, rb, rb->string_n) + 1);
+		break;
+	case EXTEND_SHAPE: {
+		const uint8_t * pn = (const uint8_t *)rb_read(rb, 1);
+		if (pn == NULL || *pn == 0 || *pn > MAX_SHAPE) {
+			invalid_stream(L,rb);
+		}
+		int n = *pn;
+		luaL_checkstack(L,LUA_MINSTACK,NULL);
+		lua_createtable(L, n, 0);
+		int i;
+		for (i=1;i<=n;i++) {
+			unpack_one(L, rb);
+			if (lua_type(L, -1) != LUA_TSTRING) {
+				invalid_stream(L,rb);
+			}
+			lua_rawseti(L, -2, i);
+		}
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, rb->shapes, ++rb->shape_n);
+		unpack_record(L, rb, n);
+		break;
+	}
+	case EXTEND_SHAPE_REF: {
+		int index = get_index(L, rb, rb->shape_n);
+		luaL_checkstack(L,LUA_MINSTACK,NULL);
+		lua_rawgeti(L, rb->shapes, index + 1);
+		unpack_record(L, rb, (int)lua_rawlen(L, -1));
+		break;
+	}
+	default:
+		invalid_stream(L,rb);
+	}
+}
+
 static void
 push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 	switch(type) {
@@ -523,6 +921,9 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		unpack_table(L,rb,cookie);
 		break;
 	}
+	case TYPE_EXTEND:
+		unpack_extend(L,rb,cookie);
+		break;
 	default: {
 		invalid_stream(L,rb);
 		break;
@@ -542,24 +943,11 @@ unpack_one(lua_State *L, struct read_block *rb) {
 }
 
 static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
-		} else {
-			memcpy(ptr, b->buffer, len);
-			break;
-		}
-	}
-	
+seri(lua_State *L, struct write_block *wb) {
+	uint8_t * buffer = skynet_malloc(wb->len);
+	memcpy(buffer, wb->buffer, wb->len);
 	lua_pushlightuserdata(L, buffer);
-	lua_pushinteger(L, sz);
+	lua_pushinteger(L, wb->len);
 }
 
 int
@@ -587,6 +975,15 @@ luaseri_unpack(lua_State *L) {
 	lua_settop(L,1);
 	struct read_block rb;
 	rball_init(&rb, buffer, len);
+	if (*(const uint8_t *)buffer == COMBINE_TYPE(TYPE_EXTEND, EXTEND_COMPACT)) {
+		// the string table and the shape table of the compact stream are at 2 and 3
+		rb_read(&rb, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		rb.strings = 2;
+		rb.shapes = 3;
+	}
+	int base = lua_gettop(L);
 
 	int i;
 	for (i=0;;i++) {
@@ -603,20 +1000,47 @@ luaseri_unpack(lua_State *L) {
 
 	// Need not free buffer
 
-	return lua_gettop(L) - 1;
+	return lua_gettop(L) - base;
 }
 
 LUAMOD_API int
 luaseri_pack(lua_State *L) {
-	struct block temp;
-	temp.next = NULL;
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb);
 	pack_from(L,&wb,0);
-	assert(wb.head == &temp);
-	seri(L, &temp, wb.len);
+	seri(L, &wb);
+
+	wb_free(&wb);
+
+	return 2;
+}
+
+// pack the repeated strings and records by reference, luaseri_unpack can unpack it.
+LUAMOD_API int
+luaseri_packcompact(lua_State *L) {
+	struct write_block wb;
+	lua_newtable(L);
+	lua_insert(L, 1);
+	wb_init(&wb);
+	wb.intern = intern_new(1);
+	uint8_t n = COMBINE_TYPE(TYPE_EXTEND, EXTEND_COMPACT);
+	wb_push(&wb, &n, 1);
+	pack_from(L,&wb,1);
+	seri(L, &wb);
 
 	wb_free(&wb);
 
 	return 2;
 }
+
+LUAMOD_API int
+luaseri_packstring(lua_State *L) {
+	struct write_block wb;
+	wb_init(&wb);
+	pack_from(L,&wb,0);
+	lua_pushlstring(L, wb.buffer, wb.len);
+
+	wb_free(&wb);
+
+	return 1;
+}
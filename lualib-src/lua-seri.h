@@ -5,5 +5,9 @@
 
 int luaseri_pack(lua_State *L);
 int luaseri_unpack(lua_State *L);
+// pack to a lua string
+int luaseri_packstring(lua_State *L);
+// pack the repeated strings and records by reference
+int luaseri_packcompact(lua_State *L);
 
 #endif
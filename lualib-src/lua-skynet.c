@@ -225,6 +225,24 @@ lintcommand(lua_State *L) {
 	return 0;
 }
 
+// ti is in centiseconds, the fraction of centisecond uses the millisecond timer. return the session
+static int
+ltimeout(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	lua_Number ti = luaL_checknumber(L, 1);
+	// check the range before any cast, nan fails both comparisons
+	if (!(ti >= -INT32_MAX && ti <= INT32_MAX)) {
+		return luaL_error(L, "Invalid timeout %f", ti);
+	}
+	int64_t ms = ti > 0 ? (int64_t)(ti * 10 + 0.5) : 0;
+	int session = skynet_context_timeout(context, ms);
+	if (session < 0) {
+		return luaL_error(L, "Can't create timer");
+	}
+	lua_pushinteger(L, session);
+	return 1;
+}
+
 static int
 lgenid(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -382,16 +400,6 @@ lharbor(lua_State *L) {
 	return 2;
 }
 
-static int
-lpackstring(lua_State *L) {
-	luaseri_pack(L);
-	char * str = (char *)lua_touserdata(L, -2);
-	int sz = lua_tointeger(L, -1);
-	lua_pushlstring(L, str, sz);
-	skynet_free(str);
-	return 1;
-}
-
 static int
 ltrash(lua_State *L) {
 	int t = lua_type(L,1);
@@ -419,6 +427,13 @@ lnow(lua_State *L) {
 	return 1;
 }
 
+static int
+lcanceltimeout(lua_State *L) {
+	int session = (int)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, skynet_timeout_cancel(skynet_current_handle(), session));
+	return 1;
+}
+
 static int
 lhpc(lua_State *L) {
 	lua_pushinteger(L, get_time());
@@ -502,6 +517,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "redirect", lredirect },
 		{ "command" , lcommand },
 		{ "intcommand", lintcommand },
+		{ "timeout", ltimeout },
 		{ "addresscommand", laddresscommand },
 		{ "error", lerror },
 		{ "harbor", lharbor },
@@ -515,9 +531,11 @@ luaopen_skynet_core(lua_State *L) {
 		{ "tostring", ltostring },
 		{ "pack", luaseri_pack },
 		{ "unpack", luaseri_unpack },
-		{ "packstring", lpackstring },
+		{ "packstring", luaseri_packstring },
+		{ "packcompact", luaseri_packcompact },
 		{ "trash" , ltrash },
 		{ "now", lnow },
+		{ "canceltimeout", lcanceltimeout },
 		{ "hpc", lhpc },	// getHPCounter
 		{ NULL, NULL },
 	};
@@ -25,6 +25,7 @@
 #define LARGE_PAGE_NODE 12
 #define POOL_SIZE_WARNING 32
 #define BUFFER_LIMIT (256 * 1024)
+#define SHARED_META "socket_shared"
 
 struct buffer_node {
 	char * msg;
@@ -47,7 +48,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			skynet_free(node->msg);
+			skynet_socket_free_buffer(node->msg);
 			node->msg = NULL;
 		}
 	}
@@ -164,7 +165,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	skynet_socket_free_buffer(free_node->msg);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -301,7 +302,7 @@ static int
 ldrop(lua_State *L) {
 	void * msg = lua_touserdata(L,1);
 	luaL_checkinteger(L,2);
-	skynet_free(msg);
+	skynet_socket_free_buffer(msg);
 	return 0;
 }
 
@@ -411,6 +412,27 @@ lunpack(lua_State *L) {
 	return 4;
 }
 
+// split the buffer of SKYNET_SOCKET_TYPE_UDP_BATCH into { data1, address1, data2, address2, ... }
+static int
+ludp_batch(lua_State *L) {
+	const char * buffer = lua_touserdata(L,1);
+	int size = luaL_checkinteger(L,2);
+	luaL_argcheck(L, buffer != NULL, 1, "need buffer");
+	lua_newtable(L);
+	int offset = 0;
+	int n = 0;
+	int sz, addrsz;
+	const char * address;
+	const char * data;
+	while ((data = skynet_socket_udp_batch(buffer, size, &offset, &sz, &address, &addrsz))) {
+		lua_pushlstring(L, data, sz);
+		lua_rawseti(L, -2, ++n);
+		lua_pushlstring(L, address, addrsz);
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
 static const char *
 address_port(lua_State *L, char *tmp, const char * addr, int port_index, int *port) {
 	const char * host;
@@ -497,6 +519,29 @@ llisten(lua_State *L) {
 	return 1;
 }
 
+static int
+llisten_reuseport(lua_State *L) {
+	static const char * const policy_name[] = { "hash", "cpu", NULL };
+	const char * host = luaL_checkstring(L,1);
+	int port = luaL_checkinteger(L,2);
+	int n = luaL_checkinteger(L,3);
+	int backlog = luaL_optinteger(L,4,BACKLOG);
+	int policy = luaL_checkoption(L,5,"hash",policy_name) == 0 ? SKYNET_SOCKET_REUSEPORT_HASH : SKYNET_SOCKET_REUSEPORT_CPU;
+	luaL_argcheck(L, n > 0 && n <= SKYNET_SOCKET_MAX_REUSEPORT, 3, "invalid number of listeners");
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int ids[SKYNET_SOCKET_MAX_REUSEPORT];
+	if (skynet_socket_listen_reuseport(ctx, host, port, backlog, n, policy, ids) < 0) {
+		return luaL_error(L, "Listen error");
+	}
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, ids[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 static size_t
 count_size(lua_State *L, int index) {
 	size_t tlen = 0;
@@ -538,8 +583,16 @@ get_buffer(lua_State *L, int index, struct socket_sendbuffer *buf) {
 	void *buffer;
 	switch(lua_type(L, index)) {
 		size_t len;
-	case LUA_TUSERDATA:
-		// lua full useobject must be a raw pointer, it can't be a socket object or a memory object.
+	case LUA_TUSERDATA: {
+		struct skynet_socket_shared **shared = luaL_testudata(L, index, SHARED_META);
+		if (shared) {
+			// each send holds a reference of the shared buffer
+			buf->type = SOCKET_BUFFER_OBJECT;
+			buf->buffer = skynet_socket_shared_grab(*shared);
+			buf->sz = skynet_socket_shared_size(*shared);
+			break;
+		}
+		// other lua full useobject must be a raw pointer, it can't be a socket object or a memory object.
 		buf->type = SOCKET_BUFFER_RAWPOINTER;
 		buf->buffer = lua_touserdata(L, index);
 		if (lua_isinteger(L, index+1)) {
@@ -548,6 +601,7 @@ get_buffer(lua_State *L, int index, struct socket_sendbuffer *buf) {
 			buf->sz = lua_rawlen(L, index);
 		}
 		break;
+		}
 	case LUA_TLIGHTUSERDATA: {
 		int sz = -1;
 		if (lua_isinteger(L, index+1)) {
@@ -578,6 +632,111 @@ get_buffer(lua_State *L, int index, struct socket_sendbuffer *buf) {
 	}
 }
 
+static int
+lfreeshared(lua_State *L) {
+	struct skynet_socket_shared **shared = lua_touserdata(L, 1);
+	if (*shared) {
+		skynet_socket_shared_release(*shared);
+		*shared = NULL;
+	}
+	return 0;
+}
+
+static int
+lsharedsize(lua_State *L) {
+	struct skynet_socket_shared **shared = lua_touserdata(L, 1);
+	lua_pushinteger(L, skynet_socket_shared_size(*shared));
+	return 1;
+}
+
+/*
+	string (or table, lightuserdata/size as send)
+	return a shared buffer, it can be sent to many sockets with one copy of the data.
+ */
+static int
+lshared(lua_State *L) {
+	if (luaL_testudata(L, 1, SHARED_META)) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	struct skynet_socket_shared **shared = lua_newuserdatauv(L, sizeof(*shared), 0);
+	*shared = NULL;
+	if (luaL_newmetatable(L, SHARED_META)) {
+		lua_pushcfunction(L, lfreeshared);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, lsharedsize);
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+	struct socket_sendbuffer buf;
+	get_buffer(L, 1, &buf);
+	if (buf.type == SOCKET_BUFFER_OBJECT) {
+		return luaL_error(L, "Invalid shared buffer");
+	}
+	*shared = skynet_socket_shared_new(buf.buffer, buf.sz);
+	if (buf.type == SOCKET_BUFFER_MEMORY) {
+		skynet_free((void *)buf.buffer);
+	}
+	return 1;
+}
+
+#define MULTI_STACK 256
+
+/*
+	table of ids, data (shared buffer, or anything accepted by send)
+	return the number of the valid ids
+ */
+static int
+send_multi(lua_State *L, int lowpriority) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = lua_rawlen(L, 1);
+	int tmp[MULTI_STACK];
+	int *ids = tmp;
+	if (n > MULTI_STACK) {
+		ids = lua_newuserdatauv(L, n * sizeof(int), 0);
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		int isnum;
+		ids[i] = lua_tointegerx(L, -1, &isnum);
+		if (!isnum) {
+			return luaL_error(L, "Invalid socket id at %d", i+1);
+		}
+		lua_pop(L, 1);
+	}
+	struct skynet_socket_shared *sb;
+	struct skynet_socket_shared **shared = luaL_testudata(L, 2, SHARED_META);
+	if (shared) {
+		sb = skynet_socket_shared_grab(*shared);
+	} else {
+		struct socket_sendbuffer buf;
+		get_buffer(L, 2, &buf);
+		if (buf.type == SOCKET_BUFFER_OBJECT) {
+			return luaL_error(L, "Invalid buffer");
+		}
+		sb = skynet_socket_shared_new(buf.buffer, buf.sz);
+		if (buf.type == SOCKET_BUFFER_MEMORY) {
+			skynet_free((void *)buf.buffer);
+		}
+	}
+	int count = lowpriority ? skynet_socket_send_multi_lowpriority(ctx, ids, n, sb) : skynet_socket_send_multi(ctx, ids, n, sb);
+	skynet_socket_shared_release(sb);
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int
+lsendmulti(lua_State *L) {
+	return send_multi(L, 0);
+}
+
+static int
+lsendmultilow(lua_State *L) {
+	return send_multi(L, 1);
+}
+
 static int
 lsend(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -635,6 +794,22 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+/*
+	id, high, low (default high/2)
+	high = 0 turns it off
+ */
+static int
+lwatermark(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	lua_Integer high = luaL_checkinteger(L, 2);
+	lua_Integer low = luaL_optinteger(L, 3, high / 2);
+	luaL_argcheck(L, high >= 0, 2, "invalid high watermark");
+	luaL_argcheck(L, low >= 0 && low <= high, 3, "invalid low watermark");
+	skynet_socket_watermark(ctx, id, high, low);
+	return 0;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -767,6 +942,8 @@ getinfo(lua_State *L, struct socket_info *si) {
 		lua_setfield(L, -2, "type");
 		lua_pushinteger(L, si->read);
 		lua_setfield(L, -2, "accept");
+		lua_pushinteger(L, si->arate);
+		lua_setfield(L, -2, "arate");
 		lua_pushinteger(L, si->rtime);
 		lua_setfield(L, -2, "rtime");
 		if (si->name[0]) {
@@ -798,10 +975,16 @@ getinfo(lua_State *L, struct socket_info *si) {
 	lua_setfield(L, -2, "write");
 	lua_pushinteger(L, si->wbuffer);
 	lua_setfield(L, -2, "wbuffer");
+	lua_pushinteger(L, si->drop);
+	lua_setfield(L, -2, "drop");
 	lua_pushinteger(L, si->rtime);
 	lua_setfield(L, -2, "rtime");
 	lua_pushinteger(L, si->wtime);
 	lua_setfield(L, -2, "wtime");
+	lua_pushinteger(L, si->rcall);
+	lua_setfield(L, -2, "rcall");
+	lua_pushinteger(L, si->wcall);
+	lua_setfield(L, -2, "wcall");
 	lua_pushboolean(L, si->reading);
 	lua_setfield(L, -2, "reading");
 	lua_pushboolean(L, si->writing);
@@ -827,6 +1010,23 @@ linfo(lua_State *L) {
 	return 1;
 }
 
+/*
+	return the histogram of the write buffer sizes, { [1] = [0,1K), [2] = [1K,2K), [3] = [2K,4K) ... }
+	the last one has no upper bound
+ */
+static int
+lhistogram(lua_State *L) {
+	uint64_t h[SKYNET_SOCKET_HISTOGRAM];
+	skynet_socket_histogram(h);
+	lua_createtable(L, SKYNET_SOCKET_HISTOGRAM, 0);
+	int i;
+	for (i=0;i<SKYNET_SOCKET_HISTOGRAM;i++) {
+		lua_pushinteger(L, h[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 static int
 lresolve(lua_State *L) {
 	const char * host = luaL_checkstring(L, 1);
@@ -869,8 +1069,11 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "str2p", lstr2p },
 		{ "header", lheader },
 		{ "info", linfo },
+		{ "histogram", lhistogram },
 
 		{ "unpack", lunpack },
+		{ "udp_batch", ludp_batch },
+		{ "shared", lshared },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -879,12 +1082,16 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "close", lclose },
 		{ "shutdown", lshutdown },
 		{ "listen", llisten },
+		{ "listen_reuseport", llisten_reuseport },
 		{ "send", lsend },
 		{ "lsend", lsendlow },
+		{ "send_multi", lsendmulti },
+		{ "lsend_multi", lsendmultilow },
 		{ "bind", lbind },
 		{ "start", lstart },
 		{ "pause", lpause },
 		{ "nodelay", lnodelay },
+		{ "watermark", lwatermark },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
 		{ "udp_dial", ludp_dial},
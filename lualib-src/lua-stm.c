@@ -234,10 +234,107 @@ lread(lua_State *L) {
 	}
 }
 
+// immutable message shared by many services, each box owns one reference of the copy.
+
+struct boxmsg {
+	struct stm_copy *copy;
+};
+
+static int
+lnewmsg(lua_State *L) {
+	void * msg;
+	size_t sz;
+	if (lua_isuserdata(L,1)) {
+		msg = lua_touserdata(L, 1);
+		sz = (size_t)luaL_checkinteger(L, 2);
+	} else {
+		const char * tmp = luaL_checklstring(L,1,&sz);
+		msg = skynet_malloc(sz);
+		memcpy(msg, tmp, sz);
+	}
+	struct boxmsg * box = lua_newuserdatauv(L, sizeof(*box), 0);
+	box->copy = stm_newcopy(msg, sz);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// adopt the reference passed by stm.ref
+static int
+lopenmsg(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	struct stm_copy * copy = lua_touserdata(L, 1);
+	struct boxmsg * box = lua_newuserdatauv(L, sizeof(*box), 0);
+	box->copy = copy;
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int
+ldeletemsg(lua_State *L) {
+	struct boxmsg * box = lua_touserdata(L, 1);
+	stm_releasecopy(box->copy);
+	box->copy = NULL;
+
+	return 0;
+}
+
+static int
+lreadmsg(lua_State *L) {
+	struct boxmsg * box = lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	struct stm_copy * copy = box->copy;
+	if (copy == NULL) {
+		return luaL_error(L, "The shared message is released");
+	}
+	lua_settop(L, 3);
+	lua_pushlightuserdata(L, copy->msg);
+	lua_pushinteger(L, copy->sz);
+	// f(msg, sz, ud)
+	lua_rotate(L, 3, 2);
+	lua_call(L, 3, LUA_MULTRET);
+	return lua_gettop(L) - 1;
+}
+
+// grab n references of the message for n receivers
+static int
+lrefmsg(lua_State *L) {
+	struct boxmsg * box = luaL_checkudata(L, 1, "STM_MESSAGE");
+	int n = (int)luaL_optinteger(L, 2, 1);
+	if (n <= 0) {
+		return luaL_error(L, "Invalid reference count %d", n);
+	}
+	if (box->copy == NULL) {
+		return luaL_error(L, "The shared message is released");
+	}
+	int ref = ATOM_FADD(&box->copy->reference, n);
+	assert(ref > 0);
+	lua_pushlightuserdata(L, box->copy);
+
+	return 1;
+}
+
+// release the references which are not delivered
+static int
+lunrefmsg(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	struct stm_copy * copy = lua_touserdata(L, 1);
+	int n = (int)luaL_optinteger(L, 2, 1);
+	if (n > 0 && ATOM_FSUB(&copy->reference, n) <= n) {
+		skynet_free(copy->msg);
+		skynet_free(copy);
+	}
+
+	return 0;
+}
+
 LUAMOD_API int
 luaopen_skynet_stm(lua_State *L) {
 	luaL_checkversion(L);
-	lua_createtable(L, 0, 3);
+	lua_createtable(L, 0, 7);
 
 	lua_pushcfunction(L, lcopy);
 	lua_setfield(L, -2, "copy");
@@ -264,5 +361,21 @@ luaopen_skynet_stm(lua_State *L) {
 	lua_setfield(L, -2, "__call");
 	luaL_setfuncs(L, reader, 1);
 
+	lua_pushcfunction(L, lunrefmsg);
+	lua_setfield(L, -2, "unref");
+
+	luaL_Reg message[] = {
+		{ "share", lnewmsg },
+		{ "open", lopenmsg },
+		{ "ref", lrefmsg },
+		{ NULL, NULL },
+	};
+	luaL_newmetatable(L, "STM_MESSAGE");
+	lua_pushcfunction(L, ldeletemsg),
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lreadmsg),
+	lua_setfield(L, -2, "__call");
+	luaL_setfuncs(L, message, 1);
+
 	return 1;
 }
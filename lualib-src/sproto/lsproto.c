@@ -405,6 +405,10 @@ expand_buffer(lua_State *L, int osz, int nsz) {
 	return output;
 }
 
+// the compiled mode, see below
+static int cencode(lua_State *L);
+static int cdecode(lua_State *L);
+
 /*
 	lightuserdata sproto_type
 	table source
@@ -418,6 +422,9 @@ lencode(lua_State *L) {
 	int sz = lua_tointeger(L, lua_upvalueindex(2));
 	int tbl_index = 2;
 	struct sproto_type * st = lua_touserdata(L, 1);
+	if (lua_type(L, 1) == LUA_TUSERDATA) {
+		return cencode(L);
+	}
 	if (st == NULL) {
 		luaL_checktype(L, tbl_index, LUA_TNIL);
 		lua_pushstring(L, "");
@@ -628,6 +635,9 @@ ldecode(lua_State *L) {
 		// return nil
 		return 0;
 	}
+	if (lua_type(L, 1) == LUA_TUSERDATA) {
+		return cdecode(L);
+	}
 	sz = 0;
 	buffer = getbuffer(L, 2, &sz);
 	if (!lua_istable(L, -1)) {
@@ -650,6 +660,787 @@ ldecode(lua_State *L) {
 	return 2;
 }
 
+/*
+	The compiled mode : each sproto_type is compiled into a flat field program,
+	and the program is run against the lua table directly without sproto_callback.
+	The key strings of all the programs are interned into the cache table.
+ */
+
+#define SIZEOF_LENGTH 4
+#define SIZEOF_HEADER 2
+#define SIZEOF_FIELD 2
+
+struct cprogram;
+
+struct cfield {
+	int tag;
+	int type;
+	int array;
+	int extra;
+	int key;	// index of the key string in the cache table
+	const char * name;
+	struct cprogram * sub;
+};
+
+struct cprogram {
+	struct sproto_type * st;
+	int n;
+	int maxn;
+	int validate;	// check the fields like proto_builder.validate
+	struct cfield f[1];
+};
+
+#define CPROGRAM_SIZE(n) (sizeof(struct cprogram) + ((n) > 0 ? (n) - 1 : 0) * sizeof(struct cfield))
+
+// The types with a map or a main index array are not compiled
+static int
+compilable(lua_State *L, int visited, struct sproto_type *st) {
+	int n = sproto_fieldn(st, NULL);
+	int i;
+	lua_pushlightuserdata(L, st);
+	if (lua_rawget(L, visited) != LUA_TNIL) {
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, st);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, visited);
+	for (i=0;i<n;i++) {
+		struct sproto_field f;
+		sproto_field(st, i, &f);
+		if ((f.type & SPROTO_TARRAY) && (f.mainindex >= 0 || f.map > 0))
+			return 0;
+		if (f.subtype && !compilable(L, visited, f.subtype))
+			return 0;
+	}
+	return 1;
+}
+
+static struct cprogram *
+compile_type(lua_State *L, int cache, struct sproto_type *st) {
+	struct cprogram * p;
+	int maxn;
+	int n;
+	int i;
+	luaL_checkstack(L, 4, NULL);
+	lua_pushlightuserdata(L, st);
+	if (lua_rawget(L, cache) == LUA_TUSERDATA) {
+		p = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return p;
+	}
+	lua_pop(L, 1);
+	n = sproto_fieldn(st, &maxn);
+	p = lua_newuserdatauv(L, CPROGRAM_SIZE(n), 1);
+	p->st = st;
+	p->n = n;
+	p->maxn = maxn;
+	p->validate = 0;
+	// the sub programs and the keys are kept by the cache table
+	lua_pushvalue(L, cache);
+	lua_setiuservalue(L, -2, 1);
+	// register before compiling the fields, for the recursive types
+	lua_pushlightuserdata(L, st);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, cache);
+	for (i=0;i<n;i++) {
+		struct cfield * cf = &p->f[i];
+		struct sproto_field f;
+		sproto_field(st, i, &f);
+		cf->tag = f.tag;
+		cf->type = f.type & ~SPROTO_TARRAY;
+		cf->array = (f.type & SPROTO_TARRAY) != 0;
+		cf->extra = f.extra;
+		cf->name = f.name;
+		cf->key = (int)lua_rawlen(L, cache) + 1;
+		lua_pushstring(L, f.name);
+		lua_rawseti(L, cache, cf->key);
+		cf->sub = f.subtype ? compile_type(L, cache, f.subtype) : NULL;
+	}
+	lua_pop(L, 1);
+	return p;
+}
+
+/*
+	lightuserdata sproto_type
+	table cache
+	boolean validate
+
+	return the program (userdata), or sproto_type if it can't be compiled
+	The program with validate is a copy, the top level fields are all required and checked by type.
+ */
+static int
+lcompile(lua_State *L) {
+	struct sproto_type * st = lua_touserdata(L, 1);
+	int validate = lua_toboolean(L, 3);
+	struct cprogram * p;
+	if (st == NULL || lua_type(L, 1) != LUA_TLIGHTUSERDATA) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_newtable(L);
+	if (!compilable(L, 3, st)) {
+		if (validate) {
+			// the validation can't be skipped silently
+			return luaL_error(L, "Type %s can't be validated in compiled mode : it has a map or a main index array", sproto_name(st));
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+	lua_settop(L, 2);
+	p = compile_type(L, 2, st);
+	if (validate) {
+		struct cprogram * vp = lua_newuserdatauv(L, CPROGRAM_SIZE(p->n), 1);
+		memcpy(vp, p, CPROGRAM_SIZE(p->n));
+		vp->validate = 1;
+		lua_pushvalue(L, 2);
+		lua_setiuservalue(L, -2, 1);
+	} else {
+		lua_pushlightuserdata(L, st);
+		lua_rawget(L, 2);
+	}
+	return 1;
+}
+
+static void
+cpush_typename(lua_State *L, const struct cfield *f) {
+	const char * name;
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+		name = "integer";
+		break;
+	case SPROTO_TDOUBLE:
+		name = "double";
+		break;
+	case SPROTO_TBOOLEAN:
+		name = "boolean";
+		break;
+	case SPROTO_TSTRING:
+		name = f->extra == SPROTO_TSTRING_BINARY ? "binary" : "string";
+		break;
+	default:
+		name = sproto_name(f->sub->st);
+		break;
+	}
+	if (f->array) {
+		lua_pushfstring(L, "*%s", name);
+	} else {
+		lua_pushstring(L, name);
+	}
+}
+
+// append { field, error, type, actual } to the error list at errors, the value is at the top
+static void
+cvalidate_error(lua_State *L, int errors, const struct cfield *f, const char *code) {
+	const char * actual = luaL_typename(L, -1);
+	luaL_checkstack(L, 4, NULL);
+	if (lua_isnil(L, errors)) {
+		lua_newtable(L);
+		lua_replace(L, errors);
+	}
+	lua_createtable(L, 0, 4);
+	lua_pushstring(L, f->name);
+	lua_setfield(L, -2, "field");
+	lua_pushstring(L, code);
+	lua_setfield(L, -2, "error");
+	cpush_typename(L, f);
+	lua_setfield(L, -2, "type");
+	lua_pushstring(L, actual);
+	lua_setfield(L, -2, "actual");
+	lua_rawseti(L, errors, lua_rawlen(L, errors) + 1);
+}
+
+// check the value at the top, the same rules as proto_builder.validate
+static int
+cvalidate(lua_State *L, int errors, const struct cfield *f) {
+	int t = lua_type(L, -1);
+	int expected;
+	if (f->array) {
+		if (t != LUA_TTABLE) {
+			cvalidate_error(L, errors, f, "type");
+			return 0;
+		}
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			lua_pop(L, 1);
+			if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1) {
+				lua_pop(L, 1);
+				cvalidate_error(L, errors, f, "index");
+				return 0;
+			}
+		}
+		return 1;
+	}
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+	case SPROTO_TDOUBLE:
+		expected = LUA_TNUMBER;
+		break;
+	case SPROTO_TBOOLEAN:
+		expected = LUA_TBOOLEAN;
+		break;
+	case SPROTO_TSTRING:
+		expected = LUA_TSTRING;
+		break;
+	default:
+		expected = LUA_TTABLE;
+		break;
+	}
+	if (t != expected) {
+		cvalidate_error(L, errors, f, "type");
+		return 0;
+	}
+	return 1;
+}
+
+struct cencode_ud {
+	lua_State *L;
+	int keys;
+	int errors;	// the error list of validate, 0 if the program doesn't validate
+};
+
+static inline int
+cfill_size(uint8_t * data, int sz) {
+	data[0] = sz & 0xff;
+	data[1] = (sz >> 8) & 0xff;
+	data[2] = (sz >> 16) & 0xff;
+	data[3] = (sz >> 24) & 0xff;
+	return sz + SIZEOF_LENGTH;
+}
+
+static inline void
+write_uint64(uint8_t *data, uint64_t v) {
+	data[0] = v & 0xff;
+	data[1] = (v >> 8) & 0xff;
+	data[2] = (v >> 16) & 0xff;
+	data[3] = (v >> 24) & 0xff;
+	data[4] = (v >> 32) & 0xff;
+	data[5] = (v >> 40) & 0xff;
+	data[6] = (v >> 48) & 0xff;
+	data[7] = (v >> 56) & 0xff;
+}
+
+// the integer/double/boolean at the top, return 4 or 8 bytes like encode_one
+static int
+cencode_number(lua_State *L, const struct cfield *f, int index, uint64_t *u) {
+	switch (f->type) {
+	case SPROTO_TINTEGER: {
+		int64_t v;
+		lua_Integer vh;
+		int isnum;
+		if (f->extra) {
+			lua_Number vn = lua_tonumber(L, -1);
+			v = (int64_t)(round(vn * f->extra));
+		} else {
+			v = tointegerx(L, -1, &isnum);
+			if(!isnum) {
+				return luaL_error(L, ".%s[%d] is not an integer (Is a %s)",
+					f->name, index, lua_typename(L, lua_type(L, -1)));
+			}
+		}
+		*u = (uint64_t)v;
+		vh = v >> 31;
+		if (vh == 0 || vh == -1) {
+			return 4;
+		}
+		return 8;
+	}
+	case SPROTO_TDOUBLE: {
+		double v = (double)lua_tonumber(L, -1);
+		memcpy(u, &v, sizeof(v));
+		return 8;
+	}
+	default: {
+		int isbool;
+		int v = tobooleanx(L, -1, &isbool);
+		if (!isbool) {
+			return luaL_error(L, ".%s[%d] is not a boolean (Is a %s)",
+				f->name, index, lua_typename(L, lua_type(L, -1)));
+		}
+		*u = v;
+		return 4;
+	}
+	}
+}
+
+static int cencode_struct(struct cencode_ud *ud, const struct cprogram *p, int tbl, uint8_t *buffer, int size, int deep);
+
+// the object at the top, write it with the length prefix
+static int
+cencode_object(struct cencode_ud *ud, const struct cfield *f, int index, uint8_t *data, int size, int deep) {
+	lua_State *L = ud->L;
+	int sz;
+	if (size < SIZEOF_LENGTH)
+		return -1;
+	if (f->type == SPROTO_TSTRING) {
+		size_t len = 0;
+		int isstring;
+		int type = lua_type(L, -1);
+		const char * str = tolstringx(L, -1, &len, &isstring);
+		if (!isstring) {
+			return luaL_error(L, ".%s[%d] is not a string (Is a %s)",
+				f->name, index, lua_typename(L, type));
+		}
+		if (len > size - SIZEOF_LENGTH)
+			return -1;
+		memcpy(data + SIZEOF_LENGTH, str, len);
+		sz = (int)len;
+	} else {
+		sz = cencode_struct(ud, f->sub, lua_gettop(L), data + SIZEOF_LENGTH, size - SIZEOF_LENGTH, deep + 1);
+		if (sz < 0)
+			return -1;
+	}
+	return cfill_size(data, sz);
+}
+
+// the array at the top
+static int
+cencode_array(struct cencode_ud *ud, const struct cfield *f, uint8_t *data, int size, int deep) {
+	lua_State *L = ud->L;
+	int array = lua_gettop(L);
+	uint8_t * buffer = data + SIZEOF_LENGTH;
+	int i;
+	if (!lua_istable(L, array)) {
+		if (luaL_getmetafield(L, array, "__pairs") == LUA_TNIL) {
+			return luaL_error(L, ".*%s(%d) should be a table or an userdata with metamethods (Is a %s)",
+				f->name, 1, lua_typename(L, lua_type(L, array)));
+		}
+		lua_pop(L, 1);
+	}
+	if (size < SIZEOF_LENGTH)
+		return -1;
+	size -= SIZEOF_LENGTH;
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+	case SPROTO_TDOUBLE: {
+		// write 8 bytes each, and shrink to 4 bytes if all of them fit
+		int intlen = f->type == SPROTO_TDOUBLE ? 8 : 4;
+		int n = 0;
+		for (i=1;;i++) {
+			uint64_t u;
+			if (lua_geti(L, array, i) == LUA_TNIL) {
+				lua_pop(L, 1);
+				break;
+			}
+			if (size < 1 + (n + 1) * 8)
+				return -1;
+			if (cencode_number(L, f, i, &u) == 8)
+				intlen = 8;
+			lua_pop(L, 1);
+			write_uint64(buffer + 1 + n * 8, u);
+			++n;
+		}
+		if (n == 0)
+			break;
+		buffer[0] = (uint8_t)intlen;
+		if (intlen == 4) {
+			for (i=0;i<n;i++) {
+				memmove(buffer + 1 + i * 4, buffer + 1 + i * 8, 4);
+			}
+		}
+		buffer += 1 + n * intlen;
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		for (i=1;;i++) {
+			uint64_t u;
+			if (lua_geti(L, array, i) == LUA_TNIL) {
+				lua_pop(L, 1);
+				break;
+			}
+			if (size < 1)
+				return -1;
+			cencode_number(L, f, i, &u);
+			lua_pop(L, 1);
+			*buffer++ = u ? 1 : 0;
+			--size;
+		}
+		break;
+	default:
+		for (i=1;;i++) {
+			int sz;
+			if (lua_geti(L, array, i) == LUA_TNIL) {
+				lua_pop(L, 1);
+				break;
+			}
+			sz = cencode_object(ud, f, i, buffer, size, deep);
+			if (sz < 0)
+				return -1;
+			lua_settop(L, array);
+			buffer += sz;
+			size -= sz;
+		}
+		break;
+	}
+	return cfill_size(data, buffer - (data + SIZEOF_LENGTH));
+}
+
+static int
+cencode_struct(struct cencode_ud *ud, const struct cprogram *p, int tbl, uint8_t *buffer, int size, int deep) {
+	lua_State *L = ud->L;
+	int header_sz = SIZEOF_HEADER + p->maxn * SIZEOF_FIELD;
+	uint8_t * data;
+	int index = 0;
+	int lasttag = -1;
+	int top = lua_gettop(L);
+	int datasz;
+	int i;
+	if (deep >= ENCODE_DEEPLEVEL)
+		return luaL_error(L, "The table is too deep");
+	if (size < header_sz)
+		return -1;
+	luaL_checkstack(L, 8, NULL);
+	data = buffer + header_sz;
+	size -= header_sz;
+	for (i=0;i<p->n;i++) {
+		const struct cfield *f = &p->f[i];
+		int value = 0;
+		int sz;
+		lua_rawgeti(L, ud->keys, f->key);
+		if (lua_gettable(L, tbl) == LUA_TNIL) {
+			if (deep == 0 && ud->errors)
+				cvalidate_error(L, ud->errors, f, "required");
+			lua_pop(L, 1);
+			continue;
+		}
+		if (deep == 0 && ud->errors && !cvalidate(L, ud->errors, f)) {
+			lua_settop(L, top);
+			continue;
+		}
+		if (f->array) {
+			sz = cencode_array(ud, f, data, size, deep);
+		} else if (f->type == SPROTO_TSTRING || f->type == SPROTO_TSTRUCT) {
+			sz = cencode_object(ud, f, 0, data, size, deep);
+		} else {
+			uint64_t u;
+			sz = cencode_number(L, f, 0, &u);
+			if (sz == 4 && (uint32_t)u < 0x7fff) {
+				value = ((uint32_t)u + 1) * 2;
+			} else if (size < SIZEOF_LENGTH + sz) {
+				sz = -1;
+			} else {
+				uint8_t tmp[8];
+				write_uint64(tmp, u);
+				memcpy(data + SIZEOF_LENGTH, tmp, sz);
+				sz = cfill_size(data, sz);
+			}
+		}
+		lua_settop(L, top);
+		if (sz < 0)
+			return -1;
+		if (sz > 0) {
+			uint8_t * record;
+			int tag;
+			if (value == 0) {
+				data += sz;
+				size -= sz;
+			}
+			record = buffer+SIZEOF_HEADER+SIZEOF_FIELD*index;
+			tag = f->tag - lasttag - 1;
+			if (tag > 0) {
+				// skip tag
+				tag = (tag - 1) * 2 + 1;
+				if (tag > 0xffff)
+					return luaL_error(L, "Invalid tag %d in %s", f->tag, f->name);
+				record[0] = tag & 0xff;
+				record[1] = (tag >> 8) & 0xff;
+				++index;
+				record += SIZEOF_FIELD;
+			}
+			++index;
+			record[0] = value & 0xff;
+			record[1] = (value >> 8) & 0xff;
+			lasttag = f->tag;
+		}
+	}
+	buffer[0] = index & 0xff;
+	buffer[1] = (index >> 8) & 0xff;
+
+	datasz = data - (buffer + header_sz);
+	if (index != p->maxn) {
+		memmove(buffer + SIZEOF_HEADER + index * SIZEOF_FIELD, buffer + header_sz, datasz);
+	}
+	return SIZEOF_HEADER + index * SIZEOF_FIELD + datasz;
+}
+
+static int
+cencode(lua_State *L) {
+	struct cencode_ud ud;
+	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
+	int sz = lua_tointeger(L, lua_upvalueindex(2));
+	const struct cprogram * p = lua_touserdata(L, 1);
+	int tbl_index = 2;
+	lua_settop(L, tbl_index);
+	lua_getiuservalue(L, 1, 1);
+	ud.L = L;
+	ud.keys = tbl_index + 1;
+	ud.errors = p->validate ? ud.keys + 1 : 0;
+	for (;;) {
+		int r;
+		lua_settop(L, ud.keys);
+		if (ud.errors)
+			lua_pushnil(L);
+		r = cencode_struct(&ud, p, tbl_index, buffer, sz, 0);
+		if (r<0) {
+			buffer = expand_buffer(L, sz, sz*2);
+			sz *= 2;
+		} else {
+			if (ud.errors && !lua_isnil(L, ud.errors)) {
+				// raise the error list
+				lua_pushvalue(L, ud.errors);
+				return lua_error(L);
+			}
+			lua_pushlstring(L, buffer, r);
+			return 1;
+		}
+	}
+}
+
+static inline uint32_t
+ctodword(const uint8_t *p) {
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+static inline uint64_t
+cexpand64(uint32_t v) {
+	uint64_t value = v;
+	if (value & 0x80000000) {
+		value |= (uint64_t)~0  << 32 ;
+	}
+	return value;
+}
+
+static const struct cfield *
+cfindtag(const struct cprogram *p, int tag) {
+	int begin = 0;
+	int end = p->n;
+	while (begin < end) {
+		int mid = (begin+end)/2;
+		int t = p->f[mid].tag;
+		if (t == tag)
+			return &p->f[mid];
+		if (tag > t) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return NULL;
+}
+
+static void
+cpush_number(lua_State *L, const struct cfield *f, uint64_t v) {
+	switch (f->type) {
+	case SPROTO_TINTEGER:
+		if (f->extra) {
+			lua_Number vn = (lua_Number)(int64_t)v;
+			lua_pushnumber(L, vn / f->extra);
+		} else {
+			lua_pushinteger(L, (int64_t)v);
+		}
+		break;
+	case SPROTO_TDOUBLE: {
+		double d;
+		memcpy(&d, &v, sizeof(d));
+		lua_pushnumber(L, d);
+		break;
+	}
+	default:
+		lua_pushboolean(L, (int)v);
+		break;
+	}
+}
+
+static int cdecode_struct(lua_State *L, int keys, const struct cprogram *p, const uint8_t *stream, int size, int result, int deep);
+
+static int
+cpush_object(lua_State *L, int keys, const struct cfield *f, const uint8_t *data, int sz, int deep) {
+	if (f->type == SPROTO_TSTRING) {
+		lua_pushlstring(L, (const char *)data, sz);
+		return 0;
+	}
+	lua_createtable(L, 0, f->sub->n);
+	if (cdecode_struct(L, keys, f->sub, data, sz, lua_gettop(L), deep + 1) != sz)
+		return -1;
+	return 0;
+}
+
+// push the array decoded from stream (with the length prefix)
+static int
+cdecode_array(lua_State *L, int keys, const struct cfield *f, const uint8_t *stream, int deep) {
+	uint32_t sz = ctodword(stream);
+	int i;
+	stream += SIZEOF_LENGTH;
+	switch (f->type) {
+	case SPROTO_TDOUBLE:
+	case SPROTO_TINTEGER: {
+		int len;
+		int n;
+		if (sz <= 1) {
+			// An empty array, maybe with a len prefix
+			lua_newtable(L);
+			return 0;
+		}
+		len = *stream++;
+		--sz;
+		if ((len != 4 && len != 8) || sz % len != 0)
+			return -1;
+		n = sz / len;
+		lua_createtable(L, n, 0);
+		for (i=0;i<n;i++) {
+			uint64_t v;
+			if (len == 4) {
+				v = cexpand64(ctodword(stream + i * 4));
+			} else {
+				v = (uint64_t)ctodword(stream + i * 8) | (uint64_t)ctodword(stream + i * 8 + 4) << 32;
+			}
+			cpush_number(L, f, v);
+			lua_rawseti(L, -2, i + 1);
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		lua_createtable(L, sz, 0);
+		for (i=0;i<sz;i++) {
+			lua_pushboolean(L, stream[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		break;
+	default: {
+		int index = 1;
+		lua_newtable(L);
+		while (sz > 0) {
+			uint32_t hsz;
+			if (sz < SIZEOF_LENGTH)
+				return -1;
+			hsz = ctodword(stream);
+			stream += SIZEOF_LENGTH;
+			sz -= SIZEOF_LENGTH;
+			if (hsz > sz)
+				return -1;
+			if (cpush_object(L, keys, f, stream, hsz, deep))
+				return -1;
+			lua_rawseti(L, -2, index++);
+			sz -= hsz;
+			stream += hsz;
+		}
+		break;
+	}
+	}
+	return 0;
+}
+
+static int
+cdecode_struct(lua_State *L, int keys, const struct cprogram *p, const uint8_t *stream, int size, int result, int deep) {
+	int total = size;
+	const uint8_t * datastream;
+	int fn;
+	int i;
+	int tag;
+	if (deep >= ENCODE_DEEPLEVEL)
+		return luaL_error(L, "The table is too deep");
+	if (size < SIZEOF_HEADER)
+		return -1;
+	luaL_checkstack(L, 8, NULL);
+	fn = stream[0] | stream[1] << 8;
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER;
+	if (size < fn * SIZEOF_FIELD)
+		return -1;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		const uint8_t * currentdata;
+		const struct cfield * f;
+		int value = stream[i * SIZEOF_FIELD] | stream[i * SIZEOF_FIELD + 1] << 8;
+		uint32_t sz = 0;
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		value = value/2 - 1;
+		currentdata = datastream;
+		if (value < 0) {
+			if (size < SIZEOF_LENGTH)
+				return -1;
+			sz = ctodword(datastream);
+			if (size < sz + SIZEOF_LENGTH)
+				return -1;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		f = cfindtag(p, tag);
+		if (f == NULL)
+			continue;
+		lua_rawgeti(L, keys, f->key);
+		if (value >= 0) {
+			if (f->array || (f->type != SPROTO_TINTEGER && f->type != SPROTO_TBOOLEAN))
+				return -1;
+			cpush_number(L, f, value);
+		} else if (f->array) {
+			if (cdecode_array(L, keys, f, currentdata, deep))
+				return -1;
+		} else if (f->type == SPROTO_TSTRING || f->type == SPROTO_TSTRUCT) {
+			if (cpush_object(L, keys, f, currentdata + SIZEOF_LENGTH, sz, deep))
+				return -1;
+		} else if (f->type == SPROTO_TBOOLEAN) {
+			return -1;
+		} else if (sz == 4) {
+			cpush_number(L, f, cexpand64(ctodword(currentdata + SIZEOF_LENGTH)));
+		} else if (sz == 8) {
+			cpush_number(L, f, (uint64_t)ctodword(currentdata + SIZEOF_LENGTH) | (uint64_t)ctodword(currentdata + SIZEOF_LENGTH + 4) << 32);
+		} else {
+			return -1;
+		}
+		lua_settable(L, result);
+	}
+	return total - size;
+}
+
+static int
+cdecode(lua_State *L) {
+	const struct cprogram * p = lua_touserdata(L, 1);
+	const void * buffer;
+	size_t sz = 0;
+	int result;
+	int r;
+	buffer = getbuffer(L, 2, &sz);
+	if (!lua_istable(L, -1)) {
+		lua_createtable(L, 0, p->n);
+	}
+	result = lua_gettop(L);
+	lua_getiuservalue(L, 1, 1);
+	r = cdecode_struct(L, result + 1, p, buffer, (int)sz, result, 0);
+	if (r < 0) {
+		return luaL_error(L, "decode error");
+	}
+	if (p->validate) {
+		int errors = result + 2;
+		int i;
+		lua_settop(L, result + 1);
+		lua_pushnil(L);
+		for (i=0;i<p->n;i++) {
+			lua_rawgeti(L, result + 1, p->f[i].key);
+			if (lua_gettable(L, result) == LUA_TNIL) {
+				cvalidate_error(L, errors, &p->f[i], "required");
+			}
+			lua_pop(L, 1);
+		}
+		if (!lua_isnil(L, errors)) {
+			return lua_error(L);
+		}
+	}
+	lua_settop(L, result);
+	lua_pushinteger(L, r);
+	return 2;
+}
+
 static int
 ldumpproto(lua_State *L) {
 	struct sproto * sp = lua_touserdata(L, 1);
@@ -856,6 +1647,10 @@ ldefault(lua_State *L) {
 	// 64 is always enough for dummy buffer, except the type has many fields ( > 27).
 	char dummy[64];
 	struct sproto_type * st = lua_touserdata(L, 1);
+	if (lua_type(L, 1) == LUA_TUSERDATA) {
+		// compiled program
+		st = ((struct cprogram *)st)->st;
+	}
 	if (st == NULL) {
 		return luaL_argerror(L, 1, "Need a sproto_type object");
 	}
@@ -893,6 +1688,7 @@ luaopen_sproto_core(lua_State *L) {
 		{ "loadproto", lloadproto },
 		{ "saveproto", lsaveproto },
 		{ "default", ldefault },
+		{ "compile", lcompile },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -643,6 +643,29 @@ sproto_name(struct sproto_type * st) {
 	return st->name;
 }
 
+int
+sproto_fieldn(const struct sproto_type *st, int *maxn) {
+	if (maxn)
+		*maxn = st->maxn;
+	return st->n;
+}
+
+int
+sproto_field(const struct sproto_type *st, int index, struct sproto_field *field) {
+	struct field *f;
+	if (index < 0 || index >= st->n)
+		return -1;
+	f = &st->f[index];
+	field->name = f->name;
+	field->tag = f->tag;
+	field->type = f->type;
+	field->subtype = f->st;
+	field->mainindex = f->key;
+	field->map = f->map;
+	field->extra = f->extra;
+	return 0;
+}
+
 static struct field *
 findtag(const struct sproto_type *st, int tag) {
 	int begin, end;
@@ -63,6 +63,20 @@ typedef int (*sproto_callback)(const struct sproto_arg *args);
 int sproto_decode(const struct sproto_type *, const void * data, int size, sproto_callback cb, void *ud);
 int sproto_encode(const struct sproto_type *, void * buffer, int size, sproto_callback cb, void *ud);
 
+// query the fields of a type, for the compiled encoder/decoder
+struct sproto_field {
+	const char *name;
+	int tag;
+	int type;	// with SPROTO_TARRAY
+	struct sproto_type *subtype;
+	int mainindex;
+	int map;
+	int extra;
+};
+
+int sproto_fieldn(const struct sproto_type *, int *maxn);
+int sproto_field(const struct sproto_type *, int index, struct sproto_field *);
+
 // for debug use
 void sproto_dump(struct sproto *);
 const char * sproto_name(struct sproto_type *);
@@ -73,7 +73,7 @@ local fork_queue = { h = 1, t = 0 }
 local auxsend, auxtimeout, auxwait
 do ---- avoid session rewind conflict
 	local csend = c.send
-	local cintcommand = c.intcommand
+	local ctimeout = c.timeout
 	local dangerzone
 	local dangerzone_size = 0x1000
 	local dangerzone_low = 0x70000000
@@ -135,7 +135,7 @@ do ---- avoid session rewind conflict
 	end
 
 	local function auxtimeout_checkconflict(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+		local session = ctimeout(timeout)
 		checkconflict(session)
 		return session
 	end
@@ -156,7 +156,7 @@ do ---- avoid session rewind conflict
 	end
 
 	local function auxtimeout_checkrewind(timeout)
-		local session = cintcommand("TIMEOUT", timeout)
+		local session = ctimeout(timeout)
 		if session and session > dangerzone_low and session <= dangerzone_up then
 			-- enter dangerzone
 			set_checkconflict(session)
@@ -499,7 +499,25 @@ function skynet.timeout(ti, func)
 	local co = co_create_for_timeout(func, ti)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
-	return co	-- for debug
+	return co, session	-- co for debug, session for skynet.cancel_timeout
+end
+
+-- Cancel the timer created by skynet.timeout, returns false if the function is called already.
+function skynet.cancel_timeout(session)
+	local co = session_id_coroutine[session]
+	if type(co) ~= "thread" then
+		return false
+	end
+	if c.canceltimeout(session) then
+		session_id_coroutine[session] = nil
+	else
+		-- the timer message is on the way, ignore it
+		session_id_coroutine[session] = "BREAK"
+	end
+	if timeout_traceback then
+		timeout_traceback[co] = nil
+	end
+	return true
 end
 
 local function suspend_sleep(session, token)
@@ -707,6 +725,8 @@ end
 
 skynet.pack = assert(c.pack)
 skynet.packstring = assert(c.packstring)
+-- smaller for the records with the same keys, skynet.unpack unpacks it too
+skynet.packcompact = assert(c.packcompact)
 skynet.unpack = assert(c.unpack)
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
@@ -0,0 +1,139 @@
+local skynet = require "skynet"
+local stm = require "skynet.stm"
+local setmetatable = setmetatable
+local getmetatable = getmetatable
+
+-- An immutable message packed once and shared by many services without copy.
+-- The receivers get a pointer, sharemsg.open it, and decode it only when the fields are accessed.
+
+local sharemsg = {}
+
+function sharemsg.pack(...)
+	return stm.share(skynet.packcompact(...))
+end
+
+-- the shared message is a pointer, it can't be sent to the other nodes
+local function isremote(addr)
+	if type(addr) == "string" then
+		local c = addr:byte()
+		if c == 46 then	-- "." , local name
+			return false
+		end
+		if c ~= 58 then	-- global name
+			return true
+		end
+		addr = tonumber(addr:sub(2), 16)	-- ":" , hex address
+		if addr == nil then
+			return true
+		end
+	end
+	local _, remote = skynet.harbor(addr)
+	return remote
+end
+
+local function send_remote(addrs, typename, obj, args)
+	-- the other nodes get a copy of the message as a string
+	args[args.n] = obj(skynet.tostring)
+	local msg = skynet.packstring(table.unpack(args, 1, args.n))
+	local count = 0
+	for _, addr in ipairs(addrs) do
+		if skynet.rawsend(addr, typename, msg) then
+			count = count + 1
+		end
+	end
+	return count
+end
+
+-- Send (..., ptr) to one address or a list of addresses, ptr is the shared message of obj.
+-- The receiver must sharemsg.open(ptr), or the message is never released.
+-- The addresses of the other nodes get (..., str), str is a copy of the message, sharemsg.open(str) works too.
+function sharemsg.send(addrs, typename, obj, ...)
+	if type(addrs) ~= "table" then
+		addrs = { addrs }
+	end
+	local args = table.pack(...)
+	args.n = args.n + 1
+	local locals = {}
+	local remotes
+	for _, addr in ipairs(addrs) do
+		if isremote(addr) then
+			remotes = remotes or {}
+			remotes[#remotes + 1] = addr
+		else
+			locals[#locals + 1] = addr
+		end
+	end
+	local count = remotes and send_remote(remotes, typename, obj, args) or 0
+	local n = #locals
+	if n == 0 then
+		return count
+	end
+	-- each address owns one reference after the message is pushed to it, the others are released even if it raises an error
+	local ptr = stm.ref(obj, n)
+	local pushed = 0
+	local ok, err = pcall(function()
+		args[args.n] = ptr
+		-- the small header is copied by skynet.rawsend for each address
+		local msg = skynet.packstring(table.unpack(args, 1, args.n))
+		for i = 1, n do
+			if skynet.rawsend(locals[i], typename, msg) then
+				pushed = pushed + 1
+			end
+		end
+	end)
+	if pushed < n then
+		stm.unref(ptr, n - pushed)
+	end
+	if not ok then
+		error(err)
+	end
+	return count + pushed
+end
+
+function sharemsg.open(ptr)
+	local box
+	if type(ptr) == "string" then
+		-- from the other node
+		box = function(f, ud)
+			return f(ptr, #ptr, ud)
+		end
+	else
+		box = stm.open(ptr)
+	end
+	local values
+	local function load()
+		if values == nil then
+			values = table.pack(box(skynet.unpack))
+		end
+		return values
+	end
+	-- index the first value of the message, decode on first access
+	return setmetatable({}, {
+		__index = function(_, k)
+			return load()[1][k]
+		end,
+		__len = function()
+			return #load()[1]
+		end,
+		__pairs = function()
+			return next, load()[1], nil
+		end,
+		__newindex = error,
+		__box = box,
+		__load = load,
+	})
+end
+
+-- all the values of the message
+function sharemsg.unpack(view)
+	local values = getmetatable(view).__load()
+	return table.unpack(values, 1, values.n)
+end
+
+-- f(msg, sz, ud) reads the packed message without decode, ie. forward it as is.
+-- msg is a string if the message is from the other node.
+function sharemsg.read(view, f, ud)
+	return getmetatable(view).__box(f, ud)
+end
+
+return sharemsg
@@ -1,6 +1,5 @@
 local driver = require "skynet.socketdriver"
 local skynet = require "skynet"
-local skynet_core = require "skynet.core"
 local assert = assert
 
 local BUFFER_LIMIT = 128 * 1024
@@ -177,7 +176,7 @@ socket_message[6] = function(id, size, data, address)
 		return
 	end
 	local str = skynet.tostring(data, size)
-	skynet_core.trash(data, size)
+	driver.drop(data, size)
 	s.callback(str, address)
 end
 
@@ -198,9 +197,26 @@ socket_message[7] = function(id, size)
 	end
 end
 
+-- SKYNET_SOCKET_TYPE_UDP_BATCH = 8
+socket_message[8] = function(id, size, data)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		skynet.error("socket: drop udp package from " .. id)
+		driver.drop(data, size)
+		return
+	end
+	local batch = driver.udp_batch(data, size)
+	driver.drop(data, size)
+	local callback = s.callback
+	for i = 1, #batch, 2 do
+		callback(batch[i], batch[i+1])
+	end
+end
+
 skynet.register_protocol {
 	name = "socket",
 	id = skynet.PTYPE_SOCKET,	-- PTYPE_SOCKET = 6
+	-- the data of socket message is from the socket pool, release it by driver.drop (or driver.push), not skynet.trash
 	unpack = driver.unpack,
 	dispatch = function (_, _, t, ...)
 		socket_message[t](...)
@@ -394,6 +410,14 @@ end
 socket.write = assert(driver.send)
 socket.lwrite = assert(driver.lsend)
 socket.header = assert(driver.header)
+-- socket.shared(data) returns a refcounted buffer, write it to many sockets without copying the data.
+socket.shared = assert(driver.shared)
+-- socket.write_multi({ id1, id2, ... }, data) queues data to the sockets in one request per socket thread.
+socket.write_multi = assert(driver.send_multi)
+socket.lwrite_multi = assert(driver.lsend_multi)
+-- socket.watermark(id, high, low) : when the write buffer reaches high bytes, the low priority (lwrite) packages are dropped
+-- and the socket stops reading until the buffer drains to low (default high/2). high = 0 turns it off.
+socket.watermark = assert(driver.watermark)
 
 function socket.invalid(id)
 	return socket_pool[id] == nil
@@ -423,6 +447,47 @@ function socket.listen(host, port, backlog)
 	return id, s.addr, s.port
 end
 
+-- listen n sockets on the same port (SO_REUSEPORT), they are spread over the socket threads.
+-- policy is "hash" (default) or "cpu", returns the ids of the listen sockets.
+function socket.listen_reuseport(host, port, n, backlog, policy)
+	if port == nil then
+		host, port = string.match(host, "([^:]+):(.+)$")
+		port = tonumber(port)
+	end
+	local ids = driver.listen_reuseport(host, port, n, backlog, policy)
+	for _, id in ipairs(ids) do
+		assert(socket_pool[id] == nil)
+		socket_pool[id] = {
+			id = id,
+			connected = false,
+			connecting = true,	-- set to the error message if listen failed
+			listen = true,
+		}
+	end
+	local addr, listen_port, err
+	for _, id in ipairs(ids) do
+		local s = socket_pool[id]
+		-- the messages of the other listeners may arrive when waiting the previous one
+		if not s.connected and s.connecting == true then
+			suspend(s)
+		end
+		if s.connected then
+			addr, listen_port = s.addr, s.port
+		else
+			err = err or s.connecting
+		end
+		s.connecting = nil
+	end
+	if err then
+		-- close all the listeners, the failed ones are shutdown already
+		for _, id in ipairs(ids) do
+			socket.close(id)
+		end
+		error(string.format("Listen reuseport %s:%s failed : %s", host, port, tostring(err)))
+	end
+	return ids, addr, listen_port
+end
+
 -- abandon use to forward socket id to other service
 -- you must call socket.start(id) later in other service
 function socket.abandon(id)
@@ -486,6 +551,8 @@ end
 socket.sendto = assert(driver.udp_send)
 socket.udp_address = assert(driver.udp_address)
 socket.netstat = assert(driver.info)
+-- the counts of the write buffer sizes when the packages are queued, [1] is [0,1K), [i] is [2^(i-2)K, 2^(i-1)K)
+socket.histogram = assert(driver.histogram)
 socket.resolve = assert(driver.resolve)
 
 function socket.warning(id, callback)
@@ -12,6 +12,7 @@ local maxclient	-- max client
 local client_number = 0
 local CMD = setmetatable({}, { __gc = function() netpack.clear(queue) end })
 local nodelay = false
+local watermark	-- { high, low } of the write buffer
 
 local connection = {}
 -- true : connected
@@ -44,8 +45,17 @@ function gateserver.start(handler)
 		local port = assert(conf.port)
 		maxclient = conf.maxclient or 1024
 		nodelay = conf.nodelay
+		if conf.watermark then
+			-- drop the low priority packages to the slow clients, and stop reading from them
+			watermark = { conf.watermark, conf.watermark_low }
+		end
 		log.info(string.format("Listen on %s:%d", address, port))
-		socket = socketdriver.listen(address, port, conf.backlog)
+		if conf.reuseport then
+			-- several gate instances can listen on the same port, the kernel spreads the connections over them.
+			socket = socketdriver.listen_reuseport(address, port, 1, conf.backlog)[1]
+		else
+			socket = socketdriver.listen(address, port, conf.backlog)
+		end
 		listen_context.co = coroutine.running()
 		listen_context.fd = socket
 		skynet.wait(listen_context.co)
@@ -100,6 +110,9 @@ function gateserver.start(handler)
 		if nodelay then
 			socketdriver.nodelay(fd)
 		end
+		if watermark then
+			socketdriver.watermark(fd, watermark[1], watermark[2])
+		end
 		connection[fd] = true
 		handler.connect(fd, msg)
 	end
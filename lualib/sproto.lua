@@ -37,11 +37,43 @@ function sproto.parse(ptext)
 	return sproto.new(pbin)
 end
 
+-- compile the type into a flat field program, if the compiled mode is on
+local function compile(self, st, validate)
+	local cache = self.__ccache
+	if cache and st then
+		return core.compile(st, cache, validate)
+	end
+	return st
+end
+
+-- turn on the compiled mode: encode/decode run the programs of the types directly
+-- With validate, the requests of the protocols are validated while encoding and decoding:
+-- all the fields are required and checked by lua type, the error raised is a list of
+-- { field = name, error = "required"|"type"|"index", type = sproto type, actual = lua type }
+-- The types with a map or a main index array can't be compiled, compile(true) raises an error for them.
+function sproto:compile(validate)
+	if not self.__ccache then
+		self.__validate = validate
+		self.__ccache = {}
+		self.__tcache = setmetatable( {} , weak_mt )
+		self.__pcache = setmetatable( {} , weak_mt )
+		if validate then
+			-- compile all the requests now, don't raise the error on the first message
+			for tag = 0, 0xffff do
+				if core.protocol(self.__cobj, tag) then
+					sproto.queryproto(self, tag)
+				end
+			end
+		end
+	end
+	return self
+end
+
 function sproto:host( packagename )
 	packagename = packagename or  "package"
 	local obj = {
 		__proto = self,
-		__package = assert(core.querytype(self.__cobj, packagename), "type package not found"),
+		__package = compile(self, assert(core.querytype(self.__cobj, packagename), "type package not found")),
 		__session = {},
 	}
 	return setmetatable(obj, host_mt)
@@ -50,7 +82,7 @@ end
 local function querytype(self, typename)
 	local v = self.__tcache[typename]
 	if not v then
-		v = assert(core.querytype(self.__cobj, typename), "type not found")
+		v = compile(self, assert(core.querytype(self.__cobj, typename), "type not found"))
 		self.__tcache[typename] = v
 	end
 
@@ -95,8 +127,8 @@ local function queryproto(self, pname)
 			pname, tag = tag, pname
 		end
 		v = {
-			request = req,
-			response =resp,
+			request = compile(self, req, self.__validate),
+			response = compile(self, resp),
 			name = pname,
 			tag = tag,
 		}
@@ -37,5 +37,11 @@ linux freebsd : SKYNET_LIBS += -lrt
 macosx : MALLOC_STATICLIB :=
 macosx : SKYNET_DEFINES :=-DNOUSE_JEMALLOC
 
+# Use io_uring instead of epoll on linux (kernel 6.0+) : make linux IO_URING=1
+
+ifeq ($(IO_URING),1)
+linux : SKYNET_DEFINES += -DUSE_IO_URING
+endif
+
 linux macosx freebsd :
 	$(MAKE) all PLAT=$@ SKYNET_LIBS="$(SKYNET_LIBS)" SHARED="$(SHARED)" EXPORT="$(EXPORT)" MALLOC_STATICLIB="$(MALLOC_STATICLIB)" SKYNET_DEFINES="$(SKYNET_DEFINES)"
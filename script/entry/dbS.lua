@@ -1,2 +1,2 @@
 local bootstrap = require "entry._bootstrap"
-bootstrap("service.db_service", { name = "db", register_hotfix = false })
+bootstrap("service.db_service", { name = "db", register_hotfix = false, compact = true })
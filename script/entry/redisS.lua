@@ -3,7 +3,7 @@ local redis_service = require "service.redis_service"
 
 skynet.start(function()
     skynet.dispatch("lua", function(session, source, cmd, ...)
-        skynet.ret(skynet.pack(redis_service.dispatch(cmd, ...)))
+        skynet.ret(skynet.packcompact(redis_service.dispatch(cmd, ...)))
     end)
     skynet.register(".redis")
 end)
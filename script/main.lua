@@ -54,6 +54,7 @@ skynet.start(function()
         address = "0.0.0.0",
         port = 8888,
         maxclient = 8192,
+        watermark = 256 * 1024,
     })
 
     skynet.exit()
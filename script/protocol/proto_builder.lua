@@ -242,6 +242,14 @@ function proto_builder:to_string()
     return table.concat(lines, "\n")
 end
 
+local type_map = {
+    integer = "number",
+    double = "number",
+    boolean = "boolean",
+    string = "string",
+    binary = "string",
+}
+
 local function validate_type(value, expected_type)
     if value == nil then
         return true
@@ -266,14 +274,6 @@ local function validate_type(value, expected_type)
         return true
     end
 
-    local type_map = {
-        integer = "number",
-        double = "number",
-        boolean = "boolean",
-        string = "string",
-        binary = "string",
-    }
-
     local lua_type = type_map[expected_type]
     if lua_type then
         if actual_type ~= lua_type then
@@ -324,4 +324,26 @@ function proto_builder.validate(protocol_name, data, schema)
     return true
 end
 
+-- 格式化 sproto 编译校验模式（sproto:compile(true)）在 C 层产生的错误列表，信息与 validate 一致
+-- errors: { { field = 字段名, error = "required"|"type"|"index", type = 期望类型, actual = 实际类型 }, ... }
+function proto_builder.format_errors(errors)
+    local msgs = {}
+    for i, e in ipairs(errors) do
+        local msg
+        if e.error == "required" then
+            msg = "不能为空"
+        elseif e.error == "index" then
+            msg = "数组格式不正确（应为数字索引从1开始）"
+        elseif e.type:match("^%*") then
+            msg = string.format("期望数组类型，实际类型: %s", e.actual)
+        elseif type_map[e.type] then
+            msg = string.format("期望类型: %s，实际类型: %s", e.type, e.actual)
+        else
+            msg = string.format("未知类型: %s", e.type)
+        end
+        msgs[i] = string.format("字段 '%s' %s", e.field, msg)
+    end
+    return table.concat(msgs, "; ")
+end
+
 return proto_builder
@@ -35,6 +35,17 @@ function protocol_handler.send_to_players(player_ids, name, data)
     return skynet.send(gate, "lua", "send_to_players", player_ids, name, data)
 end
 
+-- 批量发送可丢弃的消息（如位置同步），慢客户端可能收不到，且可能晚于之后发送的普通消息到达
+function protocol_handler.send_to_players_lossy(player_ids, name, data)
+    local gate = skynet.localname(".gate")
+    if not gate then
+        log.error("Gate service not available")
+        return false
+    end
+
+    return skynet.send(gate, "lua", "send_to_players_lossy", player_ids, name, data)
+end
+
 function protocol_handler.call_agent(player_id, name, data)
     local registerS = skynet.localname(".register")
     if not registerS then
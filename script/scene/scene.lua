@@ -5,6 +5,7 @@ local GridAOI = require "scene.grid_aoi"
 local Terrain = require "scene.terrain"
 local Simple2DNavMesh = require "scene.pathfinding.simple_2d_navmesh"
 local NPCMgr = require "scene.npc_mgr"
+local protocol_handler = require "protocol_handler"
 
 local Scene = class("Scene")
 
@@ -228,11 +229,16 @@ end
 
 -- 广播消息给场景中的所有实体
 function Scene:broadcast_message(message_name, message_data)
+    local player_ids = {}
     for _, entity in pairs(self.entities) do
         if entity.type == "player" then
-            entity:send_message(message_name, message_data)
+            player_ids[#player_ids + 1] = entity.id
         end
     end
+    if #player_ids > 0 then
+        -- 一次发给gate, gate编码一次并通过send_multi发送
+        protocol_handler.send_to_players(player_ids, message_name, message_data)
+    end
 end
 
 -- 寻路接口（使用Simple2DNavMesh）
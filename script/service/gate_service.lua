@@ -37,8 +37,16 @@ function M.reload_proto()
         log.error("reload_proto failed on s2c: %s", tostring(s2c_or_err))
         return false, tostring(s2c_or_err)
     end
-    local new_host = proto_or_err:host("package")
-    local new_sender = new_host:attach(s2c_or_err)
+    -- 编译模式：每个类型预编译为字段程序，收发包时直接执行，并在编解码时完成协议字段验证
+    -- 含 map 或主键数组的请求无法在编译模式下验证，compile(true) 会报错，不会静默跳过验证
+    local ok3, new_host, new_sender = pcall(function()
+        local h = proto_or_err:compile(true):host("package")
+        return h, h:attach(s2c_or_err:compile(true))
+    end)
+    if not ok3 then
+        log.error("reload_proto failed on compile: %s", tostring(new_host))
+        return false, tostring(new_host)
+    end
     host = new_host
     sender = new_sender
     M.host = host
@@ -47,31 +55,69 @@ function M.reload_proto()
     return true
 end
 
+-- validate and encode the message, return the package or nil
+-- the validation is fused into the sproto encoder, it raises the error list
+local function encode_message(fd, player_id, name, data)
+    if not name then
+        log.error("send_message: 协议名为空, fd=%d", fd)
+        return nil
+    end
+    local ok, resp = pcall(sender, name, data)
+    if not ok then
+        if type(resp) == "table" then
+            log.error("协议验证失败: fd=%d, player_id=%s, protocol=%s, error=%s, data=%s",
+                fd, tostring(player_id), name, proto_builder.format_errors(resp), tableUtils.serialize_table(data))
+        end
+        return nil
+    end
+    if not resp then
+        return nil
+    end
+    return string.pack(">s2", resp)
+end
+
 function M.send_message(fd, name, data)
     local c = connection[fd]
     if not c then
         return false
     end
-    if not name then
-        log.error("send_message: 协议名为空, fd=%d", fd)
+    local package = encode_message(fd, c.player_id, name, data)
+    if not package then
         return false
     end
-    local schema = proto_builder.get_send_to_client_schema(name)
-    if schema then
-        local ok, err_msg = proto_builder.validate(name, data, schema)
-        if not ok then
-            log.error("协议验证失败: fd=%d, player_id=%s, protocol=%s, error=%s, data=%s",
-                fd, tostring(c.player_id), name, err_msg, data and tableUtils.serialize_table(data) or "nil")
-            return false
+    message_count[name] = (message_count[name] or 0) + 1
+    socketdriver.send(fd, package)
+    return true
+end
+
+-- encode the message once, and queue it to all the fds by one request per socket thread
+-- the messages are high priority and keep the order with send_message, unless lossy is true:
+-- the lossy ones are low priority, they are dropped for the slow clients above the watermark
+local function send_multi(fds, name, data, lossy)
+    local targets = {}
+    local player_id
+    for _, fd in ipairs(fds) do
+        local c = connection[fd]
+        if c then
+            targets[#targets + 1] = fd
+            player_id = player_id or c.player_id
         end
     end
-    message_count[name] = (message_count[name] or 0) + 1
-    local ok, resp = pcall(sender, name, data)
-    if not ok or not resp then
-        return false
+    if #targets == 0 then
+        return 0
     end
-    socketdriver.send(fd, string.pack(">s2", resp))
-    return true
+    local package = encode_message(targets[1], player_id, name, data)
+    if not package then
+        return 0
+    end
+    local count
+    if lossy then
+        count = socketdriver.lsend_multi(targets, package)
+    else
+        count = socketdriver.send_multi(targets, package)
+    end
+    message_count[name] = (message_count[name] or 0) + count
+    return count
 end
 
 function M.send_error(fd, code, message)
@@ -113,14 +159,12 @@ function M.bound_agent(fd, account_key, agent)
     c.agent = agent
 end
 
-function M.broadcast_message(msg)
-    local count = 0
-    for fd, _ in pairs(connection) do
-        if M.send_message(fd, msg) then
-            count = count + 1
-        end
+function M.broadcast_message(name, data)
+    local fds = {}
+    for fd in pairs(connection) do
+        fds[#fds + 1] = fd
     end
-    return count
+    return send_multi(fds, name, data)
 end
 
 function M.register_player(fd, player_id)
@@ -191,16 +235,12 @@ function M.send_to_player(player_id, name, data)
 end
 
 function M.send_to_players(player_ids, name, data)
-    if type(player_ids) ~= "table" then
-        return 0
-    end
-    local count = 0
-    for _, player_id in ipairs(player_ids) do
-        if M.send_to_player(player_id, name, data) then
-            count = count + 1
-        end
-    end
-    return count
+    return send_multi(M.get_players_fd(player_ids), name, data)
+end
+
+-- 可丢弃的推送（如场景内的位置同步），低优先级发送，慢客户端超过水位时被丢弃，且不保证与其它消息的顺序
+function M.send_to_players_lossy(player_ids, name, data)
+    return send_multi(M.get_players_fd(player_ids), name, data, true)
 end
 
 function M.rpc_response(fd, session, data)
@@ -251,7 +291,14 @@ function M.handler_message(fd, msg, sz)
     end
     local data = skynet.tostring(msg, sz)
     local ok, msg_type, name, args, response_func, _, session = pcall(host.dispatch, host, data)
-    if not ok or not msg_type then
+    if not ok then
+        -- sproto 解码时验证失败，抛出错误列表
+        if type(msg_type) == "table" then
+            M.send_error(fd, 1003, "协议字段验证失败: " .. proto_builder.format_errors(msg_type))
+        end
+        return
+    end
+    if not msg_type then
         return
     end
     if msg_type == "REQUEST" then
@@ -259,14 +306,6 @@ function M.handler_message(fd, msg, sz)
             M.send_error(fd, 1002, "协议名无效")
             return
         end
-        local schema = proto_builder.get_receive_from_client_schema(name)
-        if schema and args then
-            local valid, err_msg = proto_builder.validate(name, args, schema)
-            if not valid then
-                M.send_error(fd, 1003, "协议字段验证失败: " .. err_msg)
-                return
-            end
-        end
         if response_func and session then
             local pr = pending_responses[fd]
             if not pr then
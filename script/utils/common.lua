@@ -5,13 +5,8 @@ local log = require "log"
 local common = {}
 
 function common.set_timeout(time, func)
-    local function t()
-        if func then 
-            func()
-        end 
-    end 
-    skynet.timeout(time, t)
-    return function() func = nil end 
-end 
+    local _, session = skynet.timeout(time, func)
+    return function() skynet.cancel_timeout(session) end
+end
 
 return common
\ No newline at end of file
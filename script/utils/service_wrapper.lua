@@ -58,6 +58,8 @@ end
 -- 包装服务启动函数
 function M.wrap_service(startup_func, options)
     options = options or {}
+    -- options.compact : 回包使用 skynet.packcompact, 适合返回大量同构记录的服务 (db/cache)
+    local pack = options.compact and skynet.packcompact or skynet.pack
     
     -- 返回包装后的启动函数
     return function()
@@ -89,7 +91,7 @@ function M.wrap_service(startup_func, options)
                     function_stats.last_rps_count = function_stats.calls
                 end
                 
-                skynet.ret(skynet.pack(table.unpack(result)))
+                skynet.ret(pack(table.unpack(result)))
             else
                 log.error("service:%s, Unknown command: %s", options.name, cmd)
                 skynet.ret(skynet.pack(false, "未知命令"))
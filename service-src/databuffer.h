@@ -1,6 +1,8 @@
 #ifndef skynet_databuffer_h
 #define skynet_databuffer_h
 
+#include "skynet_socket.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -54,7 +56,8 @@ _return_message(struct databuffer *db, struct messagepool *mp) {
 	} else {
 		db->head = m->next;
 	}
-	skynet_free(m->buffer);
+	// the buffer is the data of socket message
+	skynet_socket_free_buffer(m->buffer);
 	m->buffer = NULL;
 	m->size = 0;
 	m->next = mp->freelist;
@@ -39,6 +39,10 @@ void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
 uint32_t skynet_current_handle(void);
 uint64_t skynet_now(void);
+// start a timer of ms milliseconds (rounded up to the timer resolution) for the service, return the session
+int skynet_context_timeout(struct skynet_context * context, int64_t ms);
+// cancel the timer of the service, session is returned by skynet_timeout. return 0 if the timer is dispatched already (or not found)
+int skynet_timeout_cancel(uint32_t handle, int session);
 void skynet_debug_memory(const char *info);	// for debug use, output current service memory to stderr
 
 #endif
@@ -2,73 +2,220 @@
 
 #include "skynet_handle.h"
 #include "skynet_server.h"
-#include "rwlock.h"
+#include "spinlock.h"
+#include "atomic.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
 
 #define DEFAULT_SLOT_SIZE 4
 #define MAX_SLOT_SIZE 0x40000000
 
+/*
+	The readers (skynet_handle_grab, skynet_handle_findname) never lock.
+	The writers (register, retire, namehandle) take the lock, and publish a new version of the slot array
+	or the name array (copy on write) with an atomic store.
+
+	The old versions and the deleted contexts may still be read by the readers, so they are freed by epoch :
+	Each reader thread has an epoch record, it stores the global epoch in the record when entering,
+	and 0 when leaving. A garbage is stamped with the global epoch (then the epoch increases) when it's retired,
+	and it's freed when no reader is in the epoch not greater than the stamp.
+ */
+
 struct handle_name {
 	char * name;
 	uint32_t handle;
 };
 
+struct handle_slot {
+	int size;
+	ATOM_POINTER slot[1];	// struct skynet_context *
+};
+
+struct handle_names {
+	int count;
+	struct handle_name name[1];
+};
+
+struct epoch_record {
+	ATOM_SIZET epoch;	// 0 means it's not reading
+	ATOM_INT used;
+	struct epoch_record *next;
+};
+
+struct garbage {
+	void * ptr;
+	size_t epoch;
+	struct garbage *next;
+};
+
 struct handle_storage {
-	struct rwlock lock;
+	struct spinlock lock;	// for writers
 
 	uint32_t harbor;
 	uint32_t handle_index;
-	int slot_size;
-	struct skynet_context ** slot;
-	
-	int name_cap;
-	int name_count;
-	struct handle_name *name;
+	ATOM_POINTER slot;	// struct handle_slot *
+	ATOM_POINTER names;	// struct handle_names *
+
+	ATOM_SIZET epoch;
+	ATOM_POINTER record;	// struct epoch_record *, the records are never freed
+	pthread_key_t record_key;
+	struct garbage *garbage;	// in lock
 };
 
 static struct handle_storage *H = NULL;
 
+// reader epoch
+
+static void
+record_release(void *ud) {
+	struct epoch_record *r = ud;
+	ATOM_STORE(&r->epoch, 0);
+	ATOM_STORE(&r->used, 0);
+}
+
+static struct epoch_record *
+record_get(struct handle_storage *s) {
+	struct epoch_record *r = pthread_getspecific(s->record_key);
+	if (r)
+		return r;
+	// reuse the record of exited thread
+	for (r = (struct epoch_record *)ATOM_LOAD(&s->record); r; r = r->next) {
+		if (ATOM_LOAD(&r->used) == 0 && ATOM_CAS(&r->used, 0, 1)) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = skynet_malloc(sizeof(*r));
+		ATOM_INIT(&r->epoch, 0);
+		ATOM_INIT(&r->used, 1);
+		SPIN_LOCK(s)
+		r->next = (struct epoch_record *)ATOM_LOAD(&s->record);
+		ATOM_STORE(&s->record, (uintptr_t)r);
+		SPIN_UNLOCK(s)
+	}
+	pthread_setspecific(s->record_key, r);
+	return r;
+}
+
+static inline struct epoch_record *
+epoch_enter(struct handle_storage *s) {
+	struct epoch_record *r = record_get(s);
+	ATOM_STORE(&r->epoch, ATOM_LOAD(&s->epoch));
+	return r;
+}
+
+static inline void
+epoch_leave(struct epoch_record *r) {
+	ATOM_STORE(&r->epoch, 0);
+}
+
+// call it in lock
+static void
+retire_ptr(struct handle_storage *s, void *ptr) {
+	struct garbage *g = skynet_malloc(sizeof(*g));
+	g->ptr = ptr;
+	// the readers entering after here can't see ptr
+	g->epoch = ATOM_FINC(&s->epoch);
+	g->next = s->garbage;
+	s->garbage = g;
+}
+
+// call it in lock
+static void
+reclaim(struct handle_storage *s) {
+	if (s->garbage == NULL)
+		return;
+	size_t min_epoch = (size_t)-1;
+	struct epoch_record *r;
+	for (r = (struct epoch_record *)ATOM_LOAD(&s->record); r; r = r->next) {
+		size_t e = ATOM_LOAD(&r->epoch);
+		if (e != 0 && e < min_epoch)
+			min_epoch = e;
+	}
+	struct garbage **pg = &s->garbage;
+	while (*pg) {
+		struct garbage *g = *pg;
+		if (g->epoch < min_epoch) {
+			*pg = g->next;
+			skynet_free(g->ptr);
+			skynet_free(g);
+		} else {
+			pg = &g->next;
+		}
+	}
+}
+
+void
+skynet_handle_defer_free(void *ptr) {
+	struct handle_storage *s = H;
+	SPIN_LOCK(s)
+	retire_ptr(s, ptr);
+	reclaim(s);
+	SPIN_UNLOCK(s)
+}
+
+static struct handle_slot *
+slot_new(int size) {
+	struct handle_slot *hs = skynet_malloc(sizeof(*hs) + (size - 1) * sizeof(ATOM_POINTER));
+	hs->size = size;
+	int i;
+	for (i=0;i<size;i++) {
+		ATOM_INIT(&hs->slot[i], (uintptr_t)NULL);
+	}
+	return hs;
+}
+
+static struct handle_names *
+names_new(int count) {
+	struct handle_names *n = skynet_malloc(sizeof(*n) + (count > 0 ? count - 1 : 0) * sizeof(struct handle_name));
+	n->count = count;
+	return n;
+}
+
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
 	struct handle_storage *s = H;
 
-	rwlock_wlock(&s->lock);
-	
+	SPIN_LOCK(s)
+
 	for (;;) {
+		struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
 		int i;
 		uint32_t handle = s->handle_index;
-		for (i=0;i<s->slot_size;i++,handle++) {
+		for (i=0;i<hs->size;i++,handle++) {
 			if (handle > HANDLE_MASK) {
 				// 0 is reserved
 				handle = 1;
 			}
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			int hash = handle & (hs->size-1);
+			if (ATOM_LOAD(&hs->slot[hash]) == 0) {
+				ATOM_STORE(&hs->slot[hash], (uintptr_t)ctx);
 				s->handle_index = handle + 1;
 
-				rwlock_wunlock(&s->lock);
+				SPIN_UNLOCK(s)
 
 				handle |= s->harbor;
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			if (s->slot[i]) {
-				int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-				assert(new_slot[hash] == NULL);
-				new_slot[hash] = s->slot[i];
+		assert((hs->size*2 - 1) <= HANDLE_MASK);
+		// The readers may read the old slot array, so build a new one.
+		struct handle_slot *new_slot = slot_new(hs->size * 2);
+		for (i=0;i<hs->size;i++) {
+			struct skynet_context *c = (struct skynet_context *)ATOM_LOAD(&hs->slot[i]);
+			if (c) {
+				int hash = skynet_context_handle(c) & (new_slot->size - 1);
+				assert(ATOM_LOAD(&new_slot->slot[hash]) == 0);
+				ATOM_STORE(&new_slot->slot[hash], (uintptr_t)c);
 			}
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		ATOM_STORE(&s->slot, (uintptr_t)new_slot);
+		retire_ptr(s, hs);
+		reclaim(s);
 	}
 }
 
@@ -77,55 +224,73 @@ skynet_handle_retire(uint32_t handle) {
 	int ret = 0;
 	struct handle_storage *s = H;
 
-	rwlock_wlock(&s->lock);
+	SPIN_LOCK(s)
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	uint32_t hash = handle & (hs->size-1);
+	struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&hs->slot[hash]);
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		ATOM_STORE(&hs->slot[hash], (uintptr_t)NULL);
 		ret = 1;
+		struct handle_names *names = (struct handle_names *)ATOM_LOAD(&s->names);
 		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		int n = 0;
+		for (i=0; i<names->count; ++i) {
+			if (names->name[i].handle == handle) {
+				++n;
+			}
+		}
+		if (n > 0) {
+			struct handle_names *new_names = names_new(names->count - n);
+			int j = 0;
+			for (i=0; i<names->count; ++i) {
+				if (names->name[i].handle == handle) {
+					retire_ptr(s, names->name[i].name);
+				} else {
+					new_names->name[j++] = names->name[i];
+				}
 			}
-			++j;
+			ATOM_STORE(&s->names, (uintptr_t)new_names);
+			retire_ptr(s, names);
 		}
-		s->name_count = j;
+		reclaim(s);
 	} else {
 		ctx = NULL;
 	}
 
-	rwlock_wunlock(&s->lock);
+	SPIN_UNLOCK(s)
 
 	if (ctx) {
-		// release ctx may call skynet_handle_* , so wunlock first.
+		// release ctx may call skynet_handle_* , so unlock first.
 		skynet_context_release(ctx);
 	}
 
 	return ret;
 }
 
-void 
+void
 skynet_handle_retireall() {
 	struct handle_storage *s = H;
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
-			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+		struct epoch_record *r = epoch_enter(s);
+		struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+		int size = hs->size;
+		epoch_leave(r);
+		for (i=0;i<size;i++) {
+			r = epoch_enter(s);
+			hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
 			uint32_t handle = 0;
-			if (ctx) {
-				handle = skynet_context_handle(ctx);
-				++n;
+			if (i < hs->size) {
+				struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&hs->slot[i]);
+				if (ctx) {
+					handle = skynet_context_handle(ctx);
+					++n;
+				}
 			}
-			rwlock_runlock(&s->lock);
+			epoch_leave(r);
 			if (handle != 0) {
 				skynet_handle_retire(handle);
 			}
@@ -135,38 +300,40 @@ skynet_handle_retireall() {
 	}
 }
 
-struct skynet_context * 
+struct skynet_context *
 skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	rwlock_rlock(&s->lock);
+	struct epoch_record *r = epoch_enter(s);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
+	struct handle_slot *hs = (struct handle_slot *)ATOM_LOAD(&s->slot);
+	uint32_t hash = handle & (hs->size-1);
+	struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&hs->slot[hash]);
+	// the context may be retired and releasing, don't grab it if ref is 0
+	if (ctx && skynet_context_handle(ctx) == handle && skynet_context_trygrab(ctx)) {
 		result = ctx;
-		skynet_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	epoch_leave(r);
 
 	return result;
 }
 
-uint32_t 
+uint32_t
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
 
-	rwlock_rlock(&s->lock);
+	struct epoch_record *r = epoch_enter(s);
 
+	struct handle_names *names = (struct handle_names *)ATOM_LOAD(&s->names);
 	uint32_t handle = 0;
 
 	int begin = 0;
-	int end = s->name_count - 1;
+	int end = names->count - 1;
 	while (begin<=end) {
 		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
+		struct handle_name *n = &names->name[mid];
 		int c = strcmp(n->name, name);
 		if (c==0) {
 			handle = n->handle;
@@ -179,44 +346,38 @@ skynet_handle_findname(const char * name) {
 		}
 	}
 
-	rwlock_runlock(&s->lock);
+	epoch_leave(r);
 
 	return handle;
 }
 
 static void
 _insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
-		}
+	struct handle_names *names = (struct handle_names *)ATOM_LOAD(&s->names);
+	assert(names->count < MAX_SLOT_SIZE);
+	struct handle_names * n = names_new(names->count + 1);
+	int i;
+	for (i=0;i<before;i++) {
+		n->name[i] = names->name[i];
 	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	for (i=before;i<names->count;i++) {
+		n->name[i+1] = names->name[i];
+	}
+	n->name[before].name = name;
+	n->name[before].handle = handle;
+	ATOM_STORE(&s->names, (uintptr_t)n);
+	retire_ptr(s, names);
+	reclaim(s);
 }
 
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
+	struct handle_names *names = (struct handle_names *)ATOM_LOAD(&s->names);
 	int begin = 0;
-	int end = s->name_count - 1;
+	int end = names->count - 1;
 	while (begin<=end) {
 		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
+		struct handle_name *n = &names->name[mid];
 		int c = strcmp(n->name, name);
 		if (c==0) {
 			return NULL;
@@ -234,32 +395,37 @@ _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
 	return result;
 }
 
-const char * 
+const char *
 skynet_handle_namehandle(uint32_t handle, const char *name) {
-	rwlock_wlock(&H->lock);
+	SPIN_LOCK(H)
 
 	const char * ret = _insert_name(H, name, handle);
 
-	rwlock_wunlock(&H->lock);
+	SPIN_UNLOCK(H)
 
 	return ret;
 }
 
-void 
+void
 skynet_handle_init(int harbor) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	ATOM_INIT(&s->slot, (uintptr_t)slot_new(DEFAULT_SLOT_SIZE));
+	ATOM_INIT(&s->names, (uintptr_t)names_new(0));
 
-	rwlock_init(&s->lock);
+	SPIN_INIT(s)
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
-	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+
+	// epoch 0 means the reader is not reading
+	ATOM_INIT(&s->epoch, 1);
+	ATOM_INIT(&s->record, (uintptr_t)NULL);
+	s->garbage = NULL;
+	if (pthread_key_create(&s->record_key, record_release)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
 
 	H = s;
 
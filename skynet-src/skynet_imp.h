@@ -10,6 +10,14 @@ struct skynet_config {
 	const char * bootstrap;
 	const char * logger;
 	const char * logservice;
+	const char * scheduler;
+	const char * weight;
+	const char * worker_affinity;
+	const char * socket_affinity;
+	const char * timer_affinity;
+	const char * timer;
+	int timer_resolution;
+	int socket_thread;
 };
 
 #define THREAD_WORKER 0
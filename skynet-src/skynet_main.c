@@ -161,6 +161,14 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
 	config.profile = optboolean("profile", 1);
+	config.scheduler = optstring("scheduler", "global");
+	config.weight = optstring("weight", "static");
+	config.worker_affinity = optstring("worker_affinity", NULL);
+	config.socket_affinity = optstring("socket_affinity", NULL);
+	config.timer_affinity = optstring("timer_affinity", NULL);
+	config.timer = optstring("timer", "tick");
+	config.timer_resolution = optint("timer_resolution", 10);
+	config.socket_thread = optint("socket_thread", 1);
 
 	skynet_start(&config);
 	skynet_globalexit();
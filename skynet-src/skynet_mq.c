@@ -1,7 +1,11 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_park.h"
 #include "spinlock.h"
+#include "atomic.h"
+
+#include <pthread.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,17 +22,48 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+// Local run queue of each worker in SCHEDULE_STEAL mode, must be power of 2
+#define LOCAL_QUEUE_SIZE 256
+#define LOCAL_QUEUE_MASK (LOCAL_QUEUE_SIZE-1)
+// Check the global (injection) queue first every GLOBAL_CHECK_TICK local pops, avoid starvation
+#define GLOBAL_CHECK_TICK 61
+
+// The top bit of mq_ring.tail, set when the ring is full. Producers never use a closed ring again.
+#define RING_CLOSED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+/*
+	Messages are stored in a chain of bounded rings (Dmitry Vyukov's bounded queue, single consumer).
+	Each slot has a sequence number :
+		seq == pos : the slot is free for the producer at pos
+		seq == pos + 1 : the message at pos is published, the consumer can read it
+		seq == pos + cap : the message is consumed, the slot is free for the producer at pos + cap
+	When a producer finds the ring full, it closes the ring, links a new ring (twice the size)
+	after it and pushes there, so producers never wait for each other or the consumer.
+	The consumer drains a closed ring, then moves to the next one.
+	The old rings are kept until the queue released, because a slow producer may still read them.
+ */
+struct mq_slot {
+	ATOM_SIZET seq;
+	struct skynet_message message;
+};
+
+struct mq_ring {
+	ATOM_SIZET tail;	// producers
+	ATOM_POINTER next;
+	size_t head;	// consumer only
+	int cap;
+	struct mq_slot slot[1];
+};
+
 struct message_queue {
-	struct spinlock lock;
 	uint32_t handle;
-	int cap;
-	int head;
-	int tail;
-	int release;
-	int in_global;
+	ATOM_INT release;
+	ATOM_INT in_global;
 	int overload;
 	int overload_threshold;
-	struct skynet_message *queue;
+	struct mq_ring *first;	// for release
+	struct mq_ring *head;	// consumer only
+	ATOM_POINTER tail;	// struct mq_ring *, for producers
 	struct message_queue *next;
 };
 
@@ -38,12 +73,31 @@ struct global_queue {
 	struct spinlock lock;
 };
 
-static struct global_queue *Q = NULL;
+/*
+	Each worker owns a local run queue in SCHEDULE_STEAL mode.
+	Only the owner pushes at tail, and both the owner and thieves pop at head (CAS),
+	so it's a lock-free single producer / multi consumer ring and keeps FIFO order.
+	When the ring is full, the queue overflows into the global queue.
+ */
+struct local_queue {
+	ATOM_INT head;
+	ATOM_INT tail;
+	int tick;
+	ATOM_POINTER slot[LOCAL_QUEUE_SIZE];
+};
 
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+struct scheduler {
+	int mode;
+	int worker;
+	pthread_key_t local_key;
+	ATOM_POINTER * local;	// struct local_queue *, created by each worker thread
+};
+
+static struct global_queue *Q = NULL;
+static struct scheduler S;
 
+static void
+global_push(struct global_queue *q, struct message_queue * queue) {
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
 	if(q->tail) {
@@ -55,10 +109,8 @@ skynet_globalmq_push(struct message_queue * queue) {
 	SPIN_UNLOCK(q)
 }
 
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
+static struct message_queue *
+global_pop(struct global_queue *q) {
 	SPIN_LOCK(q)
 	struct message_queue *mq = q->head;
 	if(mq) {
@@ -74,22 +126,180 @@ skynet_globalmq_pop() {
 	return mq;
 }
 
+// only the owner thread can push
+static int
+local_push(struct local_queue *lq, struct message_queue * queue) {
+	int tail = ATOM_LOAD(&lq->tail);
+	int head = ATOM_LOAD(&lq->head);
+	if (tail - head >= LOCAL_QUEUE_SIZE) {
+		// full
+		return 1;
+	}
+	ATOM_STORE(&lq->slot[tail & LOCAL_QUEUE_MASK], (uintptr_t)queue);
+	ATOM_STORE(&lq->tail, tail + 1);
+	return 0;
+}
+
+// the owner and the thieves can pop
+static struct message_queue *
+local_pop(struct local_queue *lq) {
+	for (;;) {
+		int head = ATOM_LOAD(&lq->head);
+		int tail = ATOM_LOAD(&lq->tail);
+		if (tail - head <= 0) {
+			return NULL;
+		}
+		struct message_queue *mq = (struct message_queue *)ATOM_LOAD(&lq->slot[head & LOCAL_QUEUE_MASK]);
+		if (ATOM_CAS(&lq->head, head, head + 1)) {
+			return mq;
+		}
+		// retry, another thread took the head
+	}
+}
+
+static struct message_queue *
+steal(struct local_queue *self) {
+	int n = S.worker;
+	int i;
+	// start from a different victim each time to spread the steal traffic
+	int start = ++self->tick;
+	for (i=0;i<n;i++) {
+		struct local_queue *victim = (struct local_queue *)ATOM_LOAD(&S.local[(start + i) % n]);
+		if (victim == self || victim == NULL)
+			continue;
+		struct message_queue *mq = local_pop(victim);
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+static inline struct local_queue *
+current_local(void) {
+	if (S.mode != SCHEDULE_STEAL)
+		return NULL;
+	return (struct local_queue *)pthread_getspecific(S.local_key);
+}
+
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	struct local_queue *lq = current_local();
+	if (lq == NULL || local_push(lq, queue)) {
+		// not a worker thread (socket, timer, etc.), or local queue overflow
+		global_push(Q, queue);
+	}
+	// wake up an idle worker if there is no spinning one
+	skynet_park_wakeup();
+}
+
+int
+skynet_globalmq_ready(void) {
+	// take the lock, so a queue pushed before it must be seen (see skynet_park.c)
+	SPIN_LOCK(Q)
+	int ready = Q->head != NULL;
+	SPIN_UNLOCK(Q)
+	if (ready || S.mode != SCHEDULE_STEAL)
+		return ready;
+	int i;
+	for (i=0;i<S.worker;i++) {
+		struct local_queue *lq = (struct local_queue *)ATOM_LOAD(&S.local[i]);
+		if (lq && ATOM_LOAD(&lq->tail) - ATOM_LOAD(&lq->head) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+struct message_queue * 
+skynet_globalmq_pop() {
+	struct local_queue *lq = current_local();
+	if (lq == NULL) {
+		return global_pop(Q);
+	}
+	struct message_queue *mq;
+	// The global queue is only for injection (from non-worker threads) and overflow, so it's empty mostly.
+	// Check q->head without lock first, a queue pushed just after that will be picked in next round.
+	int global = Q->head != NULL;
+	if (global && ++lq->tick % GLOBAL_CHECK_TICK == 0) {
+		mq = global_pop(Q);
+		if (mq)
+			return mq;
+	}
+	mq = local_pop(lq);
+	if (mq)
+		return mq;
+	if (global) {
+		mq = global_pop(Q);
+		if (mq)
+			return mq;
+	}
+	return steal(lq);
+}
+
+static struct mq_ring *
+ring_new(int cap) {
+	struct mq_ring *r = skynet_malloc(sizeof(*r) + (cap - 1) * sizeof(struct mq_slot));
+	ATOM_INIT(&r->tail, 0);
+	ATOM_INIT(&r->next, (uintptr_t)NULL);
+	r->head = 0;
+	r->cap = cap;
+	int i;
+	for (i=0;i<cap;i++) {
+		ATOM_INIT(&r->slot[i].seq, i);
+	}
+	return r;
+}
+
+// return 0 for success, 1 when the ring is closed (full)
+static int
+ring_push(struct mq_ring *r, struct skynet_message *message) {
+	size_t mask = r->cap - 1;
+	size_t pos = ATOM_LOAD(&r->tail);
+	for (;;) {
+		if (pos & RING_CLOSED)
+			return 1;
+		struct mq_slot *slot = &r->slot[pos & mask];
+		size_t seq = ATOM_LOAD(&slot->seq);
+		if (seq == pos) {
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos + 1)) {
+				slot->message = *message;
+				ATOM_STORE(&slot->seq, pos + 1);
+				return 0;
+			}
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			// the slot is not consumed yet, the ring is full
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos | RING_CLOSED))
+				return 1;
+		}
+		// another producer moves tail, retry
+		pos = ATOM_LOAD(&r->tail);
+	}
+}
+
+static inline int
+ring_ready(struct mq_ring *r, size_t head) {
+	return ATOM_LOAD(&r->slot[head & (r->cap - 1)].seq) == head + 1;
+}
+
+// The ring is closed and all the claimed slots are consumed
+static inline int
+ring_drained(struct mq_ring *r, size_t head) {
+	size_t tail = ATOM_LOAD(&r->tail);
+	return (tail & RING_CLOSED) && (tail & ~RING_CLOSED) == head;
+}
+
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
 	q->handle = handle;
-	q->cap = DEFAULT_QUEUE_SIZE;
-	q->head = 0;
-	q->tail = 0;
-	SPIN_INIT(q)
 	// When the queue is create (always between service create and service init) ,
 	// set in_global flag to avoid push it to global queue .
 	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
-	q->in_global = MQ_IN_GLOBAL;
-	q->release = 0;
+	ATOM_INIT(&q->in_global, MQ_IN_GLOBAL);
+	ATOM_INIT(&q->release, 0);
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
+	q->first = q->head = ring_new(DEFAULT_QUEUE_SIZE);
+	ATOM_INIT(&q->tail, (uintptr_t)q->first);
 	q->next = NULL;
 
 	return q;
@@ -98,8 +308,12 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
-	SPIN_DESTROY(q)
-	skynet_free(q->queue);
+	struct mq_ring *r = q->first;
+	while (r) {
+		struct mq_ring *next = (struct mq_ring *)ATOM_LOAD(&r->next);
+		skynet_free(r);
+		r = next;
+	}
 	skynet_free(q);
 }
 
@@ -108,20 +322,17 @@ skynet_mq_handle(struct message_queue *q) {
 	return q->handle;
 }
 
+// Lock free, call it only in the consumer (the worker dispatching the queue, or the service itself).
+// The producers claimed but not published messages are counted in.
 int
 skynet_mq_length(struct message_queue *q) {
-	int head, tail,cap;
-
-	SPIN_LOCK(q)
-	head = q->head;
-	tail = q->tail;
-	cap = q->cap;
-	SPIN_UNLOCK(q)
-	
-	if (head <= tail) {
-		return tail - head;
+	size_t length = 0;
+	struct mq_ring *r = q->head;
+	while (r) {
+		length += (ATOM_LOAD(&r->tail) & ~RING_CLOSED) - r->head;
+		r = (struct mq_ring *)ATOM_LOAD(&r->next);
 	}
-	return tail + cap - head;
+	return (int)length;
 }
 
 int
@@ -134,97 +345,192 @@ skynet_mq_overload(struct message_queue *q) {
 	return 0;
 }
 
-int
-skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;
-	SPIN_LOCK(q)
-
-	if (q->head != q->tail) {
-		*message = q->queue[q->head++];
-		ret = 0;
-		int head = q->head;
-		int tail = q->tail;
-		int cap = q->cap;
-
-		if (head >= cap) {
-			q->head = head = 0;
-		}
-		int length = tail - head;
-		if (length < 0) {
-			length += cap;
+// return 0 for success
+static int
+mq_take(struct message_queue *q, struct skynet_message *message) {
+	struct mq_ring *r = q->head;
+	for (;;) {
+		size_t head = r->head;
+		struct mq_slot *slot = &r->slot[head & (r->cap - 1)];
+		if (ATOM_LOAD(&slot->seq) == head + 1) {
+			*message = slot->message;
+			ATOM_STORE(&slot->seq, head + r->cap);
+			r->head = head + 1;
+			return 0;
 		}
-		while (length > q->overload_threshold) {
-			q->overload = length;
-			q->overload_threshold *= 2;
+		if (!ring_drained(r, head))
+			return 1;
+		struct mq_ring *next = (struct mq_ring *)ATOM_LOAD(&r->next);
+		if (next == NULL) {
+			// The producer closed the ring is linking the next one.
+			return 1;
 		}
-	} else {
+		q->head = r = next;
+	}
+}
+
+// Read only peek, see skynet_mq_pop
+static int
+mq_ready(struct mq_ring *r, size_t head) {
+	for (;;) {
+		if (ring_ready(r, head))
+			return 1;
+		if (!ring_drained(r, head))
+			return 0;
+		r = (struct mq_ring *)ATOM_LOAD(&r->next);
+		if (r == NULL)
+			return 0;
+		head = 0;
+	}
+}
+
+// ATOM_CAS may fail spuriously, retry until in_global is set by someone.
+// return 1 if the caller set it.
+static inline int
+mq_activate(struct message_queue *q) {
+	while (ATOM_LOAD(&q->in_global) == 0) {
+		if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL))
+			return 1;
+	}
+	return 0;
+}
+
+static inline void
+check_overload(struct message_queue *q) {
+	int length = skynet_mq_length(q);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+}
+
+// Call it when mq_take() failed, return 0 if a message is taken.
+static int
+mq_giveup(struct message_queue *q, struct skynet_message *message) {
+	for (;;) {
 		// reset overload_threshold when queue is empty
 		q->overload_threshold = MQ_OVERLOAD;
-	}
 
-	if (ret) {
-		q->in_global = 0;
+		struct mq_ring *r = q->head;
+		size_t head = r->head;
+		ATOM_STORE(&q->in_global, 0);
+		// A producer may publish a message after mq_take() and before in_global is cleared,
+		// it saw in_global == 1 and didn't push the queue into global queue, so check again.
+		// Don't touch the consumer side of q after in_global is cleared, another worker may own it now.
+		if (!mq_ready(r, head) || !mq_activate(q))
+			return 1;
+		// We own the queue again, but a producer may activate it between mq_ready() and mq_activate(),
+		// and another worker may take the message and clear in_global in the window, so the queue may be empty.
+		if (mq_take(q, message) == 0) {
+			check_overload(q);
+			return 0;
+		}
 	}
-	
-	SPIN_UNLOCK(q)
+}
 
-	return ret;
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	if (mq_take(q, message) == 0) {
+		check_overload(q);
+		return 0;
+	}
+	return mq_giveup(q, message);
 }
 
-static void
-expand_queue(struct message_queue *q) {
-	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->cap * 2);
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *messages, int n) {
 	int i;
-	for (i=0;i<q->cap;i++) {
-		new_queue[i] = q->queue[(q->head + i) % q->cap];
+	for (i=0;i<n;i++) {
+		if (mq_take(q, &messages[i]))
+			break;
+	}
+	if (i > 0) {
+		check_overload(q);
+		return i;
 	}
-	q->head = 0;
-	q->tail = q->cap;
-	q->cap *= 2;
-	
-	skynet_free(q->queue);
-	q->queue = new_queue;
+	if (n > 0 && mq_giveup(q, messages) == 0) {
+		return 1;
+	}
+	return 0;
 }
 
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
-	SPIN_LOCK(q)
-
-	q->queue[q->tail] = *message;
-	if (++ q->tail >= q->cap) {
-		q->tail = 0;
-	}
-
-	if (q->head == q->tail) {
-		expand_queue(q);
+	for (;;) {
+		struct mq_ring *r = (struct mq_ring *)ATOM_LOAD(&q->tail);
+		if (ring_push(r, message) == 0)
+			break;
+		// ring is full, grow the queue
+		struct mq_ring *next = (struct mq_ring *)ATOM_LOAD(&r->next);
+		if (next == NULL) {
+			struct mq_ring *nr = ring_new(r->cap * 2);
+			if (ATOM_CAS_POINTER(&r->next, (uintptr_t)NULL, (uintptr_t)nr)) {
+				next = nr;
+			} else {
+				// other producer links the next ring first
+				skynet_free(nr);
+				next = (struct mq_ring *)ATOM_LOAD(&r->next);
+			}
+		}
+		// move tail forward, it's ok if other producer did it first
+		ATOM_CAS_POINTER(&q->tail, (uintptr_t)r, (uintptr_t)next);
 	}
 
-	if (q->in_global == 0) {
-		q->in_global = MQ_IN_GLOBAL;
+	if (mq_activate(q)) {
 		skynet_globalmq_push(q);
 	}
-	
-	SPIN_UNLOCK(q)
 }
 
 void 
-skynet_mq_init() {
+skynet_mq_init(int mode, int worker) {
 	struct global_queue *q = skynet_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q);
 	Q=q;
+
+	S.mode = mode;
+	S.worker = worker;
+	S.local = NULL;
+	if (mode == SCHEDULE_STEAL) {
+		if (pthread_key_create(&S.local_key, NULL)) {
+			fprintf(stderr, "pthread_key_create failed");
+			exit(1);
+		}
+		S.local = skynet_malloc(worker * sizeof(ATOM_POINTER));
+		int i;
+		for (i=0;i<worker;i++) {
+			ATOM_INIT(&S.local[i], (uintptr_t)NULL);
+		}
+	}
+}
+
+// Call it in the worker thread (after cpu binding), so the local queue is allocated (first touched) in its own NUMA node.
+void
+skynet_mq_initworker(int id) {
+	if (S.mode == SCHEDULE_STEAL) {
+		assert(id >= 0 && id < S.worker);
+		struct local_queue *lq = skynet_malloc(sizeof(*lq));
+		memset(lq, 0, sizeof(*lq));
+		ATOM_INIT(&lq->head, 0);
+		ATOM_INIT(&lq->tail, 0);
+		lq->tick = id;
+		ATOM_STORE(&S.local[id], (uintptr_t)lq);
+		pthread_setspecific(S.local_key, lq);
+	}
 }
 
 void 
 skynet_mq_mark_release(struct message_queue *q) {
-	SPIN_LOCK(q)
-	assert(q->release == 0);
-	q->release = 1;
-	if (q->in_global != MQ_IN_GLOBAL) {
+	assert(ATOM_LOAD(&q->release) == 0);
+	if (mq_activate(q)) {
+		ATOM_STORE(&q->release, 1);
 		skynet_globalmq_push(q);
+	} else {
+		// The queue is in global mq (or a worker holds it), the worker will call skynet_mq_release later.
+		// Don't touch q after release is set, the worker may free it.
+		ATOM_STORE(&q->release, 1);
 	}
-	SPIN_UNLOCK(q)
 }
 
 static void
@@ -238,13 +544,9 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
-	SPIN_LOCK(q)
-	
-	if (q->release) {
-		SPIN_UNLOCK(q)
+	if (ATOM_LOAD(&q->release)) {
 		_drop_queue(q, drop_func, ud);
 	} else {
 		skynet_globalmq_push(q);
-		SPIN_UNLOCK(q)
 	}
 }
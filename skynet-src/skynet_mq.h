@@ -15,10 +15,16 @@ struct skynet_message {
 #define MESSAGE_TYPE_MASK (SIZE_MAX >> 8)
 #define MESSAGE_TYPE_SHIFT ((sizeof(size_t)-1) * 8)
 
+// scheduler mode, see skynet_mq_init
+#define SCHEDULE_GLOBAL 0	// all workers share one global queue
+#define SCHEDULE_STEAL 1	// each worker owns a local run queue, and steals from others when idle
+
 struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+// return 1 if there is any message queue in the run queues
+int skynet_globalmq_ready(void);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -31,11 +37,14 @@ uint32_t skynet_mq_handle(struct message_queue *);
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
+// pop at most n messages, return the number of messages. 0 means the queue is empty (the same as skynet_mq_pop returns 1)
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *messages, int n);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+void skynet_mq_init(int mode, int worker);
+void skynet_mq_initworker(int id);	// bind the local run queue to current worker thread
 
 #endif
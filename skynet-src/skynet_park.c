@@ -0,0 +1,216 @@
+#include "skynet.h"
+#include "skynet_park.h"
+#include "skynet_mq.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define SLOT_RUNNING 0
+#define SLOT_PARKED 1
+#define SLOT_NOTIFIED 2
+
+#define CACHE_LINE 64
+
+/*
+	Each worker owns a slot. A worker parks in its slot with the state SLOT_PARKED, and the producer changes
+	the state of exactly one parked slot to SLOT_NOTIFIED (CAS) and wakes it up.
+
+	No lost wakeup :
+		worker : state = PARKED ; ++idle ; --spinning ; check the run queues again
+		producer : push to the run queue ; check spinning and idle ; notify a parked slot
+	All of them are sequentially consistent, so either the worker finds the queue, or the producer finds the worker.
+ */
+struct park_slot {
+	ATOM_INT state;
+	ATOM_ULONG notify_time;	// nanosec, set by the producer after notified
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+} __attribute__((aligned(CACHE_LINE)));
+
+struct park {
+	int worker;
+	ATOM_INT quit;
+	ATOM_INT idle;	// the number of parked workers can be notified
+	ATOM_INT spinning;
+	ATOM_INT next;	// the slot to start searching
+	ATOM_ULONG wakeup;
+	ATOM_ULONG latency;	// nanosec
+	struct park_slot *slot;
+};
+
+static struct park P;
+
+static inline uint64_t
+now_ns(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+#ifdef __linux__
+
+static inline void
+slot_sleep(struct park_slot *s) {
+	while (ATOM_LOAD(&s->state) == SLOT_PARKED) {
+		// returns at once if state is changed already
+		syscall(SYS_futex, (int *)&s->state, FUTEX_WAIT_PRIVATE, SLOT_PARKED, NULL, NULL, 0);
+	}
+}
+
+static inline void
+slot_signal(struct park_slot *s) {
+	syscall(SYS_futex, (int *)&s->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+static inline void
+slot_sleep(struct park_slot *s) {
+	pthread_mutex_lock(&s->mutex);
+	while (ATOM_LOAD(&s->state) == SLOT_PARKED) {
+		pthread_cond_wait(&s->cond, &s->mutex);
+	}
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static inline void
+slot_signal(struct park_slot *s) {
+	pthread_mutex_lock(&s->mutex);
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+#endif
+
+// return 1 if the slot is parked and notified by the caller
+static int
+slot_notify(struct park_slot *s) {
+	if (ATOM_LOAD(&s->state) != SLOT_PARKED)
+		return 0;
+	if (!ATOM_CAS(&s->state, SLOT_PARKED, SLOT_NOTIFIED))
+		return 0;
+	// The woken worker is spinning, so the producers don't wake up others before it finds the work.
+	ATOM_FINC(&P.spinning);
+	ATOM_FDEC(&P.idle);
+	ATOM_STORE(&s->notify_time, now_ns());
+	slot_signal(s);
+	return 1;
+}
+
+void
+skynet_park_init(int worker) {
+	P.worker = worker;
+	ATOM_INIT(&P.quit, 0);
+	ATOM_INIT(&P.idle, 0);
+	ATOM_INIT(&P.spinning, 0);
+	ATOM_INIT(&P.next, 0);
+	ATOM_INIT(&P.wakeup, 0);
+	ATOM_INIT(&P.latency, 0);
+	P.slot = skynet_memalign(CACHE_LINE, worker * sizeof(struct park_slot));
+	memset(P.slot, 0, worker * sizeof(struct park_slot));
+	int i;
+	for (i=0;i<worker;i++) {
+		struct park_slot *s = &P.slot[i];
+		ATOM_INIT(&s->state, SLOT_RUNNING);
+		ATOM_INIT(&s->notify_time, 0);
+#ifndef __linux__
+		pthread_mutex_init(&s->mutex, NULL);
+		pthread_cond_init(&s->cond, NULL);
+#endif
+	}
+}
+
+void
+skynet_park_exit(void) {
+	ATOM_STORE(&P.quit, 1);
+	int i;
+	for (i=0;i<P.worker;i++) {
+		slot_notify(&P.slot[i]);
+	}
+}
+
+int
+skynet_park_spin(void) {
+	// Limit the spinning workers to half of the running workers, spinning is not free.
+	int spinning = ATOM_LOAD(&P.spinning);
+	if (spinning * 2 >= P.worker - ATOM_LOAD(&P.idle))
+		return 0;
+	ATOM_FINC(&P.spinning);
+	return 1;
+}
+
+void
+skynet_park_unspin(void) {
+	if (ATOM_FDEC(&P.spinning) == 1) {
+		// The last spinning worker finds work, producers may skip wakeup because of it. Wake up another one to find more.
+		skynet_park_wakeup();
+	}
+}
+
+int
+skynet_park_wait(int id, int spinning) {
+	assert(id >= 0 && id < P.worker);
+	struct park_slot *s = &P.slot[id];
+	ATOM_STORE(&s->state, SLOT_PARKED);
+	ATOM_FINC(&P.idle);
+	if (spinning) {
+		ATOM_FDEC(&P.spinning);
+	}
+	if (ATOM_LOAD(&P.quit) || skynet_globalmq_ready()) {
+		if (ATOM_CAS(&s->state, SLOT_PARKED, SLOT_RUNNING)) {
+			ATOM_FDEC(&P.idle);
+			return 0;
+		}
+		// notified by a producer already
+	}
+	slot_sleep(s);
+	uint64_t t;
+	// the producer sets notify_time just after CAS
+	while ((t = ATOM_LOAD(&s->notify_time)) == 0) {}
+	uint64_t ti = now_ns();
+	ATOM_STORE(&s->notify_time, 0);
+	ATOM_FINC(&P.wakeup);
+	if (ti > t) {
+		ATOM_FADD(&P.latency, ti - t);
+	}
+	ATOM_STORE(&s->state, SLOT_RUNNING);
+	return 1;
+}
+
+void
+skynet_park_wakeup(void) {
+	// A spinning worker will find the work, don't wake up another one.
+	if (ATOM_LOAD(&P.spinning) > 0 || ATOM_LOAD(&P.idle) == 0)
+		return;
+	int n = P.worker;
+	int start = ATOM_FINC(&P.next);
+	int i;
+	for (i=0;i<n;i++) {
+		if (slot_notify(&P.slot[(unsigned)(start + i) % n]))
+			return;
+	}
+}
+
+uint64_t
+skynet_park_wakeup_count(void) {
+	return ATOM_LOAD(&P.wakeup);
+}
+
+double
+skynet_park_wakeup_latency(void) {
+	uint64_t n = ATOM_LOAD(&P.wakeup);
+	if (n == 0)
+		return 0;
+	return (double)ATOM_LOAD(&P.latency) / n / 1000.0;
+}
@@ -0,0 +1,24 @@
+#ifndef SKYNET_PARK_H
+#define SKYNET_PARK_H
+
+#include <stdint.h>
+
+// Idle workers park in their own slots, and a producer wakes exactly one of them.
+
+void skynet_park_init(int worker);
+void skynet_park_exit(void);	// wake up all the workers, and never park again
+
+// An idle worker spins (keeps trying to find work) before it parks. return 0 if there are enough spinning workers already.
+int skynet_park_spin(void);
+// The spinning worker finds work.
+void skynet_park_unspin(void);
+// Park the worker id until skynet_park_wakeup or skynet_park_exit. It returns at once if there is any work.
+// Return 1 if it's woken up, and the worker is spinning now.
+int skynet_park_wait(int id, int spinning);
+// Call it after a message queue is pushed into the run queue.
+void skynet_park_wakeup(void);
+
+uint64_t skynet_park_wakeup_count(void);
+double skynet_park_wakeup_latency(void);	// average in microsec
+
+#endif
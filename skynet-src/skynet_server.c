@@ -8,6 +8,7 @@
 #include "skynet_harbor.h"
 #include "skynet_env.h"
 #include "skynet_monitor.h"
+#include "skynet_park.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
 #include "spinlock.h"
@@ -18,9 +19,18 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 
+// max number of messages popped from a message queue at once, see skynet_context_message_dispatch
+#define DISPATCH_BATCH 32
+
+// For adaptive weight : the cpu time (in microsec) a service can use in one dispatch round,
+// and the fixed point scale of skynet_context.avg_cost
+#define DISPATCH_QUANTUM 1000
+#define COST_SCALE 16
+
 #ifdef CALLING_CHECK
 
 #define CHECKCALLING_BEGIN(ctx) if (!(spinlock_trylock(&ctx->calling))) { assert(0); }
@@ -53,6 +63,9 @@ struct skynet_context {
 	int session_id;
 	ATOM_INT ref;
 	size_t message_count;
+	size_t dispatch_count;
+	uint32_t avg_cost;	// average cpu cost of one message, in 1/COST_SCALE microsec
+	int quota;	// messages of last dispatch round
 	bool init;
 	bool endless;
 	bool profile;
@@ -66,6 +79,7 @@ struct skynet_node {
 	uint32_t monitor_exit;
 	pthread_key_t handle_key;
 	bool profile;	// default is on
+	bool adaptive;	// adaptive weight, default is off
 };
 
 static struct skynet_node G_NODE;
@@ -148,6 +162,9 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->cpu_cost = 0;
 	ctx->cpu_start = 0;
 	ctx->message_count = 0;
+	ctx->dispatch_count = 0;
+	ctx->avg_cost = 0;
+	ctx->quota = 0;
 	ctx->profile = G_NODE.profile;
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;	
@@ -196,6 +213,18 @@ skynet_context_grab(struct skynet_context *ctx) {
 	ATOM_FINC(&ctx->ref);
 }
 
+// grab the context only if it's not releasing (ref > 0)
+int
+skynet_context_trygrab(struct skynet_context *ctx) {
+	int ref = ATOM_LOAD(&ctx->ref);
+	while (ref > 0) {
+		if (ATOM_CAS(&ctx->ref, ref, ref + 1))
+			return 1;
+		ref = ATOM_LOAD(&ctx->ref);
+	}
+	return 0;
+}
+
 void
 skynet_context_reserve(struct skynet_context *ctx) {
 	skynet_context_grab(ctx);
@@ -213,7 +242,8 @@ delete_context(struct skynet_context *ctx) {
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
 	CHECKCALLING_DESTROY(ctx)
-	skynet_free(ctx);
+	// skynet_handle_grab may be reading it
+	skynet_handle_defer_free(ctx);
 	context_dec();
 }
 
@@ -294,6 +324,35 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+/*
+	Adaptive weight : instead of the static weight of each worker thread,
+	let a service run about DISPATCH_QUANTUM microsec in one dispatch round.
+	The cheap services drain their queues at once (no useless rotation),
+	and the heavy ones yield the worker to others after a few messages (no starvation).
+	It needs profile on to measure the cost, or the service drains the queue (like weight 0).
+ */
+static int
+adaptive_quota(struct skynet_context *ctx, int length) {
+	int n = length;
+	if (ctx->avg_cost > 0) {
+		uint64_t quota = (uint64_t)DISPATCH_QUANTUM * COST_SCALE / ctx->avg_cost;
+		if (quota < n)
+			n = (int)quota;
+	}
+	if (n < 1)
+		n = 1;
+	return n;
+}
+
+static inline void
+update_cost(struct skynet_context *ctx, uint64_t cost, int dispatched) {
+	if (!G_NODE.adaptive || !ctx->profile || dispatched == 0)
+		return;
+	uint32_t c = (uint32_t)((ctx->cpu_cost - cost) * COST_SCALE / dispatched);
+	// exponential moving average, alpha = 1/8
+	ctx->avg_cost = ctx->avg_cost - (ctx->avg_cost >> 3) + (c >> 3);
+}
+
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
 	if (q == NULL) {
@@ -312,32 +371,50 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	}
 
 	int i,n=1;
-	struct skynet_message msg;
-
-	for (i=0;i<n;i++) {
-		if (skynet_mq_pop(q,&msg)) {
+	if (G_NODE.adaptive) {
+		n = adaptive_quota(ctx, skynet_mq_length(q));
+	} else if (weight >= 0) {
+		n = skynet_mq_length(q) >> weight;
+		if (n < 1)
+			n = 1;
+	}
+	ctx->quota = n;
+	++ctx->dispatch_count;
+	uint64_t cost = ctx->cpu_cost;
+	int dispatched = 0;
+
+	// Pop messages in batch, and report overload once per batch
+	struct skynet_message batch[DISPATCH_BATCH];
+	while (n > 0) {
+		int c = skynet_mq_pop_batch(q, batch, n < DISPATCH_BATCH ? n : DISPATCH_BATCH);
+		if (c == 0) {
+			// queue is empty, and it's not in global mq now. (See skynet_mq_pop)
+			update_cost(ctx, cost, dispatched);
 			skynet_context_release(ctx);
 			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
 		}
+		n -= c;
+		dispatched += c;
 		int overload = skynet_mq_overload(q);
 		if (overload) {
 			skynet_error(ctx, "error: May overload, message queue length = %d", overload);
 		}
 
-		skynet_monitor_trigger(sm, msg.source , handle);
+		for (i=0;i<c;i++) {
+			skynet_monitor_trigger(sm, batch[i].source , handle);
 
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
-		}
+			if (ctx->cb == NULL) {
+				skynet_free(batch[i].data);
+			} else {
+				dispatch_message(ctx, &batch[i]);
+			}
 
-		skynet_monitor_trigger(sm, 0,0);
+			skynet_monitor_trigger(sm, 0,0);
+		}
 	}
 
+	update_cost(ctx, cost, dispatched);
+
 	assert(q == ctx->queue);
 	struct message_queue *nq = skynet_globalmq_pop();
 	if (nq) {
@@ -405,6 +482,12 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+int
+skynet_context_timeout(struct skynet_context * context, int64_t ms) {
+	int session = skynet_context_newsession(context);
+	return skynet_timeout_ms(context->handle, ms, session);
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
@@ -575,6 +658,14 @@ cmd_stat(struct skynet_context * context, const char * param) {
 		}
 	} else if (strcmp(param, "message") == 0) {
 		sprintf(context->result, "%zu", context->message_count);
+	} else if (strcmp(param, "dispatch") == 0) {
+		sprintf(context->result, "%zu", context->dispatch_count);
+	} else if (strcmp(param, "quota") == 0) {
+		sprintf(context->result, "%d", context->quota);
+	} else if (strcmp(param, "wakeup") == 0) {
+		sprintf(context->result, "%" PRIu64, skynet_park_wakeup_count());
+	} else if (strcmp(param, "wakeup_latency") == 0) {
+		sprintf(context->result, "%lf", skynet_park_wakeup_latency());	// microsec
 	} else {
 		context->result[0] = '\0';
 	}
@@ -833,3 +924,8 @@ void
 skynet_profile_enable(int enable) {
 	G_NODE.profile = (bool)enable;
 }
+
+void
+skynet_adaptive_enable(int enable) {
+	G_NODE.adaptive = (bool)enable;
+}
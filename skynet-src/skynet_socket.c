@@ -2,9 +2,11 @@
 
 #include "skynet_socket.h"
 #include "socket_server.h"
+#include "socket_pool.h"
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "atomic.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -13,9 +15,39 @@
 
 static struct socket_server * SOCKET_SERVER = NULL;
 
+struct skynet_socket_shared {
+	ATOM_INT ref;
+	size_t sz;
+	// the data follows
+};
+
+// SOCKET_BUFFER_OBJECT is the shared buffer, each queued send holds a reference.
+
+static const void *
+shared_buffer(const void *object) {
+	const struct skynet_socket_shared *sb = object;
+	return sb + 1;
+}
+
+static size_t
+shared_size(const void *object) {
+	const struct skynet_socket_shared *sb = object;
+	return sb->sz;
+}
+
+static void
+shared_free(void *object) {
+	skynet_socket_shared_release(object);
+}
+
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+skynet_socket_init(int thread) {
+	socket_pool_init();
+	SOCKET_SERVER = socket_server_create(skynet_now(), thread);
+	if (SOCKET_SERVER) {
+		struct socket_object_interface soi = { shared_buffer, shared_size, shared_free };
+		socket_server_userobject(SOCKET_SERVER, &soi);
+	}
 }
 
 void
@@ -34,7 +66,7 @@ skynet_socket_updatetime() {
 	socket_server_updatetime(SOCKET_SERVER, skynet_now());
 }
 
-// mainloop thread
+// socket thread
 static void
 forward_message(int type, bool padding, struct socket_message * result) {
 	struct skynet_socket_message *sm;
@@ -70,18 +102,20 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	if (skynet_context_push((uint32_t)result->opaque, &message)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
-		skynet_free(sm->buffer);
+		if (type == SKYNET_SOCKET_TYPE_DATA || type == SKYNET_SOCKET_TYPE_UDP || type == SKYNET_SOCKET_TYPE_UDP_BATCH) {
+			socket_pool_free(sm->buffer);
+		}
 		skynet_free(sm);
 	}
 }
 
 int 
-skynet_socket_poll() {
+skynet_socket_poll(int thread) {
 	struct socket_server *ss = SOCKET_SERVER;
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type = socket_server_poll(ss, thread, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
@@ -103,6 +137,9 @@ skynet_socket_poll() {
 	case SOCKET_UDP:
 		forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result);
 		break;
+	case SOCKET_UDP_BATCH:
+		forward_message(SKYNET_SOCKET_TYPE_UDP_BATCH, false, &result);
+		break;
 	case SOCKET_WARNING:
 		forward_message(SKYNET_SOCKET_TYPE_WARNING, false, &result);
 		break;
@@ -116,6 +153,11 @@ skynet_socket_poll() {
 	return 1;
 }
 
+void
+skynet_socket_free_buffer(void *buffer) {
+	socket_pool_free(buffer);
+}
+
 int
 skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer) {
 	return socket_server_send(SOCKET_SERVER, buffer);
@@ -132,6 +174,15 @@ skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int
 	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
 }
 
+int
+skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog, int n, int policy, int ids[]) {
+	uint32_t source = skynet_context_handle(ctx);
+	if (n > MAX_REUSEPORT)
+		return -1;
+	policy = policy == SKYNET_SOCKET_REUSEPORT_CPU ? SOCKET_REUSEPORT_CPU : SOCKET_REUSEPORT_HASH;
+	return socket_server_listen_reuseport(SOCKET_SERVER, source, host, port, backlog, n, policy, ids);
+}
+
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
@@ -174,6 +225,11 @@ skynet_socket_nodelay(struct skynet_context *ctx, int id) {
 	socket_server_nodelay(SOCKET_SERVER, id);
 }
 
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low) {
+	socket_server_watermark(SOCKET_SERVER, id, high, low);
+}
+
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
@@ -215,7 +271,61 @@ skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
 	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
 }
 
+const char *
+skynet_socket_udp_batch(const char *buffer, int size, int *offset, int *sz, const char **address, int *addrsz) {
+	return socket_server_udp_batch(buffer, size, offset, sz, (const struct socket_udp_address **)address, addrsz);
+}
+
+struct skynet_socket_shared *
+skynet_socket_shared_new(const void *buffer, size_t sz) {
+	struct skynet_socket_shared *sb = skynet_malloc(sizeof(*sb) + sz);
+	ATOM_INIT(&sb->ref, 1);
+	sb->sz = sz;
+	memcpy(sb + 1, buffer, sz);
+	return sb;
+}
+
+struct skynet_socket_shared *
+skynet_socket_shared_grab(struct skynet_socket_shared *sb) {
+	ATOM_FINC(&sb->ref);
+	return sb;
+}
+
+void
+skynet_socket_shared_release(struct skynet_socket_shared *sb) {
+	if (ATOM_FDEC(&sb->ref) == 1) {
+		skynet_free(sb);
+	}
+}
+
+size_t
+skynet_socket_shared_size(struct skynet_socket_shared *sb) {
+	return sb->sz;
+}
+
+int
+skynet_socket_send_multi(struct skynet_context *ctx, const int ids[], int n, struct skynet_socket_shared *sb) {
+	if (n <= 0)
+		return 0;
+	// each id holds a reference
+	ATOM_FADD(&sb->ref, n);
+	return socket_server_send_multi(SOCKET_SERVER, ids, n, sb);
+}
+
+int
+skynet_socket_send_multi_lowpriority(struct skynet_context *ctx, const int ids[], int n, struct skynet_socket_shared *sb) {
+	if (n <= 0)
+		return 0;
+	ATOM_FADD(&sb->ref, n);
+	return socket_server_send_multi_lowpriority(SOCKET_SERVER, ids, n, sb);
+}
+
 struct socket_info *
 skynet_socket_info() {
 	return socket_server_info(SOCKET_SERVER);
 }
+
+void
+skynet_socket_histogram(uint64_t histogram[SKYNET_SOCKET_HISTOGRAM]) {
+	socket_server_histogram(SOCKET_SERVER, histogram);
+}
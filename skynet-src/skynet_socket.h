@@ -13,23 +13,33 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5
 #define SKYNET_SOCKET_TYPE_UDP 6
 #define SKYNET_SOCKET_TYPE_WARNING 7
+#define SKYNET_SOCKET_TYPE_UDP_BATCH 8
+
+#define SKYNET_SOCKET_REUSEPORT_HASH 0
+#define SKYNET_SOCKET_REUSEPORT_CPU 1
+#define SKYNET_SOCKET_MAX_REUSEPORT 64
 
 struct skynet_socket_message {
 	int type;
 	int id;
 	int ud;
+	// The buffer of SKYNET_SOCKET_TYPE_DATA/UDP/UDP_BATCH comes from the socket pool,
+	// free it by skynet_socket_free_buffer (socketdriver.drop in lua), never skynet_free.
+	// Copy the data out if it's passed to the code which frees it by skynet_free.
 	char * buffer;
 };
 
-void skynet_socket_init();
+void skynet_socket_init(int thread);
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int thread);
 void skynet_socket_updatetime();
+void skynet_socket_free_buffer(void *buffer);
 
 int skynet_socket_sendbuffer(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 int skynet_socket_sendbuffer_lowpriority(struct skynet_context *ctx, struct socket_sendbuffer *buffer);
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
+int skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog, int n, int policy, int ids[]);
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 int skynet_socket_bind(struct skynet_context *ctx, int fd);
 void skynet_socket_close(struct skynet_context *ctx, int id);
@@ -37,6 +47,8 @@ void skynet_socket_shutdown(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
 void skynet_socket_pause(struct skynet_context *ctx, int id);
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
+// drop the low priority packages and pause reading when the write buffer of id reaches high, until it drains to low.
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low);
 
 int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
 int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
@@ -44,8 +56,26 @@ int skynet_socket_udp_dial(struct skynet_context *ctx, const char * addr, int po
 int skynet_socket_udp_listen(struct skynet_context *ctx, const char * addr, int port);
 int skynet_socket_udp_sendbuffer(struct skynet_context *ctx, const char * address, struct socket_sendbuffer *buffer);
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
+// iterate the packages in the buffer of SKYNET_SOCKET_TYPE_UDP_BATCH, *offset should be 0 at the beginning, return NULL at the end.
+const char * skynet_socket_udp_batch(const char *buffer, int size, int *offset, int *sz, const char **address, int *addrsz);
 
 struct socket_info * skynet_socket_info();
+// the histogram of the write buffer sizes, see socket_server_histogram
+#define SKYNET_SOCKET_HISTOGRAM 16
+void skynet_socket_histogram(uint64_t histogram[SKYNET_SOCKET_HISTOGRAM]);
+
+// A refcounted immutable send buffer, one payload can be queued to many sockets without copying.
+// Send it with the type SOCKET_BUFFER_OBJECT, each send consumes a reference (grab it before send),
+// and it is freed after the last reference released.
+struct skynet_socket_shared;
+
+struct skynet_socket_shared * skynet_socket_shared_new(const void *buffer, size_t sz);	// copy the buffer, ref = 1
+struct skynet_socket_shared * skynet_socket_shared_grab(struct skynet_socket_shared *);
+void skynet_socket_shared_release(struct skynet_socket_shared *);
+size_t skynet_socket_shared_size(struct skynet_socket_shared *);
+// send the shared buffer to n sockets (it doesn't consume the reference of caller), return the number of the valid ids.
+int skynet_socket_send_multi(struct skynet_context *ctx, const int ids[], int n, struct skynet_socket_shared *);
+int skynet_socket_send_multi_lowpriority(struct skynet_context *ctx, const int ids[], int n, struct skynet_socket_shared *);
 
 // legacy APIs
 
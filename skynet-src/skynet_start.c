@@ -1,3 +1,8 @@
+#ifdef __linux__
+// for pthread_setaffinity_np
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
@@ -5,10 +10,12 @@
 #include "skynet_handle.h"
 #include "skynet_module.h"
 #include "skynet_timer.h"
+#include "skynet_park.h"
 #include "skynet_monitor.h"
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "atomic.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -17,14 +24,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// The times an idle worker tries to find work before parking
+#define WORKER_SPIN 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define spin_pause() __builtin_ia32_pause()
+#else
+#define spin_pause() ((void)0)
+#endif
+
+struct affinity {
+	int n;
+	int *cpu;
+};
 
 struct monitor {
 	int count;
+	int socket_count;
 	struct skynet_monitor ** m;
-	pthread_cond_t cond;
-	pthread_mutex_t mutex;
-	int sleep;
-	int quit;
+	ATOM_INT quit;
+	struct affinity worker_cpu;
+	struct affinity socket_cpu;
+	struct affinity timer_cpu;
 };
 
 struct worker_parm {
@@ -33,6 +60,11 @@ struct worker_parm {
 	int weight;
 };
 
+struct socket_parm {
+	struct monitor *m;
+	int id;
+};
+
 static volatile int SIG = 0;
 
 static void
@@ -52,27 +84,100 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
+#ifdef __linux__
+#define MAX_CPU CPU_SETSIZE
+#else
+#define MAX_CPU 1024
+#endif
+
+// cpu list is like "0-7,16,18" , return the number of cpu, -1 for invalid list
+// the cpu index should be in [0, MAX_CPU) , or CPU_SET writes out of cpu_set_t
+static int
+parse_cpu_list(const char *list, int *cpu) {
+	int n = 0;
+	const char *p = list;
+	while (*p) {
+		char *endptr;
+		long from = strtol(p, &endptr, 10);
+		if (endptr == p || from < 0 || from >= MAX_CPU)
+			return -1;
+		long to = from;
+		p = endptr;
+		if (*p == '-') {
+			++p;
+			to = strtol(p, &endptr, 10);
+			if (endptr == p || to < from || to >= MAX_CPU)
+				return -1;
+			p = endptr;
+		}
+		long i;
+		for (i=from;i<=to;i++) {
+			if (cpu)
+				cpu[n] = (int)i;
+			++n;
+		}
+		while (*p == ',' || *p == ' ')
+			++p;
+	}
+	return n;
+}
+
+static void
+affinity_init(struct affinity *a, const char *name, const char *list) {
+	a->n = 0;
+	a->cpu = NULL;
+	if (list == NULL || list[0] == '\0')
+		return;
+	int n = parse_cpu_list(list, NULL);
+	if (n <= 0) {
+		fprintf(stderr, "Invalid %s : %s (cpu index should be in [0, %d))\n", name, list, MAX_CPU);
+		exit(1);
+	}
+	a->cpu = skynet_malloc(n * sizeof(int));
+	a->n = parse_cpu_list(list, a->cpu);
+}
+
+// bind current thread to the index-th cpu of the list, or all the cpus in the list when index < 0
 static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+affinity_bind(struct affinity *a, const char *name, int index) {
+	if (a->n == 0)
+		return;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (index < 0) {
+		int i;
+		for (i=0;i<a->n;i++) {
+			CPU_SET(a->cpu[i], &set);
+		}
+	} else {
+		CPU_SET(a->cpu[index % a->n], &set);
 	}
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		skynet_error(NULL, "error: bind %s thread (%d) to cpu failed : %s", name, index, strerror(err));
+	}
+#else
+	skynet_error(NULL, "error: cpu affinity of %s thread is not supported on this platform", name);
+#endif
 }
 
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
+	int id = sp->id;
 	skynet_initthread(THREAD_SOCKET);
+	// one socket thread uses all the cpus in the list, or bind each socket thread to one cpu
+	affinity_bind(&m->socket_cpu, "socket", m->socket_count > 1 ? id : -1);
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(id);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
 			continue;
 		}
-		wakeup(m,0);
 	}
 	return NULL;
 }
@@ -84,8 +189,9 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
+	skynet_free(m->worker_cpu.cpu);
+	skynet_free(m->socket_cpu.cpu);
+	skynet_free(m->timer_cpu.cpu);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -129,24 +235,22 @@ static void *
 thread_timer(void *p) {
 	struct monitor * m = p;
 	skynet_initthread(THREAD_TIMER);
+	affinity_bind(&m->timer_cpu, "timer", -1);
 	for (;;) {
 		skynet_updatetime();
 		skynet_socket_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);
-		usleep(2500);
+		skynet_timer_sleep();
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
 		}
 	}
-	// wakeup socket thread
+	// wakeup socket threads
 	skynet_socket_exit();
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
-	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	ATOM_STORE(&m->quit, 1);
+	skynet_park_exit();
 	return NULL;
 }
 
@@ -158,53 +262,68 @@ thread_worker(void *p) {
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
 	skynet_initthread(THREAD_WORKER);
+	// bind cpu before allocating the hot structures of the worker, so they are in the local NUMA node
+	affinity_bind(&m->worker_cpu, "worker", id);
+	skynet_mq_initworker(id);
 	struct message_queue * q = NULL;
-	while (!m->quit) {
+	int spinning = 0;
+	int spin = 0;
+	while (!ATOM_LOAD(&m->quit)) {
 		q = skynet_context_message_dispatch(sm, q, weight);
-		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
+		if (q) {
+			if (spinning) {
+				spinning = 0;
+				skynet_park_unspin();
 			}
+			continue;
 		}
+		// Spin for a while before parking, a burst of messages may come soon.
+		if (!spinning) {
+			spinning = skynet_park_spin();
+			spin = 0;
+		}
+		if (spinning && ++spin < WORKER_SPIN) {
+			spin_pause();
+			continue;
+		}
+		spin = 0;
+		spinning = skynet_park_wait(id, spinning);
+	}
+	if (spinning) {
+		skynet_park_unspin();
 	}
 	return NULL;
 }
 
 static void
-start(int thread) {
-	pthread_t pid[thread+3];
+start(struct skynet_config * config) {
+	int thread = config->thread;
+	int socket_thread = config->socket_thread;
+	pthread_t pid[thread+socket_thread+2];
 
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread;
-	m->sleep = 0;
+	m->socket_count = socket_thread;
+	ATOM_INIT(&m->quit, 0);
+	affinity_init(&m->worker_cpu, "worker_affinity", config->worker_affinity);
+	affinity_init(&m->socket_cpu, "socket_affinity", config->socket_affinity);
+	affinity_init(&m->timer_cpu, "timer_affinity", config->timer_affinity);
 
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
 	int i;
 	for (i=0;i<thread;i++) {
 		m->m[i] = skynet_monitor_new();
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
 
 	create_thread(&pid[0], thread_monitor, m);
 	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
+	struct socket_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+		create_thread(&pid[i+2], thread_socket, &sp[i]);
+	}
 
 	static int weight[] = { 
 		-1, -1, -1, -1, 0, 0, 0, 0,
@@ -220,10 +339,10 @@ start(int thread) {
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+socket_thread+2], thread_worker, &wp[i]);
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+socket_thread+2;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
@@ -254,6 +373,57 @@ bootstrap(struct skynet_context * logger, const char * cmdline) {
 	}
 }
 
+static int
+schedule_mode(const char *scheduler) {
+	if (strcmp(scheduler, "global") == 0) {
+		return SCHEDULE_GLOBAL;
+	} else if (strcmp(scheduler, "steal") == 0) {
+		return SCHEDULE_STEAL;
+	}
+	fprintf(stderr, "Invalid scheduler %s, use global or steal\n", scheduler);
+	exit(1);
+}
+
+static int
+adaptive_weight(const char *weight) {
+	if (strcmp(weight, "static") == 0) {
+		return 0;
+	} else if (strcmp(weight, "adaptive") == 0) {
+		return 1;
+	}
+	fprintf(stderr, "Invalid weight %s, use static or adaptive\n", weight);
+	exit(1);
+}
+
+static int
+timer_mode(const char *timer) {
+	if (strcmp(timer, "tick") == 0) {
+		return 0;
+	} else if (strcmp(timer, "tickless") == 0) {
+		return 1;
+	}
+	fprintf(stderr, "Invalid timer %s, use tick or tickless\n", timer);
+	exit(1);
+}
+
+static int
+timer_resolution(int ms) {
+	if (ms <= 0 || 10 % ms != 0) {
+		fprintf(stderr, "Invalid timer_resolution %d, use 1, 2, 5 or 10\n", ms);
+		exit(1);
+	}
+	return ms;
+}
+
+static int
+socket_thread(int n) {
+	if (n <= 0) {
+		fprintf(stderr, "Invalid socket_thread %d\n", n);
+		exit(1);
+	}
+	return n;
+}
+
 void 
 skynet_start(struct skynet_config * config) {
 	// register SIGHUP for log file reopen
@@ -270,11 +440,13 @@ skynet_start(struct skynet_config * config) {
 	}
 	skynet_harbor_init(config->harbor);
 	skynet_handle_init(config->harbor);
-	skynet_mq_init();
+	skynet_mq_init(schedule_mode(config->scheduler), config->thread);
+	skynet_park_init(config->thread);
 	skynet_module_init(config->module_path);
-	skynet_timer_init();
-	skynet_socket_init();
+	skynet_timer_init(timer_mode(config->timer), timer_resolution(config->timer_resolution));
+	skynet_socket_init(socket_thread(config->socket_thread));
 	skynet_profile_enable(config->profile);
+	skynet_adaptive_enable(adaptive_weight(config->weight));
 
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
 	if (ctx == NULL) {
@@ -286,7 +458,7 @@ skynet_start(struct skynet_config * config) {
 
 	bootstrap(ctx, config->bootstrap);
 
-	start(config->thread);
+	start(config);
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
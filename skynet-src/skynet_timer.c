@@ -5,7 +5,9 @@
 #include "skynet_server.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
+#include <pthread.h>
 #include <time.h>
 #include <assert.h>
 #include <string.h>
@@ -21,47 +23,252 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+// The timer thread wakes up at least every TIMER_MAX_SLEEP ms in tickless mode, for the socket time and quit checking.
+#define TIMER_MAX_SLEEP 100
+
+// The timer nodes are allocated in slabs of TIMER_SLAB nodes, and never return to the system.
+#define TIMER_SLAB 1024
+#define TIMER_HASH_INIT 1024
+// The number of insertion shards, must be power of 2
+#define TIMER_SHARD 64
+#define CACHE_LINE 64
+
 struct timer_event {
 	uint32_t handle;
 	int session;
 };
 
+/*
+	A node is linked in a circular list of the wheel (with a sentinel head), so it can be unlinked in O(1).
+	It's in the hash of (handle, session) until it's dispatched or cancelled.
+ */
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;
+	struct timer_node *hash_next;
+	struct timer_node **hash_prev;
 	uint32_t expire;
+	struct timer_event event;
+	uint64_t point;	// the clock tick it expires, for the node in the shard
 };
 
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
+struct timer_hash {
+	int size;	// power of 2
+	int count;
+	struct timer_node **slot;
+};
+
+/*
+	skynet_timeout doesn't touch the wheel. It appends the node to the shard of the service handle,
+	and the timer thread merges the shards into the wheel before advancing it.
+	A service runs in one worker at a time, so the shard lock is rarely contended.
+	The node pool is in the shard too, the timer thread returns the nodes by the lock-free recycle stack.
+ */
+struct timer_shard {
+	struct spinlock lock;
+	ATOM_POINTER head;	// pending nodes, set in lock, and the timer thread peeks it without lock
+	struct timer_node *tail;
+	struct timer_node *freelist;
+	ATOM_POINTER recycle;	// the nodes dispatched or cancelled by other threads
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+	The wheel time (T->time) is counted in ticks, a tick is T->resolution ms (10 ms by default, 1/100 second).
+	The bitmaps mark the non-empty lists, so timer_advance can jump over the ticks without any timer.
+	In tickless mode, the timer thread sleeps until the next tick has something to do, and timer_add
+	wakes it up if the new timer expires earlier than T->wakeup_point.
+ */
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
+	uint64_t near_bits[TIME_NEAR / 64];
+	uint64_t level_bits[4];
 	struct spinlock lock;
 	uint32_t time;
 	uint32_t starttime;
-	uint64_t current;
-	uint64_t current_point;
+	uint64_t current;	// in ticks
+	uint64_t current_point;	// in ticks
+	int resolution;	// ms per tick
+	int tick_per_cs;
+	int tickless;
+	ATOM_ULONG wakeup_point;	// the clock tick the sleeping timer thread wakes up, 0 when it's awake
+	uint64_t origin;	// current at origin_point, for skynet_now in tickless mode
+	uint64_t origin_point;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int signal;
+	struct timer_hash hash;
+	struct timer_shard shard[TIMER_SHARD];
 };
 
 static struct timer * TI = NULL;
 
+static inline void
+link_init(struct link_list *list) {
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+}
+
+static inline int
+link_empty(struct link_list *list) {
+	return list->head.next == &list->head;
+}
+
+// detach all the nodes as a NULL terminated list
 static inline struct timer_node *
 link_clear(struct link_list *list) {
-	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	struct timer_node * ret = NULL;
+	if (!link_empty(list)) {
+		ret = list->head.next;
+		list->head.prev->next = NULL;
+	}
+	link_init(list);
 
 	return ret;
 }
 
 static inline void
 link(struct link_list *list,struct timer_node *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	struct timer_node *tail = list->head.prev;
+	node->prev = tail;
+	node->next = &list->head;
+	tail->next = node;
+	list->head.prev = node;
+}
+
+static inline void
+unlink_node(struct timer_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static inline struct timer_shard *
+get_shard(struct timer *T, uint32_t handle) {
+	return &T->shard[handle & (TIMER_SHARD - 1)];
+}
+
+// call it in the shard lock
+static struct timer_node *
+node_alloc(struct timer_shard *S) {
+	struct timer_node *node = S->freelist;
+	if (node == NULL) {
+		// take all the recycled nodes
+		uintptr_t recycle;
+		do {
+			recycle = ATOM_LOAD(&S->recycle);
+		} while (recycle && !ATOM_CAS_POINTER(&S->recycle, recycle, (uintptr_t)NULL));
+		node = (struct timer_node *)recycle;
+	}
+	if (node == NULL) {
+		struct timer_node *slab = (struct timer_node *)skynet_malloc(TIMER_SLAB * sizeof(*slab));
+		int i;
+		for (i=1;i<TIMER_SLAB-1;i++) {
+			slab[i].next = &slab[i+1];
+		}
+		slab[TIMER_SLAB-1].next = NULL;
+		node = slab;
+		S->freelist = &slab[1];
+	} else {
+		S->freelist = node->next;
+	}
+	return node;
+}
+
+// return the node to its shard from any thread (lock-free push)
+static void
+node_recycle(struct timer *T, struct timer_node *node) {
+	struct timer_shard *S = get_shard(T, node->event.handle);
+	uintptr_t head;
+	do {
+		head = ATOM_LOAD(&S->recycle);
+		node->next = (struct timer_node *)head;
+	} while (!ATOM_CAS_POINTER(&S->recycle, head, (uintptr_t)node));
+}
+
+static inline uint32_t
+hash_key(uint32_t handle, int session) {
+	return (handle * 0x9e3779b1u) ^ (uint32_t)session;
+}
+
+static void
+hash_insert(struct timer_hash *h, struct timer_node *node);
+
+static void
+hash_expand(struct timer_hash *h) {
+	struct timer_node **old = h->slot;
+	int old_size = h->size;
+	h->size *= 2;
+	h->count = 0;
+	h->slot = (struct timer_node **)skynet_malloc(h->size * sizeof(struct timer_node *));
+	memset(h->slot, 0, h->size * sizeof(struct timer_node *));
+	int i;
+	for (i=0;i<old_size;i++) {
+		struct timer_node *node = old[i];
+		while (node) {
+			struct timer_node *next = node->hash_next;
+			hash_insert(h, node);
+			node = next;
+		}
+	}
+	skynet_free(old);
+}
+
+static void
+hash_insert(struct timer_hash *h, struct timer_node *node) {
+	if (h->count >= h->size) {
+		hash_expand(h);
+	}
+	struct timer_node **slot = &h->slot[hash_key(node->event.handle, node->event.session) & (h->size - 1)];
+	node->hash_next = *slot;
+	if (*slot) {
+		(*slot)->hash_prev = &node->hash_next;
+	}
+	node->hash_prev = slot;
+	*slot = node;
+	++h->count;
+}
+
+static inline void
+hash_remove(struct timer_hash *h, struct timer_node *node) {
+	*node->hash_prev = node->hash_next;
+	if (node->hash_next) {
+		node->hash_next->hash_prev = node->hash_prev;
+	}
+	--h->count;
+}
+
+static struct timer_node *
+hash_find(struct timer_hash *h, uint32_t handle, int session) {
+	struct timer_node *node = h->slot[hash_key(handle, session) & (h->size - 1)];
+	while (node) {
+		if (node->event.handle == handle && node->event.session == session)
+			return node;
+		node = node->hash_next;
+	}
+	return NULL;
+}
+
+static inline uint64_t
+gettick(struct timer *T) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	uint64_t ms = (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+	return ms / T->resolution;
+}
+
+// the lowest set bit at or after the position from, -1 for none
+static inline int
+next_bit(uint64_t bits, int from) {
+	if (from >= 64)
+		return -1;
+	bits &= ~(uint64_t)0 << from;
+	if (bits == 0)
+		return -1;
+	return __builtin_ctzll(bits);
 }
 
 static void
@@ -70,7 +277,9 @@ add_node(struct timer *T,struct timer_node *node) {
 	uint32_t current_time=T->time;
 	
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		int idx = time&TIME_NEAR_MASK;
+		link(&T->near[idx],node);
+		T->near_bits[idx / 64] |= (uint64_t)1 << (idx % 64);
 	} else {
 		int i;
 		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
@@ -81,26 +290,82 @@ add_node(struct timer *T,struct timer_node *node) {
 			mask <<= TIME_LEVEL_SHIFT;
 		}
 
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+		int idx = (time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK;
+		link(&T->t[i][idx],node);
+		T->level_bits[i] |= (uint64_t)1 << idx;
 	}
 }
 
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
-
-	SPIN_LOCK(T);
-
-		node->expire=time+T->time;
-		add_node(T,node);
+timer_add(struct timer *T,struct timer_event *event,uint32_t time) {
+	// The wheel time falls behind the clock (the timer thread may be sleeping), so count from the clock.
+	uint64_t point = gettick(T) + time;
+	struct timer_shard *S = get_shard(T, event->handle);
+
+	SPIN_LOCK(S);
+
+		struct timer_node *node = node_alloc(S);
+		node->event = *event;
+		node->point = point;
+		node->next = NULL;
+		if (S->tail) {
+			S->tail->next = node;
+		} else {
+			ATOM_STORE(&S->head, (uintptr_t)node);
+		}
+		S->tail = node;
+
+	SPIN_UNLOCK(S);
+
+	// The timer thread stores wakeup_point before it checks the shards (see skynet_timer_sleep)
+	uint64_t wakeup = ATOM_LOAD(&T->wakeup_point);
+	while (point < wakeup) {
+		if (ATOM_CAS_ULONG(&T->wakeup_point, wakeup, point)) {
+			pthread_mutex_lock(&T->mutex);
+			T->signal = 1;
+			pthread_cond_signal(&T->cond);
+			pthread_mutex_unlock(&T->mutex);
+			break;
+		}
+		wakeup = ATOM_LOAD(&T->wakeup_point);
+	}
+}
 
-	SPIN_UNLOCK(T);
+// Move the nodes in the shards into the wheel, call it in the lock of T. return the number of nodes.
+static int
+timer_merge(struct timer *T) {
+	int n = 0;
+	int i;
+	for (i=0;i<TIMER_SHARD;i++) {
+		struct timer_shard *S = &T->shard[i];
+		if (ATOM_LOAD(&S->head) == 0)
+			continue;
+		SPIN_LOCK(S);
+		struct timer_node *node = (struct timer_node *)ATOM_LOAD(&S->head);
+		ATOM_STORE(&S->head, (uintptr_t)NULL);
+		S->tail = NULL;
+		SPIN_UNLOCK(S);
+		while (node) {
+			struct timer_node *next = node->next;
+			// expires at the next tick at least, the current tick is dispatched already
+			uint32_t time = 1;
+			if (node->point > T->current_point + 1) {
+				time = (uint32_t)(node->point - T->current_point);
+			}
+			node->expire = T->time + time;
+			add_node(T, node);
+			hash_insert(&T->hash, node);
+			node = next;
+			++n;
+		}
+	}
+	return n;
 }
 
 static void
 move_list(struct timer *T, int level, int idx) {
 	struct timer_node *current = link_clear(&T->t[level][idx]);
+	T->level_bits[level] &= ~((uint64_t)1 << idx);
 	while (current) {
 		struct timer_node *temp=current->next;
 		add_node(T,current);
@@ -134,7 +399,7 @@ timer_shift(struct timer *T) {
 static inline void
 dispatch_list(struct timer_node *current) {
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
+		struct timer_event * event = &current->event;
 		struct skynet_message message;
 		message.source = 0;
 		message.session = event->session;
@@ -143,9 +408,7 @@ dispatch_list(struct timer_node *current) {
 
 		skynet_context_push(event->handle, &message);
 		
-		struct timer_node * temp = current;
 		current=current->next;
-		skynet_free(temp);	
 	} while (current);
 }
 
@@ -153,56 +416,124 @@ static inline void
 timer_execute(struct timer *T) {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->near[idx].head.next) {
+	while (!link_empty(&T->near[idx])) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		struct timer_node *node;
+		// can't be cancelled after here
+		for (node = current; node; node = node->next) {
+			hash_remove(&T->hash, node);
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
 		dispatch_list(current);
+		while (current) {
+			struct timer_node *next = current->next;
+			node_recycle(T, current);
+			current = next;
+		}
 		SPIN_LOCK(T);
 	}
+	// the bit may be left by a cancelled timer
+	T->near_bits[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+}
+
+// The ticks from T->time to the next tick that timer_shift moves a list or timer_execute dispatches a list.
+static uint64_t
+next_event(struct timer *T) {
+	uint32_t ct = T->time;
+	int idx = ct & TIME_NEAR_MASK;
+	int i;
+	for (i=idx/64;i<TIME_NEAR/64;i++) {
+		int bit = next_bit(T->near_bits[i], i == idx/64 ? idx % 64 + 1 : 0);
+		if (bit >= 0) {
+			return i * 64 + bit - idx;
+		}
+	}
+	for (i=0;i<4;i++) {
+		int shift = TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT;
+		int bit = next_bit(T->level_bits[i], ((ct >> shift) & TIME_LEVEL_MASK) + 1);
+		if (bit >= 0) {
+			// the lower bits of ct are 0 when the list moves
+			uint32_t window = (i < 3) ? ct & ~(((uint32_t)1 << (shift + TIME_LEVEL_SHIFT)) - 1) : 0;
+			uint32_t event = window | ((uint32_t)bit << shift);
+			return (uint32_t)(event - ct);
+		}
+	}
+	// the time wraps around (move_list(T, 3, 0))
+	return ((uint64_t)1 << 32) - ct;
 }
 
-static void 
-timer_update(struct timer *T) {
+// Advance the wheel n ticks. It jumps over the ticks without timers, so it's O(expired timers) rather than O(n).
+static void
+timer_advance(struct timer *T, uint64_t n, uint64_t point) {
 	SPIN_LOCK(T);
 
-	// try to dispatch timeout 0 (rare condition)
-	timer_execute(T);
+	// merge before updating current_point, the nodes count the ticks from it
+	timer_merge(T);
 
-	// shift time first, and then dispatch timer message
-	timer_shift(T);
+	T->current_point = point;
+	T->current += n;
 
+	// try to dispatch timeout 0 (rare condition)
 	timer_execute(T);
 
+	while (n > 0) {
+		uint64_t step = next_event(T);
+		if (step > n) {
+			T->time += (uint32_t)n;
+			break;
+		}
+		T->time += (uint32_t)(step - 1);
+		n -= step;
+		// shift time first, and then dispatch timer message
+		timer_shift(T);
+		timer_execute(T);
+	}
+
 	SPIN_UNLOCK(T);
 }
 
 static struct timer *
 timer_create_timer() {
-	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
+	struct timer *r=(struct timer *)skynet_memalign(CACHE_LINE, sizeof(struct timer));
 	memset(r,0,sizeof(*r));
 
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 
 	SPIN_INIT(r)
 
 	r->current = 0;
+	ATOM_INIT(&r->wakeup_point, 0);
+	for (i=0;i<TIMER_SHARD;i++) {
+		struct timer_shard *S = &r->shard[i];
+		SPIN_INIT(S)
+		ATOM_INIT(&S->head, (uintptr_t)NULL);
+		S->tail = NULL;
+		S->freelist = NULL;
+		ATOM_INIT(&S->recycle, (uintptr_t)NULL);
+	}
+	r->hash.size = TIMER_HASH_INIT;
+	r->hash.count = 0;
+	r->hash.slot = (struct timer_node **)skynet_malloc(TIMER_HASH_INIT * sizeof(struct timer_node *));
+	memset(r->hash.slot, 0, TIMER_HASH_INIT * sizeof(struct timer_node *));
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+static int
+timeout_tick(uint32_t handle, int64_t time, int session) {
 	if (time <= 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -217,12 +548,26 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		if (time > INT32_MAX)
+			time = INT32_MAX;
+		timer_add(TI, &event, (uint32_t)time);
 	}
 
 	return session;
 }
 
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	return timeout_tick(handle, (int64_t)time * TI->tick_per_cs, session);
+}
+
+int
+skynet_timeout_ms(uint32_t handle, int64_t ms, int session) {
+	int res = TI->resolution;
+	int64_t tick = ms > 0 ? (ms + res - 1) / res : 0;
+	return timeout_tick(handle, tick, session);
+}
+
 // centisecond: 1/100 second
 static void
 systime(uint32_t *sec, uint32_t *cs) {
@@ -232,31 +577,101 @@ systime(uint32_t *sec, uint32_t *cs) {
 	*cs = (uint32_t)(ti.tv_nsec / 10000000);
 }
 
-static uint64_t
-gettime() {
-	uint64_t t;
-	struct timespec ti;
-	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
-	return t;
-}
-
 void
 skynet_updatetime(void) {
-	uint64_t cp = gettime();
+	uint64_t cp = gettick(TI);
 	if(cp < TI->current_point) {
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
+		SPIN_LOCK(TI);
 		TI->current_point = cp;
+		SPIN_UNLOCK(TI);
 	} else if (cp != TI->current_point) {
-		uint32_t diff = (uint32_t)(cp - TI->current_point);
-		TI->current_point = cp;
-		TI->current += diff;
-		int i;
-		for (i=0;i<diff;i++) {
-			timer_update(TI);
+		timer_advance(TI, cp - TI->current_point, cp);
+	}
+}
+
+void
+skynet_timer_sleep(void) {
+	struct timer *T = TI;
+	if (!T->tickless) {
+		// poll 4 times per tick
+		struct timespec ti;
+		ti.tv_sec = 0;
+		ti.tv_nsec = T->resolution * 250000;
+		nanosleep(&ti, NULL);
+		return;
+	}
+	uint64_t max_sleep = TIMER_MAX_SLEEP / T->resolution;
+	SPIN_LOCK(T);
+	timer_merge(T);
+	uint64_t tick = next_event(T);
+	if (tick > max_sleep)
+		tick = max_sleep;
+	if (tick == 0)
+		tick = 1;
+	uint64_t deadline = T->current_point + tick;
+	ATOM_STORE(&T->wakeup_point, deadline);
+	// The nodes added before storing wakeup_point may be missed by timer_add, check again.
+	int merged = timer_merge(T);
+	SPIN_UNLOCK(T);
+
+	uint64_t now = gettick(T);
+	if (!merged && deadline > now) {
+		// pthread_cond_timedwait uses CLOCK_REALTIME
+		uint64_t ms = (deadline - now) * T->resolution;
+		struct timespec ti;
+		clock_gettime(CLOCK_REALTIME, &ti);
+		uint64_t nsec = ti.tv_nsec + (ms % 1000) * 1000000;
+		ti.tv_sec += ms / 1000 + nsec / 1000000000;
+		ti.tv_nsec = nsec % 1000000000;
+		pthread_mutex_lock(&T->mutex);
+		if (!T->signal) {
+			pthread_cond_timedwait(&T->cond, &T->mutex, &ti);
 		}
+		T->signal = 0;
+		pthread_mutex_unlock(&T->mutex);
 	}
+
+	ATOM_STORE(&T->wakeup_point, 0);
+}
+
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer *T = TI;
+	SPIN_LOCK(T);
+	struct timer_node *node = hash_find(&T->hash, handle, session);
+	if (node) {
+		hash_remove(&T->hash, node);
+		// The bit of the list is left, timer_execute or move_list clears it later.
+		unlink_node(node);
+		node_recycle(T, node);
+	} else {
+		// not merged yet
+		struct timer_shard *S = get_shard(T, handle);
+		SPIN_LOCK(S);
+		struct timer_node *prev = NULL;
+		node = (struct timer_node *)ATOM_LOAD(&S->head);
+		while (node) {
+			if (node->event.handle == handle && node->event.session == session) {
+				if (prev) {
+					prev->next = node->next;
+				} else {
+					ATOM_STORE(&S->head, (uintptr_t)node->next);
+				}
+				if (S->tail == node) {
+					S->tail = prev;
+				}
+				node->next = S->freelist;
+				S->freelist = node;
+				break;
+			}
+			prev = node;
+			node = node->next;
+		}
+		SPIN_UNLOCK(S);
+	}
+	SPIN_UNLOCK(T);
+	return node != NULL;
 }
 
 uint32_t
@@ -266,16 +681,25 @@ skynet_starttime(void) {
 
 uint64_t 
 skynet_now(void) {
-	return TI->current;
+	if (TI->tickless) {
+		// The timer thread may sleep long, read the clock.
+		return (TI->origin + gettick(TI) - TI->origin_point) / TI->tick_per_cs;
+	}
+	return TI->current / TI->tick_per_cs;
 }
 
 void 
-skynet_timer_init(void) {
+skynet_timer_init(int tickless, int resolution) {
 	TI = timer_create_timer();
+	TI->resolution = resolution;
+	TI->tick_per_cs = 10 / resolution;
+	TI->tickless = tickless;
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
-	TI->current = current;
-	TI->current_point = gettime();
+	TI->current = (uint64_t)current * TI->tick_per_cs;
+	TI->current_point = gettick(TI);
+	TI->origin = TI->current;
+	TI->origin_point = TI->current_point;
 }
 
 // for profile
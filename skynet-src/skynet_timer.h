@@ -3,11 +3,16 @@
 
 #include <stdint.h>
 
+// time is in centisecond (1/100 second)
 int skynet_timeout(uint32_t handle, int time, int session);
+// round up to the timer resolution
+int skynet_timeout_ms(uint32_t handle, int64_t ms, int session);
 void skynet_updatetime(void);
+void skynet_timer_sleep(void);	// called by the timer thread between skynet_updatetime
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 
-void skynet_timer_init(void);
+// resolution is in ms, and must be a divisor of 10
+void skynet_timer_init(int tickless, int resolution);
 
 #endif
@@ -18,6 +18,10 @@ struct socket_info {
 	uint64_t write;
 	uint64_t rtime;
 	uint64_t wtime;
+	uint64_t rcall;	// read syscalls
+	uint64_t wcall;	// write syscalls
+	uint64_t arate;	// accepts per second, for listen socket
+	uint64_t drop;	// low priority bytes dropped above the high watermark
 	int64_t wbuffer;
 	uint8_t reading;
 	uint8_t writing;
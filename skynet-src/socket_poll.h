@@ -3,7 +3,18 @@
 
 #include <stdbool.h>
 
+#if defined(__linux__) && defined(USE_IO_URING)
+// The poller completes the read (recv and accept) itself, see struct event.
+#define SP_COMPLETION
+typedef struct sp_uring * poll_fd;
+#else
 typedef int poll_fd;
+#endif
+
+// How to read a socket, only the completion poller cares about it (sp_mode).
+#define SP_READ 0	// report the readable event
+#define SP_RECV 1	// receive stream data
+#define SP_ACCEPT 2	// accept connections
 
 struct event {
 	void * s;
@@ -11,6 +22,13 @@ struct event {
 	bool write;
 	bool error;
 	bool eof;
+#ifdef SP_COMPLETION
+	bool completed;	// read is completed by the poller
+	bool accept;	// result is the accepted fd
+	int result;	// the size of data, the accepted fd, or -errno
+	const void * data;	// the received data
+	int bid;
+#endif
 };
 
 static bool sp_invalid(poll_fd fd);
@@ -22,9 +40,19 @@ static int sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_e
 static int sp_wait(poll_fd, struct event *e, int max);
 static void sp_nonblocking(int sock);
 
+#ifdef SP_COMPLETION
+static void sp_mode(poll_fd, int sock, int mode);
+// give back the buffer or close the fd of a completed event
+static void sp_drop(poll_fd, struct event *e);
+#endif
+
 #ifdef __linux__
+#ifdef USE_IO_URING
+#include "socket_uring.h"
+#else
 #include "socket_epoll.h"
 #endif
+#endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #include "socket_kqueue.h"
@@ -0,0 +1,220 @@
+#include "skynet.h"
+
+#include "socket_pool.h"
+#include "spinlock.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+	The buffers are in size classes 64, 128, ... 64K (the read size of socket_server is always one of them),
+	the larger ones are not pooled.
+
+	Each thread has a cache for each class, the socket threads alloc from their caches and the worker threads
+	(the services) free to their caches. The cache moves half of the buffers to the shared depot of the class
+	when it's full, and takes a batch from the depot when it's empty, so the lock of the depot is rarely taken.
+
+	The buffer isn't the start of an allocation, so it must be released by socket_pool_free, never skynet_free.
+	The block is tagged while it's in use, socket_pool_free checks the tag to catch the buffers not from the pool
+	and the double free.
+ */
+
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASS 11
+#define POOL_LARGE POOL_CLASS
+#define CACHE_BYTES (256 * 1024)	// per class per thread
+#define DEPOT_BYTES (4 * 1024 * 1024)	// per class
+#define POOL_TAG 0x736b6e6574706f6fULL	// "sknetpoo"
+
+struct pool_block {
+	union {
+		struct pool_block *next;	// in the free list
+		int cls;	// in use
+	} u;
+	uint64_t tag;	// POOL_TAG in use, it also keeps the buffer aligned
+};
+
+struct pool_list {
+	struct pool_block *head;
+	int n;
+};
+
+struct pool_cache {
+	struct pool_list list[POOL_CLASS];
+};
+
+struct pool_depot {
+	struct spinlock lock;
+	struct pool_list list;
+};
+
+struct socket_pool {
+	pthread_key_t cache_key;
+	struct pool_depot depot[POOL_CLASS];
+};
+
+static struct socket_pool P;
+
+static inline int
+cache_limit(int cls) {
+	int n = CACHE_BYTES >> (cls + POOL_MIN_SHIFT);
+	return n < 8 ? 8 : n;
+}
+
+static inline int
+depot_limit(int cls) {
+	int n = DEPOT_BYTES >> (cls + POOL_MIN_SHIFT);
+	return n < 16 ? 16 : n;
+}
+
+static inline int
+size_class(size_t sz) {
+	int cls = 0;
+	size_t cap = 1 << POOL_MIN_SHIFT;
+	while (cap < sz) {
+		cap <<= 1;
+		if (++cls == POOL_CLASS)
+			break;
+	}
+	return cls;
+}
+
+// move n blocks from the head of list
+static struct pool_block *
+list_take(struct pool_list *list, int n, int *taken) {
+	struct pool_block *head = list->head;
+	struct pool_block *tail = head;
+	int i;
+	for (i=1;i<n && tail->u.next;i++) {
+		tail = tail->u.next;
+	}
+	list->head = tail->u.next;
+	list->n -= i;
+	tail->u.next = NULL;
+	*taken = i;
+	return head;
+}
+
+static void
+depot_push(int cls, struct pool_block *head, int n) {
+	struct pool_depot *d = &P.depot[cls];
+	struct pool_block *tail = head;
+	while (tail->u.next) {
+		tail = tail->u.next;
+	}
+	spinlock_lock(&d->lock);
+	if (d->list.n < depot_limit(cls)) {
+		tail->u.next = d->list.head;
+		d->list.head = head;
+		d->list.n += n;
+		head = NULL;
+	}
+	spinlock_unlock(&d->lock);
+	// the depot is full
+	while (head) {
+		struct pool_block *next = head->u.next;
+		skynet_free(head);
+		head = next;
+	}
+}
+
+static void
+cache_release(void *ud) {
+	struct pool_cache *c = ud;
+	int i;
+	for (i=0;i<POOL_CLASS;i++) {
+		struct pool_list *list = &c->list[i];
+		if (list->head) {
+			depot_push(i, list->head, list->n);
+		}
+	}
+	skynet_free(c);
+}
+
+static struct pool_cache *
+cache_get() {
+	struct pool_cache *c = pthread_getspecific(P.cache_key);
+	if (c == NULL) {
+		c = skynet_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		pthread_setspecific(P.cache_key, c);
+	}
+	return c;
+}
+
+void
+socket_pool_init() {
+	int i;
+	for (i=0;i<POOL_CLASS;i++) {
+		spinlock_init(&P.depot[i].lock);
+		P.depot[i].list.head = NULL;
+		P.depot[i].list.n = 0;
+	}
+	if (pthread_key_create(&P.cache_key, cache_release)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
+}
+
+void *
+socket_pool_alloc(size_t sz, size_t *cap) {
+	int cls = size_class(sz);
+	struct pool_block *b;
+	if (cls == POOL_LARGE) {
+		b = skynet_malloc(sizeof(*b) + sz);
+		b->u.cls = POOL_LARGE;
+		b->tag = POOL_TAG;
+		if (cap)
+			*cap = sz;
+		return b + 1;
+	}
+	struct pool_list *list = &cache_get()->list[cls];
+	if (list->head == NULL) {
+		struct pool_depot *d = &P.depot[cls];
+		spinlock_lock(&d->lock);
+		if (d->list.head) {
+			int n;
+			list->head = list_take(&d->list, cache_limit(cls) / 2, &n);
+			list->n = n;
+		}
+		spinlock_unlock(&d->lock);
+	}
+	b = list->head;
+	if (b) {
+		list->head = b->u.next;
+		--list->n;
+	} else {
+		b = skynet_malloc(sizeof(*b) + ((size_t)1 << (cls + POOL_MIN_SHIFT)));
+	}
+	b->u.cls = cls;
+	b->tag = POOL_TAG;
+	if (cap)
+		*cap = (size_t)1 << (cls + POOL_MIN_SHIFT);
+	return b + 1;
+}
+
+void
+socket_pool_free(void *buffer) {
+	if (buffer == NULL)
+		return;
+	struct pool_block *b = (struct pool_block *)buffer - 1;
+	assert(b->tag == POOL_TAG);
+	b->tag = 0;
+	int cls = b->u.cls;
+	if (cls == POOL_LARGE) {
+		skynet_free(b);
+		return;
+	}
+	struct pool_list *list = &cache_get()->list[cls];
+	b->u.next = list->head;
+	list->head = b;
+	if (++list->n > cache_limit(cls)) {
+		int n;
+		struct pool_block *half = list_take(list, list->n / 2, &n);
+		depot_push(cls, half, n);
+	}
+}
@@ -0,0 +1,13 @@
+#ifndef skynet_socket_pool_h
+#define skynet_socket_pool_h
+
+#include <stddef.h>
+
+// The pool of the received data buffers, the socket threads alloc them and the services free them.
+
+void socket_pool_init();
+// alloc a buffer not less than sz, the capacity (power of 2, >= 64) is returned by *cap if cap isn't NULL.
+void * socket_pool_alloc(size_t sz, size_t *cap);
+void socket_pool_free(void *buffer);
+
+#endif
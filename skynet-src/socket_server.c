@@ -1,21 +1,35 @@
+#ifdef __linux__
+// for recvmmsg/sendmmsg
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
+#include "socket_pool.h"
 #include "atomic.h"
 #include "spinlock.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#endif
 
 #define MAX_INFO 128
 // MAX_SOCKET will be 2^MAX_SOCKET_P
@@ -50,6 +64,15 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+#ifdef __linux__
+#define HAVE_MMSG
+#define UDP_BATCH 16	// the datagrams read/written by one recvmmsg/sendmmsg
+#else
+#define UDP_BATCH 1
+#endif
+
+#define CTRL_RING 1024	// the slots of ctrl command ring
+
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
 #define AGAIN_WOULDBLOCK EAGAIN : case EWOULDBLOCK
@@ -59,8 +82,18 @@
 
 #define WARNING_SIZE (1024*1024)
 
+// the buckets of the write buffer histogram are [0,1K) [1K,2K) [2K,4K) ... [8M,16M) [16M,inf)
+#define HISTOGRAM_SHIFT 10
+
 #define USEROBJECT ((size_t)(-1))
 
+// the max number of buffers written by one writev
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 256
+#endif
+
 struct write_buffer {
 	struct write_buffer * next;
 	const void *buffer;
@@ -84,6 +117,12 @@ struct socket_stat {
 	uint64_t wtime;
 	uint64_t read;
 	uint64_t write;
+	uint64_t rcall;	// read syscalls
+	uint64_t wcall;	// write syscalls
+	uint64_t asec;	// the second of acount
+	uint64_t acount;	// accepts in asec
+	uint64_t arate;	// accepts in the second before asec
+	uint64_t drop;	// low priority bytes dropped above the high watermark
 };
 
 struct socket {
@@ -100,8 +139,11 @@ struct socket {
 	bool reading;
 	bool writing;
 	bool closing;
+	bool throttled;	// reading is paused by the high watermark
 	ATOM_INT udpconnecting;
 	int64_t warn_size;
+	int64_t wm_high;	// 0 : no watermark
+	int64_t wm_low;
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
@@ -110,24 +152,75 @@ struct socket {
 	int dw_offset;
 	const void * dw_buffer;
 	size_t dw_size;
+#ifdef SP_COMPLETION
+	// the recv completions in flight when reading is paused, see hold_completion
+	char * held;
+	int held_size;
+	int held_cap;
+	int held_result;	// 0 : none, 1 : eof, < 0 : -errno
+	bool held_queued;
+	struct socket * held_next;
+#endif
 };
 
-struct socket_server {
-	volatile uint64_t time;
+/*
+	The ctrl commands are sent by a multi producer / single consumer ring (Dmitry Vyukov's bounded queue).
+	A producer claims a slot by increasing tail, waits until the slot is free (the ring is full),
+	copies the command into it and publishes it by the sequence number :
+		seq == pos : the slot is free for the producer at pos
+		seq == pos + 1 : the command at pos is published
+		seq == pos + CTRL_RING : the command is consumed, the slot is free for the producer at pos + CTRL_RING
+	The socket thread sets sleeping before waiting for the events, and the producer who clears it
+	signals wake_fd (eventfd), so no syscall is needed when the socket thread is busy.
+ */
+struct ctrl_slot {
+	ATOM_SIZET seq;
+	int type;
+	int len;
+	union {
+		uint8_t buffer[256];
+		uint64_t align;
+	} u;
+};
+
+struct ctrl_ring {
+	ATOM_SIZET tail;	// producers
+	size_t head;	// consumer only
+	struct ctrl_slot slot[CTRL_RING];
+};
+
+/*
+	Each poller is polled by one socket thread, it has its own event pool and ctrl ring.
+	A socket belongs to the poller (id % poller_n), all the ctrl commands of it are sent to that poller,
+	so only one thread changes the socket (except the direct write).
+ */
+struct socket_poller {
 	int reserve_fd;	// for EMFILE
-	int recvctrl_fd;
-	int sendctrl_fd;
+	int wake_fd[2];	// read and write end, they are the same eventfd on linux
+	ATOM_INT sleeping;
 	int checkctrl;
 	poll_fd event_fd;
-	ATOM_INT alloc_id;
 	int event_n;
 	int event_index;
-	struct socket_object_interface soi;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
 	char buffer[MAX_INFO];
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+	struct udp_arena *udp;	// created at the first udp read
+	struct send_multi *multi;	// the rest of a send_multi command, see socket_server_send_multi
+	struct pending_accept *pending;	// an accepted socket waiting for the ctrl ring of its poller, see report_accept
+	ATOM_ULONG histogram[SOCKET_HISTOGRAM];	// the write buffer size of the sockets when a package is queued, read by socket_server_histogram
+#ifdef SP_COMPLETION
+	struct socket *held;	// the resumed sockets with held completions
+#endif
+	struct ctrl_ring ctrl;
+};
+
+struct socket_server {
+	volatile uint64_t time;
+	ATOM_INT alloc_id;
+	int poller_n;
+	struct socket_poller *poller;
+	struct socket_object_interface soi;
+	struct socket slot[MAX_SOCKET];
 };
 
 struct request_open {
@@ -143,6 +236,19 @@ struct request_send {
 	const void * buffer;
 };
 
+// one buffer (a USEROBJECT) for n sockets of the same poller
+struct send_multi {
+	int priority;
+	int n;
+	int index;	// the ids before index are sent
+	const void * buffer;
+	int id[1];
+};
+
+struct request_send_multi {
+	struct send_multi *m;
+};
+
 struct request_send_udp {
 	struct request_send send;
 	uint8_t address[UDP_ADDRESS_SIZE];
@@ -183,6 +289,12 @@ struct request_setopt {
 	int value;
 };
 
+struct request_watermark {
+	int id;
+	int64_t high;
+	int64_t low;
+};
+
 struct request_udp {
 	int id;
 	int fd;
@@ -190,6 +302,12 @@ struct request_udp {
 	uintptr_t opaque;
 };
 
+struct request_accept {
+	int id;
+	int fd;
+	uintptr_t opaque;
+};
+
 struct request_dial_udp {
 	int id;
 	int fd;
@@ -210,14 +328,16 @@ struct request_dial_udp {
 	D Send package (high)
 	P Send package (low)
 	A Send UDP package
+	M Send a package to multiple sockets
 	C set udp address
 	N client dial to UDP host port
 	T Set opt
+	H Set the write buffer watermarks
 	U Create UDP socket
+	I Add accepted socket (from the poller of listen socket)
  */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -228,9 +348,12 @@ struct request_package {
 		struct request_bind bind;
 		struct request_resumepause resumepause;
 		struct request_setopt setopt;
+		struct request_watermark watermark;
 		struct request_udp udp;
 		struct request_setudp set_udp;
 		struct request_dial_udp dial_udp;
+		struct request_accept accept;
+		struct request_send_multi send_multi;
 	} u;
 	uint8_t dummy[256];
 };
@@ -241,6 +364,22 @@ union sockaddr_all {
 	struct sockaddr_in6 v6;
 };
 
+struct pending_accept {
+	struct request_accept request;
+	int listen_id;
+	union sockaddr_all addr;
+};
+
+// the packets of one recvmmsg, reused by all the udp sockets of a poller
+struct udp_arena {
+#ifdef HAVE_MMSG
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+#endif
+	union sockaddr_all addr[UDP_BATCH];
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];
+};
+
 struct send_object {
 	const void * buffer;
 	size_t sz;
@@ -288,6 +427,11 @@ socket_unlock(struct socket_lock *sl) {
 	}
 }
 
+static inline struct socket_poller *
+socket_poller(struct socket_server *ss, int id) {
+	return &ss->poller[(unsigned)id % ss->poller_n];
+}
+
 static inline int
 socket_invalid(struct socket *s, int id) {
 	return (s->id != id || ATOM_LOAD(&s->type) == SOCKET_TYPE_INVALID);
@@ -386,36 +530,105 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
-struct socket_server * 
-socket_server_create(uint64_t time) {
-	int i;
-	int fd[2];
+static int
+wake_open(int fd[2]) {
+#ifdef __linux__
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return 1;
+	fd[0] = fd[1] = efd;
+#else
+	if (pipe(fd))
+		return 1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+static void
+wake_close(int fd[2]) {
+	close(fd[0]);
+	if (fd[1] != fd[0])
+		close(fd[1]);
+}
+
+static int
+poller_init(struct socket_poller *p) {
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
 		skynet_error(NULL, "socket-server error: create event pool failed.");
-		return NULL;
+		return 1;
 	}
-	if (pipe(fd)) {
+	if (wake_open(p->wake_fd)) {
 		sp_release(efd);
-		skynet_error(NULL, "socket-server error: create socket pair failed.");
-		return NULL;
+		skynet_error(NULL, "socket-server error: create wake fd failed.");
+		return 1;
 	}
-	if (sp_add(efd, fd[0], NULL)) {
-		// add recvctrl_fd to event poll
+	if (sp_add(efd, p->wake_fd[0], NULL)) {
+		// add wake fd to event poll
 		skynet_error(NULL, "socket-server error: can't add server fd to event pool.");
-		close(fd[0]);
-		close(fd[1]);
+		wake_close(p->wake_fd);
 		sp_release(efd);
-		return NULL;
+		return 1;
+	}
+	p->event_fd = efd;
+	ATOM_INIT(&p->sleeping, 0);
+	p->checkctrl = 1;
+	p->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
+	p->udp = NULL;
+	p->multi = NULL;
+	p->pending = NULL;
+#ifdef SP_COMPLETION
+	p->held = NULL;
+#endif
+	p->event_n = 0;
+	p->event_index = 0;
+	struct ctrl_ring *r = &p->ctrl;
+	ATOM_INIT(&r->tail, 0);
+	r->head = 0;
+	int i;
+	for (i=0;i<CTRL_RING;i++) {
+		ATOM_INIT(&r->slot[i].seq, i);
+	}
+	for (i=0;i<SOCKET_HISTOGRAM;i++) {
+		ATOM_INIT(&p->histogram[i], 0);
+	}
+	return 0;
+}
+
+static void
+poller_release(struct socket_poller *p) {
+	wake_close(p->wake_fd);
+	sp_release(p->event_fd);
+	if (p->reserve_fd >= 0)
+		close(p->reserve_fd);
+	FREE(p->udp);
+	if (p->pending) {
+		close(p->pending->request.fd);
+		FREE(p->pending);
+	}
+}
+
+struct socket_server * 
+socket_server_create(uint64_t time, int poller_n) {
+	int i;
+	assert(poller_n > 0);
+	struct socket_poller *poller = MALLOC(poller_n * sizeof(struct socket_poller));
+	for (i=0;i<poller_n;i++) {
+		if (poller_init(&poller[i])) {
+			while (--i >= 0) {
+				poller_release(&poller[i]);
+			}
+			FREE(poller);
+			return NULL;
+		}
 	}
 
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->time = time;
-	ss->event_fd = efd;
-	ss->recvctrl_fd = fd[0];
-	ss->sendctrl_fd = fd[1];
-	ss->checkctrl = 1;
-	ss->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
+	ss->poller_n = poller_n;
+	ss->poller = poller;
 
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];
@@ -423,13 +636,17 @@ socket_server_create(uint64_t time) {
 		clear_wb_list(&s->high);
 		clear_wb_list(&s->low);
 		spinlock_init(&s->dw_lock);
+#ifdef SP_COMPLETION
+		s->held = NULL;
+		s->held_size = 0;
+		s->held_cap = 0;
+		s->held_result = 0;
+		s->held_queued = false;
+		s->held_next = NULL;
+#endif
 	}
 	ATOM_INIT(&ss->alloc_id , 0);
-	ss->event_n = 0;
-	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
@@ -500,7 +717,7 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	assert(type != SOCKET_TYPE_RESERVE);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
-	sp_del(ss->event_fd, s->fd);
+	sp_del(socket_poller(ss, s->id)->event_fd, s->fd);
 	socket_lock(l);
 	if (type != SOCKET_TYPE_BIND) {
 		if (close(s->fd) < 0) {
@@ -518,6 +735,14 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		s->dw_buffer = NULL;
 	}
 	socket_unlock(l);
+#ifdef SP_COMPLETION
+	// keep held_next, the poller skips it in forward_held
+	FREE(s->held);
+	s->held = NULL;
+	s->held_size = 0;
+	s->held_cap = 0;
+	s->held_result = 0;
+#endif
 }
 
 void 
@@ -533,11 +758,18 @@ socket_server_release(struct socket_server *ss) {
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
-	if (ss->reserve_fd >= 0)
-		close(ss->reserve_fd);
+	for (i=0;i<ss->poller_n;i++) {
+		struct socket_poller *p = &ss->poller[i];
+		struct send_multi *m = p->multi;
+		if (m) {
+			for (;m->index < m->n; m->index++) {
+				ss->soi.free((void *)m->buffer);
+			}
+			FREE(m);
+		}
+		poller_release(p);
+	}
+	FREE(ss->poller);
 	FREE(ss);
 }
 
@@ -551,41 +783,66 @@ static inline int
 enable_write(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->writing != enable) {
 		s->writing = enable;
-		return sp_enable(ss->event_fd, s->fd, s, s->reading, enable);
+		return sp_enable(socket_poller(ss, s->id)->event_fd, s->fd, s, s->reading, enable);
 	}
 	return 0;
 }
 
+#ifdef SP_COMPLETION
+
+static void
+queue_held(struct socket_server *ss, struct socket *s) {
+	if ((s->held_size > 0 || s->held_result) && !s->held_queued) {
+		struct socket_poller *p = socket_poller(ss, s->id);
+		s->held_queued = true;
+		s->held_next = p->held;
+		p->held = s;
+	}
+}
+
+#endif
+
 static inline int
 enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->reading != enable) {
 		s->reading = enable;
-		return sp_enable(ss->event_fd, s->fd, s, enable, s->writing);
+#ifdef SP_COMPLETION
+		if (enable) {
+			queue_held(ss, s);
+		}
+#endif
+		return sp_enable(socket_poller(ss, s->id)->event_fd, s->fd, s, enable, s->writing);
 	}
 	return 0;
 }
 
 static struct socket *
-new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool reading) {
+new_fd(struct socket_server *ss, int id, int fd, int protocol, int mode, uintptr_t opaque, bool reading) {
 	struct socket * s = &ss->slot[HASH_ID(id)];
 	assert(ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE);
 
-	if (sp_add(ss->event_fd, fd, s)) {
+	if (sp_add(socket_poller(ss, id)->event_fd, fd, s)) {
 		ATOM_STORE(&s->type, SOCKET_TYPE_INVALID);
 		return NULL;
 	}
+#ifdef SP_COMPLETION
+	sp_mode(socket_poller(ss, id)->event_fd, fd, mode);
+#endif
 
 	s->id = id;
 	s->fd = fd;
 	s->reading = true;
 	s->writing = false;
 	s->closing = false;
+	s->throttled = false;
 	ATOM_INIT(&s->sending , ID_TAG16(id) << 16 | 0);
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
 	s->warn_size = 0;
+	s->wm_high = 0;
+	s->wm_low = 0;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	s->dw_buffer = NULL;
@@ -610,10 +867,23 @@ stat_write(struct socket_server *ss, struct socket *s, int n) {
 	s->stat.wtime = ss->time;
 }
 
+static inline void
+stat_accept(struct socket_server *ss, struct socket *s) {
+	uint64_t sec = ss->time / 100;
+	if (sec != s->stat.asec) {
+		s->stat.arate = (sec == s->stat.asec + 1) ? s->stat.acount : 0;
+		s->stat.asec = sec;
+		s->stat.acount = 0;
+	}
+	++s->stat.acount;
+	stat_read(ss,s,1);
+}
+
 // return -1 when connecting
 static int
 open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
 	int id = request->id;
+	struct socket_poller *p = socket_poller(ss, id);
 	result->opaque = request->opaque;
 	result->id = id;
 	result->ud = 0;
@@ -657,7 +927,8 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		goto _failed;
 	}
 
-	ns = new_fd(ss, id, sock, PROTOCOL_TCP, request->opaque, true);
+	// Don't read until connected, see report_connect
+	ns = new_fd(ss, id, sock, PROTOCOL_TCP, SP_RECV, request->opaque, status == 0);
 	if (ns == NULL) {
 		result->data = "reach skynet socket number limit";
 		goto _failed;
@@ -667,8 +938,8 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+			result->data = p->buffer;
 		}
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
@@ -723,34 +994,72 @@ close_write(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	}
 }
 
-static int
-send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+// pop the written buffers (sz bytes) of list, return the size left
+static size_t
+list_written(struct socket_server *ss, struct wb_list *list, size_t sz) {
 	while (list->head) {
 		struct write_buffer * tmp = list->head;
-		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
-			if (sz < 0) {
-				switch(errno) {
-				case EINTR:
-					continue;
-				case AGAIN_WOULDBLOCK:
-					return -1;
-				}
-				return close_write(ss, s, l, result);
-			}
-			stat_write(ss,s,(int)sz);
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
-				return -1;
-			}
-			break;
+		if (sz < tmp->sz) {
+			tmp->ptr += sz;
+			tmp->sz -= sz;
+			return 0;
 		}
+		sz -= tmp->sz;
 		list->head = tmp->next;
 		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
+	return sz;
+}
+
+static int
+list_iov(struct wb_list *list, struct iovec *iov, int n, size_t *sz) {
+	struct write_buffer * tmp;
+	for (tmp = list->head; tmp && n < MAX_IOV; tmp = tmp->next) {
+		iov[n].iov_base = tmp->ptr;
+		iov[n].iov_len = tmp->sz;
+		*sz += tmp->sz;
+		++n;
+	}
+	return n;
+}
+
+/*
+	Write the buffers of list, and then the buffers of next list (can be NULL), MAX_IOV buffers by one writev.
+	Stop when the kernel buffer is full (a partial write).
+ */
+static int
+send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct wb_list *next, struct socket_lock *l, struct socket_message *result) {
+	struct iovec iov[MAX_IOV];
+	for (;;) {
+		size_t total = 0;
+		int n = list_iov(list, iov, 0, &total);
+		if (next) {
+			n = list_iov(next, iov, n, &total);
+		}
+		if (n == 0)
+			break;
+		ssize_t sz = writev(s->fd, iov, n);
+		++s->stat.wcall;
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			return close_write(ss, s, l, result);
+		}
+		stat_write(ss,s,(int)sz);
+		s->wb_size -= sz;
+		size_t left = list_written(ss, list, sz);
+		if (next) {
+			list_written(ss, next, left);
+		}
+		if ((size_t)sz != total) {
+			return -1;
+		}
+	}
 
 	return -1;
 }
@@ -788,33 +1097,69 @@ drop_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struc
 	write_buffer_free(ss,tmp);
 }
 
+static void
+udp_sent(struct socket_server *ss, struct socket *s, struct wb_list *list) {
+	struct write_buffer * tmp = list->head;
+	stat_write(ss,s,tmp->sz);
+	s->wb_size -= tmp->sz;
+	list->head = tmp->next;
+	write_buffer_free(ss,tmp);
+}
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	union sockaddr_all sa[UDP_BATCH];
+#ifdef HAVE_MMSG
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+#endif
 	while (list->head) {
 		struct write_buffer * tmp = list->head;
-		struct write_buffer_udp * udp = (struct write_buffer_udp *)tmp;
-		union sockaddr_all sa;
-		socklen_t sasz = udp_socket_address(s, udp->udp_address, &sa);
-		if (sasz == 0) {
+		int n = 0;
+		socklen_t sasz;
+		for (;;) {
+			struct write_buffer_udp * udp = (struct write_buffer_udp *)tmp;
+			sasz = udp_socket_address(s, udp->udp_address, &sa[n]);
+			if (sasz == 0)
+				break;
+#ifdef HAVE_MMSG
+			iov[n].iov_base = (void *)tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			memset(&msg[n], 0, sizeof(msg[n]));
+			msg[n].msg_hdr.msg_name = &sa[n];
+			msg[n].msg_hdr.msg_namelen = sasz;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+#endif
+			tmp = tmp->next;
+			if (++n == UDP_BATCH || tmp == NULL)
+				break;
+		}
+		if (n == 0) {
 			skynet_error(NULL, "socket-server : udp (%d) error: type mismatch.", s->id);
-			drop_udp(ss, s, list, tmp);
+			drop_udp(ss, s, list, list->head);
 			return -1;
 		}
-		int err = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
-		if (err < 0) {
+#ifdef HAVE_MMSG
+		int sent = sendmmsg(s->fd, msg, n, 0);
+#else
+		tmp = list->head;
+		int sent = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa[0].s, sasz) < 0 ? -1 : 1;
+#endif
+		++s->stat.wcall;
+		if (sent < 0) {
 			switch(errno) {
 			case EINTR:
 			case AGAIN_WOULDBLOCK:
 				return -1;
 			}
 			skynet_error(NULL, "socket-server : udp (%d) sendto error %s.",s->id, strerror(errno));
-			drop_udp(ss, s, list, tmp);
+			drop_udp(ss, s, list, list->head);
 			return -1;
 		}
-		stat_write(ss,s,tmp->sz);
-		s->wb_size -= tmp->sz;
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
+		while (sent-- > 0) {
+			udp_sent(ss, s, list);
+		}
 	}
 	list->tail = NULL;
 
@@ -822,9 +1167,9 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 }
 
 static int
-send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct wb_list *next, struct socket_lock *l, struct socket_message *result) {
 	if (s->protocol == PROTOCOL_TCP) {
-		return send_list_tcp(ss, s, list, l, result);
+		return send_list_tcp(ss, s, list, next, l, result);
 	} else {
 		return send_list_udp(ss, s, list, result);
 	}
@@ -864,7 +1209,7 @@ send_buffer_empty(struct socket *s) {
 /*
 	Each socket has two write buffer list, high priority and low priority.
 
-	1. send high list as far as possible.
+	1. send high list as far as possible. (tcp sends low list after high list in the same writev)
 	2. If high list is empty, try to send low list.
 	3. If low list head is uncomplete (send a part before), move the head of low list to empty high list (call raise_uncomplete) .
 	4. If two lists are both empty, turn off the event. (call check_close)
@@ -873,7 +1218,7 @@ static int
 send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	assert(!list_uncomplete(&s->low));
 	// step 1
-	int ret = send_list(ss,s,&s->high,l,result);
+	int ret = send_list(ss,s,&s->high,&s->low,l,result);
 	if (ret != -1) {
 		if (ret == SOCKET_ERR) {
 			// HALFCLOSE_WRITE
@@ -885,14 +1230,17 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 	if (s->high.head == NULL) {
 		// step 2
 		if (s->low.head != NULL) {
-			int ret = send_list(ss,s,&s->low,l,result);
-			if (ret != -1) {
-				if (ret == SOCKET_ERR) {
-					// HALFCLOSE_WRITE
-					return SOCKET_ERR;
+			// tcp tried the low list in step 1 already, so the kernel buffer is full.
+			if (s->protocol != PROTOCOL_TCP) {
+				int ret = send_list(ss,s,&s->low,NULL,l,result);
+				if (ret != -1) {
+					if (ret == SOCKET_ERR) {
+						// HALFCLOSE_WRITE
+						return SOCKET_ERR;
+					}
+					// SOCKET_RST (ignore)
+					return -1;
 				}
-				// SOCKET_RST (ignore)
-				return -1;
 			}
 			// step 3
 			if (list_uncomplete(&s->low)) {
@@ -930,6 +1278,17 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 	return -1;
 }
 
+static int
+unthrottle_socket(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	s->throttled = false;
+	if (ATOM_LOAD(&s->type) == SOCKET_TYPE_CONNECTED && !s->closing) {
+		if (enable_read(ss, s, true)) {
+			return report_error(s, result, "enable read failed");
+		}
+	}
+	return -1;
+}
+
 static int
 send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	if (!socket_trylock(l))
@@ -953,11 +1312,54 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		s->dw_buffer = NULL;
 	}
 	int r = send_buffer_(ss,s,l,result);
+	if (s->throttled && s->wb_size <= s->wm_low) {
+		int err = unthrottle_socket(ss, s, result);
+		if (err != -1)
+			r = err;
+	}
 	socket_unlock(l);
 
 	return r;
 }
 
+/*
+	When the write buffer reaches the high watermark and the kernel buffer is full, the client is too slow
+	to catch up with the server, so the low priority packages are dropped (the queued ones and the later ones),
+	and the socket stops reading from the client (the client can't flood more requests) until the write buffer
+	drains to the low watermark. The high priority packages are never dropped, SOCKET_WARNING is still raised for them.
+ */
+static int
+throttle_socket(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	if (!s->throttled) {
+		// the commands may be handled before the write event, so flush it first, the fast client isn't throttled.
+		struct socket_lock l;
+		socket_lock_init(s, &l);
+		int ret = send_buffer(ss, s, &l, result);
+		if (ret != -1)
+			return ret;
+		if (ATOM_LOAD(&s->type) == SOCKET_TYPE_INVALID || s->wb_size < s->wm_high)
+			return -1;
+	}
+	// the head of low list is always complete here, see raise_uncomplete
+	struct write_buffer *wb = s->low.head;
+	while (wb) {
+		struct write_buffer *tmp = wb;
+		wb = wb->next;
+		s->wb_size -= tmp->sz;
+		s->stat.drop += tmp->sz;
+		write_buffer_free(ss, tmp);
+	}
+	s->low.head = NULL;
+	s->low.tail = NULL;
+	if (s->reading) {
+		s->throttled = true;
+		if (enable_read(ss, s, false)) {
+			return report_error(s, result, "disable read failed");
+		}
+	}
+	return -1;
+}
+
 static struct write_buffer *
 append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_send * request, int size) {
 	struct write_buffer * buf = MALLOC(size);
@@ -998,6 +1400,17 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 	s->wb_size += buf->sz;
 }
 
+static inline void
+stat_queue(struct socket_server *ss, struct socket *s) {
+	int64_t sz = s->wb_size >> HISTOGRAM_SHIFT;
+	int i = 0;
+	while (sz > 0 && i < SOCKET_HISTOGRAM - 1) {
+		sz >>= 1;
+		++i;
+	}
+	ATOM_FINC(&socket_poller(ss, s->id)->histogram[i]);
+}
+
 static int
 trigger_write(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
 	int id = request->id;
@@ -1053,6 +1466,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return -1;
 			}
 			int n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+			++s->stat.wcall;
 			if (n != so.sz) {
 				append_sendbuffer_udp(ss,s,priority,request,udp_address);
 			} else {
@@ -1067,6 +1481,11 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
+				if (s->throttled) {
+					s->stat.drop += so.sz;
+					so.free_func((void *)request->buffer);
+					return -1;
+				}
 				append_sendbuffer_low(ss, s, request);
 			} else {
 				append_sendbuffer(ss, s, request);
@@ -1078,6 +1497,12 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
+	stat_queue(ss, s);
+	if (s->wm_high > 0 && s->wb_size >= s->wm_high) {
+		int err = throttle_socket(ss, s, result);
+		if (err != -1)
+			return err;
+	}
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
 		result->opaque = s->opaque;
@@ -1093,10 +1518,13 @@ static int
 listen_socket(struct socket_server *ss, struct request_listen * request, struct socket_message *result) {
 	int id = request->id;
 	int listen_fd = request->fd;
-	struct socket *s = new_fd(ss, id, listen_fd, PROTOCOL_TCP, request->opaque, false);
+	struct socket_poller *p = socket_poller(ss, id);
+	struct socket *s = new_fd(ss, id, listen_fd, PROTOCOL_TCP, SP_ACCEPT, request->opaque, false);
 	if (s == NULL) {
 		goto _failed;
 	}
+	// accept may be called without the readable event, see report_accept
+	sp_nonblocking(listen_fd);
 	ATOM_STORE(&s->type , SOCKET_TYPE_PLISTEN);
 	result->opaque = request->opaque;
 	result->id = id;
@@ -1107,12 +1535,12 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 	socklen_t slen = sizeof(u);
 	if (getsockname(listen_fd, &u.s, &slen) == 0) {
 		void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-		if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer)) == 0) {
+		if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer)) == 0) {
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
-		result->data = ss->buffer;
+		result->data = p->buffer;
 		result->ud = sin_port;
 	} else {
 		result->data = strerror(errno);
@@ -1194,7 +1622,7 @@ bind_socket(struct socket_server *ss, struct request_bind *request, struct socke
 	result->id = id;
 	result->opaque = request->opaque;
 	result->ud = 0;
-	struct socket *s = new_fd(ss, id, request->fd, PROTOCOL_TCP, request->opaque, true);
+	struct socket *s = new_fd(ss, id, request->fd, PROTOCOL_TCP, SP_READ, request->opaque, true);
 	if (s == NULL) {
 		result->data = "reach skynet socket number limit";
 		return SOCKET_ERR;
@@ -1224,7 +1652,8 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	}
 	struct socket_lock l;
 	socket_lock_init(s, &l);
-	if (enable_read(ss, s, true)) {
+	// the throttled socket is resumed when the write buffer drains
+	if (!s->throttled && enable_read(ss, s, true)) {
 		result->data = "enable read failed";
 		return SOCKET_ERR;
 	}
@@ -1251,6 +1680,8 @@ pause_socket(struct socket_server *ss, struct request_resumepause *request, stru
 	if (socket_invalid(s, id)) {
 		return -1;
 	}
+	// the service pauses it, so don't resume it when the write buffer drains
+	s->throttled = false;
 	if (enable_read(ss, s, false)) {
 		return report_error(s, result, "enable read failed");
 	}
@@ -1268,34 +1699,111 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
+static int
+watermark_socket(struct socket_server *ss, struct request_watermark *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	if (socket_invalid(s, id) || s->protocol != PROTOCOL_TCP) {
+		return -1;
+	}
+	s->wm_high = request->high;
+	s->wm_low = request->low;
+	if (s->throttled && (s->wm_high == 0 || s->wb_size <= s->wm_low)) {
+		return unthrottle_socket(ss, s, result);
+	}
+	return -1;
+}
+
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
+poller_wake(struct socket_poller *p) {
+	uint64_t v = 1;
 	for (;;) {
-		int n = read(pipefd, buffer, sz);
+#ifdef __linux__
+		ssize_t n = write(p->wake_fd[1], &v, sizeof(v));
+#else
+		ssize_t n = write(p->wake_fd[1], &v, 1);
+#endif
 		if (n<0) {
 			if (errno == EINTR)
 				continue;
-			skynet_error(NULL, "socket-server : read pipe error %s.",strerror(errno));
-			return;
+			if (errno != AGAIN_WOULDBLOCK) {
+				// AGAIN_WOULDBLOCK : it's signaled already
+				skynet_error(NULL, "socket-server : wake socket thread error %s.", strerror(errno));
+			}
 		}
-		// must atomic read from a pipe
-		assert(n == sz);
 		return;
 	}
 }
 
+static void
+poller_publish(struct socket_poller *p, struct ctrl_slot *slot, size_t pos, struct request_package *request, char type, int len) {
+	slot->type = (uint8_t)type;
+	slot->len = len;
+	memcpy(slot->u.buffer, &request->u, len);
+	ATOM_STORE(&slot->seq, pos + 1);
+	if (ATOM_LOAD(&p->sleeping) && ATOM_FAND(&p->sleeping, 0)) {
+		poller_wake(p);
+	}
+}
+
+// for the service threads, wait when the ring is full
+static void
+poller_request(struct socket_poller *p, struct request_package *request, char type, int len) {
+	struct ctrl_ring *r = &p->ctrl;
+	size_t pos = ATOM_FINC(&r->tail);
+	struct ctrl_slot *slot = &r->slot[pos % CTRL_RING];
+	while (ATOM_LOAD(&slot->seq) != pos) {
+		// the ring is full, wait for the socket thread
+		sched_yield();
+	}
+	poller_publish(p, slot, pos, request, type, len);
+}
+
+// The socket threads can't wait for the ring of another poller, because that poller may wait for this one.
+// Claim the slot only when it's free, return 1 when the ring is full.
 static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
+poller_try_request(struct socket_poller *p, struct request_package *request, char type, int len) {
+	struct ctrl_ring *r = &p->ctrl;
+	for (;;) {
+		size_t pos = ATOM_LOAD(&r->tail);
+		struct ctrl_slot *slot = &r->slot[pos % CTRL_RING];
+		size_t seq = ATOM_LOAD(&slot->seq);
+		if (seq == pos) {
+			if (ATOM_CAS_SIZET(&r->tail, pos, pos + 1)) {
+				poller_publish(p, slot, pos, request, type, len);
+				return 0;
+			}
+		} else if ((intptr_t)(seq - pos) < 0) {
+			// the slot is not consumed in the last round
+			return 1;
+		}
+		// another producer claimed pos, retry
+	}
+}
 
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
+// send the request to the poller of socket id
+static inline void
+send_request(struct socket_server *ss, int id, struct request_package *request, char type, int len) {
+	poller_request(socket_poller(ss, id), request, type, len);
+}
 
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
+static inline int
+has_cmd(struct socket_poller *p) {
+	// the claimed commands are counted in, ctrl_cmd waits for them
+	return ATOM_LOAD(&p->ctrl.tail) != p->ctrl.head;
+}
+
+// read the wake fd until it's empty
+static void
+drain_wake(struct socket_poller *p) {
+	uint64_t tmp[8];
+	for (;;) {
+		ssize_t n = read(p->wake_fd[0], tmp, sizeof(tmp));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || p->wake_fd[0] == p->wake_fd[1])
+			return;
 	}
-	return 0;
 }
 
 static void
@@ -1307,7 +1815,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	} else {
 		protocol = PROTOCOL_UDP;
 	}
-	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
+	struct socket *ns = new_fd(ss, id, udp->fd, protocol, SP_READ, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
 		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
@@ -1343,7 +1851,7 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 	int id = request->id;
 	int protocol = request->address[0];
 
-	struct socket *ns = new_fd(ss, id, request->fd, protocol, request->opaque, true);
+	struct socket *ns = new_fd(ss, id, request->fd, protocol, SP_READ, request->opaque, true);
 	if (ns == NULL){
 		close(request->fd);
 		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
@@ -1362,6 +1870,19 @@ dial_udp_socket(struct socket_server *ss, struct request_dial_udp *request, stru
 	return -1;
 }
 
+static int
+accept_socket(struct socket_server *ss, struct request_accept *request) {
+	int id = request->id;
+	struct socket *ns = new_fd(ss, id, request->fd, PROTOCOL_TCP, SP_RECV, request->opaque, false);
+	if (ns == NULL) {
+		// SOCKET_ACCEPT is reported already, socket_server_start will raise an error.
+		close(request->fd);
+		return -1;
+	}
+	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
+	return -1;
+}
+
 static inline void
 inc_sending_ref(struct socket *s, int id) {
 	if (s->protocol != PROTOCOL_TCP)
@@ -1394,18 +1915,49 @@ dec_sending_ref(struct socket_server *ss, int id) {
 	}
 }
 
+// send the buffer to each socket, stop at the first result and keep the rest in p->multi
+static int
+send_multi(struct socket_server *ss, struct socket_poller *p, struct send_multi *m, struct socket_message *result) {
+	p->multi = NULL;
+	while (m->index < m->n) {
+		struct request_send request;
+		request.id = m->id[m->index++];
+		request.sz = USEROBJECT;
+		request.buffer = m->buffer;
+		int ret = send_socket(ss, &request, result, m->priority, NULL);
+		dec_sending_ref(ss, request.id);
+		if (ret != -1) {
+			if (m->index < m->n) {
+				p->multi = m;
+			} else {
+				FREE(m);
+			}
+			return ret;
+		}
+	}
+	FREE(m);
+	return -1;
+}
+
 // return type
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
+ctrl_cmd(struct socket_server *ss, struct socket_poller *p, struct socket_message *result) {
+	struct ctrl_ring *r = &p->ctrl;
+	struct ctrl_slot *slot = &r->slot[r->head % CTRL_RING];
+	while (ATOM_LOAD(&slot->seq) != r->head + 1) {
+		// the producer claimed the slot, but hasn't published it yet
+		sched_yield();
+	}
+	// copy the command out and free the slot, because the command may send another command.
+	union {
+		uint8_t buffer[256];
+		uint64_t align;
+	} u;
+	int type = slot->type;
+	memcpy(u.buffer, slot->u.buffer, slot->len);
+	ATOM_STORE(&slot->seq, r->head + CTRL_RING);
+	++r->head;
+	uint8_t *buffer = u.buffer;
 	switch (type) {
 	case 'R':
 		return resume_socket(ss,(struct request_resumepause *)buffer, result);
@@ -1435,6 +1987,8 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		dec_sending_ref(ss, request->id);
 		return ret;
 	}
+	case 'M':
+		return send_multi(ss, p, ((struct request_send_multi *)buffer)->m, result);
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1446,9 +2000,13 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'T':
 		setopt_socket(ss, (struct request_setopt *)buffer);
 		return -1;
+	case 'H':
+		return watermark_socket(ss, (struct request_watermark *)buffer, result);
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'I':
+		return accept_socket(ss, (struct request_accept *)buffer);
 	default:
 		skynet_error(NULL, "socket-server error: Unknown ctrl %c.",type);
 		return -1;
@@ -1457,14 +2015,39 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
-// return -1 (ignore) when error
+// recv 0 (eof)
+static int
+read_eof(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	if (s->closing) {
+		// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
+		if (nomore_sending_data(s)) {
+			force_close(ss,s,l,result);
+		}
+		return -1;
+	}
+	int t = ATOM_LOAD(&s->type);
+	if (t == SOCKET_TYPE_HALFCLOSE_READ) {
+		// Rare case : Already shutdown read.
+		return -1;
+	}
+	if (t == SOCKET_TYPE_HALFCLOSE_WRITE) {
+		// Remote shutdown read (write error) before.
+		force_close(ss,s,l,result);
+	} else {
+		close_read(ss, s, result);
+	}
+	return SOCKET_CLOSE;
+}
+
+// return -1 (ignore) when error
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	char * buffer = socket_pool_alloc(sz, NULL);
 	int n = (int)read(s->fd, buffer, sz);
+	++s->stat.rcall;
 	if (n<0) {
-		FREE(buffer);
+		socket_pool_free(buffer);
 		switch(errno) {
 		case EINTR:
 		case AGAIN_WOULDBLOCK:
@@ -1475,31 +2058,13 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
-		if (s->closing) {
-			// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
-			if (nomore_sending_data(s)) {
-				force_close(ss,s,l,result);
-			}
-			return -1;
-		}
-		int t = ATOM_LOAD(&s->type);
-		if (t == SOCKET_TYPE_HALFCLOSE_READ) {
-			// Rare case : Already shutdown read.
-			return -1;
-		}
-		if (t == SOCKET_TYPE_HALFCLOSE_WRITE) {
-			// Remote shutdown read (write error) before.
-			force_close(ss,s,l,result);
-		} else {
-			close_read(ss, s, result);
-		}
-		return SOCKET_CLOSE;
+		socket_pool_free(buffer);
+		return read_eof(ss, s, l, result);
 	}
 
 	if (halfclose_read(s)) {
 		// discard recv data (Rare case : if socket is HALFCLOSE_READ, reading event is disable.)
-		FREE(buffer);
+		socket_pool_free(buffer);
 		return -1;
 	}
 
@@ -1520,6 +2085,126 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 	return SOCKET_DATA;
 }
 
+#ifdef SP_COMPLETION
+
+/*
+	The multishot recv may complete after the socket is paused (socket_server_pause or the high watermark),
+	the data can't be dropped (it's a part of the stream), so it's held until reading is enabled again.
+	The eof or error after the held data is held too, to keep the order.
+ */
+static void
+hold_completion(struct socket *s, struct event *e) {
+	int n = e->result;
+	if (s->held_result) {
+		// Rare case : eof or error is held already
+		return;
+	}
+	if (n <= 0) {
+		s->held_result = (n == 0) ? 1 : n;
+		return;
+	}
+	if (s->held_size + n > s->held_cap) {
+		int cap = s->held_cap ? s->held_cap : 4096;
+		while (cap < s->held_size + n)
+			cap *= 2;
+		char * held = MALLOC(cap);
+		if (s->held_size > 0)
+			memcpy(held, s->held, s->held_size);
+		FREE(s->held);
+		s->held = held;
+		s->held_cap = cap;
+	}
+	memcpy(s->held + s->held_size, e->data, n);
+	s->held_size += n;
+}
+
+// forward the held completions of a resumed socket, return -1 (ignore) when nothing to forward
+static int
+forward_held(struct socket_server *ss, struct socket_poller *p, struct socket_message * result) {
+	struct socket *s = p->held;
+	p->held = s->held_next;
+	s->held_next = NULL;
+	s->held_queued = false;
+	if (!s->reading) {
+		// paused again, enable_read will queue it later
+		return -1;
+	}
+	uint8_t type = ATOM_LOAD(&s->type);
+	if (type == SOCKET_TYPE_INVALID || type == SOCKET_TYPE_RESERVE) {
+		return -1;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	int n = s->held_size;
+	if (n > 0) {
+		s->held_size = 0;
+		// the held eof or error is forwarded next time
+		queue_held(ss, s);
+		if (halfclose_read(s)) {
+			// discard recv data
+			return -1;
+		}
+		char * buffer = socket_pool_alloc(n, NULL);
+		memcpy(buffer, s->held, n);
+		stat_read(ss,s,n);
+		FREE(s->held);
+		s->held = NULL;
+		s->held_cap = 0;
+
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = n;
+		result->data = buffer;
+
+		return SOCKET_DATA;
+	}
+	int r = s->held_result;
+	s->held_result = 0;
+	if (r < 0) {
+		return report_error(s, result, strerror(-r));
+	}
+	if (r > 0) {
+		return read_eof(ss, s, &l, result);
+	}
+	return -1;
+}
+
+// the data is received by the poller already, return -1 (ignore) when error
+static int
+forward_completion(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct event *e, struct socket_message * result) {
+	int n = e->result;
+	if (e->accept) {
+		// Rare case : the listen socket is closed or paused
+		return -1;
+	}
+	if (!s->reading || s->held_queued) {
+		hold_completion(s, e);
+		return -1;
+	}
+	if (n<0) {
+		return report_error(s, result, strerror(-n));
+	}
+	if (n==0) {
+		return read_eof(ss, s, l, result);
+	}
+	if (halfclose_read(s)) {
+		// discard recv data
+		return -1;
+	}
+	char * buffer = socket_pool_alloc(n, NULL);
+	memcpy(buffer, e->data, n);
+	stat_read(ss,s,n);
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+
+	return SOCKET_DATA;
+}
+
+#endif
+
 static int
 gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	int addrsz = 1;
@@ -1538,11 +2223,70 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+static struct udp_arena *
+udp_arena(struct socket_poller *p) {
+	struct udp_arena *a = p->udp;
+	if (a == NULL) {
+		a = MALLOC(sizeof(*a));
+#ifdef HAVE_MMSG
+		int i;
+		memset(a->msg, 0, sizeof(a->msg));
+		for (i=0;i<UDP_BATCH;i++) {
+			a->iov[i].iov_base = a->buffer[i];
+			a->iov[i].iov_len = MAX_UDP_PACKAGE;
+			a->msg[i].msg_hdr.msg_name = &a->addr[i];
+			a->msg[i].msg_hdr.msg_iov = &a->iov[i];
+			a->msg[i].msg_hdr.msg_iovlen = 1;
+		}
+#endif
+		p->udp = a;
+	}
+	return a;
+}
+
+// read the datagrams into the arena, return the number of them, or -1 when error
+static int
+udp_recv(struct socket *s, struct udp_arena *a, int len[UDP_BATCH], socklen_t slen[UDP_BATCH]) {
+	int i,n;
+#ifdef HAVE_MMSG
+	for (i=0;i<UDP_BATCH;i++) {
+		a->msg[i].msg_hdr.msg_namelen = sizeof(a->addr[i]);
+	}
+	n = recvmmsg(s->fd, a->msg, UDP_BATCH, 0, NULL);
+	++s->stat.rcall;
+	for (i=0;i<n;i++) {
+		len[i] = a->msg[i].msg_len;
+		slen[i] = a->msg[i].msg_hdr.msg_namelen;
+	}
+#else
+	slen[0] = sizeof(a->addr[0]);
+	len[0] = recvfrom(s->fd, a->buffer[0], MAX_UDP_PACKAGE, 0, &a->addr[0].s, &slen[0]);
+	++s->stat.rcall;
+	n = len[0] < 0 ? -1 : 1;
+#endif
+	return n;
+}
+
+static inline int
+udp_protocol(socklen_t slen) {
+	return slen == sizeof(struct sockaddr_in) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+}
+
+static inline int
+udp_address_size(int protocol) {
+	return protocol == PROTOCOL_UDP ? 1 + 2 + 4 : 1 + 2 + 16;
+}
+
+/*
+	A batch of datagrams from one socket is forwarded in one SOCKET_UDP_BATCH message, ud is the size of the buffer.
+	Each datagram in the buffer is : uint16 size, udp address (see socket_server_udp_address), data.
+ */
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
-	union sockaddr_all sa;
-	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	struct udp_arena *a = udp_arena(socket_poller(ss, s->id));
+	int len[UDP_BATCH];
+	socklen_t slen[UDP_BATCH];
+	int n = udp_recv(s, a, len, slen);
 	if (n<0) {
 		switch(errno) {
 		case EINTR:
@@ -1555,28 +2299,54 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 		result->data = strerror(error);
 		return SOCKET_ERR;
 	}
-	stat_read(ss,s,n);
+	int i;
+	int count = 0;
+	int last = 0;
+	size_t sz = 0;
+	for (i=0;i<n;i++) {
+		stat_read(ss,s,len[i]);
+		if (udp_protocol(slen[i]) != s->protocol) {
+			len[i] = -1;
+			continue;
+		}
+		sz += 2 + udp_address_size(s->protocol) + len[i];
+		last = i;
+		++count;
+	}
+	if (count == 0)
+		return -1;
 
 	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+	if (count == 1) {
+		n = len[last];
+		data = socket_pool_alloc(n + udp_address_size(s->protocol), NULL);
+		gen_udp_address(s->protocol, &a->addr[last], data + n);
+		memcpy(data, a->buffer[last], n);
+		result->ud = n;
+		result->data = (char *)data;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		return SOCKET_UDP;
+	}
+	data = socket_pool_alloc(sz, NULL);
+	uint8_t * ptr = data;
+	for (i=0;i<n;i++) {
+		if (len[i] < 0)
+			continue;
+		uint16_t size = (uint16_t)len[i];
+		memcpy(ptr, &size, sizeof(size));
+		ptr += sizeof(size);
+		ptr += gen_udp_address(s->protocol, &a->addr[i], ptr);
+		memcpy(ptr, a->buffer[i], len[i]);
+		ptr += len[i];
 	}
-	memcpy(data, ss->udpbuffer, n);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
-	result->ud = n;
+	result->ud = (int)sz;
 	result->data = (char *)data;
 
-	return SOCKET_UDP;
+	return SOCKET_UDP_BATCH;
 }
 
 static int
@@ -1594,6 +2364,11 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
+		if (enable_read(ss, s, true)) {
+			force_close(ss,s,l, result);
+			result->data = "enable read failed";
+			return SOCKET_ERR;
+		}
 		if (nomore_sending_data(s)) {
 			if (enable_write(ss, s, false)) {
 				force_close(ss,s,l, result);
@@ -1605,8 +2380,9 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			struct socket_poller *p = socket_poller(ss, s->id);
+			if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+				result->data = p->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1631,10 +2407,23 @@ getname(union sockaddr_all *u, char *buffer, size_t sz) {
 
 // return 0 when failed, or -1 when file limit
 static int
-report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+report_accept(struct socket_server *ss, struct socket *s, struct event *e, struct socket_message *result) {
+	struct socket_poller *p = socket_poller(ss, s->id);
 	union sockaddr_all u;
 	socklen_t len = sizeof(u);
+#ifdef SP_COMPLETION
+	// the poller accepted it already
+	int client_fd = e->result;
+	e->result = -1;
+	if (client_fd < 0) {
+		errno = -client_fd;
+	} else if (getpeername(client_fd, &u.s, &len) != 0) {
+		memset(&u, 0, sizeof(u));
+	}
+#else
+	(void)e;
 	int client_fd = accept(s->fd, &u.s, &len);
+#endif
 	if (client_fd < 0) {
 		if (errno == EMFILE || errno == ENFILE) {
 			result->opaque = s->opaque;
@@ -1643,13 +2432,13 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			result->data = strerror(errno);
 
 			// See https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
-			if (ss->reserve_fd >= 0) {
-				close(ss->reserve_fd);
+			if (p->reserve_fd >= 0) {
+				close(p->reserve_fd);
 				client_fd = accept(s->fd, &u.s, &len);
 				if (client_fd >= 0) {
 					close(client_fd);
 				}
-				ss->reserve_fd = dup(1);
+				p->reserve_fd = dup(1);
 			}
 			return -1;
 		} else {
@@ -1663,34 +2452,80 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	}
 	socket_keepalive(client_fd);
 	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
-	if (ns == NULL) {
-		close(client_fd);
-		return 0;
+	if (socket_poller(ss, id) == p) {
+		struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, SP_RECV, s->opaque, false);
+		if (ns == NULL) {
+			close(client_fd);
+			return 0;
+		}
+		ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
+	} else {
+		// The new socket belongs to another poller, let its thread add it to the event pool.
+		// The commands about the new id are sent after SOCKET_ACCEPT, so they are always behind this one.
+		struct request_package request;
+		request.u.accept.id = id;
+		request.u.accept.fd = client_fd;
+		request.u.accept.opaque = s->opaque;
+		if (poller_try_request(socket_poller(ss, id), &request, 'I', sizeof(request.u.accept))) {
+			// The ring is full, report SOCKET_ACCEPT after it's forwarded, see forward_pending
+			struct pending_accept *pa = MALLOC(sizeof(*pa));
+			pa->request = request.u.accept;
+			pa->listen_id = s->id;
+			pa->addr = u;
+			p->pending = pa;
+			return 0;
+		}
 	}
 	// accept new one connection
-	stat_read(ss,s,1);
+	stat_accept(ss,s);
 
-	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = id;
 	result->data = NULL;
 
-	if (getname(&u, ss->buffer, sizeof(ss->buffer))) {
-		result->data = ss->buffer;
+	if (getname(&u, p->buffer, sizeof(p->buffer))) {
+		result->data = p->buffer;
 	}
 
 	return 1;
 }
 
+// forward the pending accepted socket to its poller, return -1 when the ring is still full
+static int
+forward_pending(struct socket_server *ss, struct socket_poller *p, struct socket_message *result) {
+	struct pending_accept *pa = p->pending;
+	struct request_package request;
+	request.u.accept = pa->request;
+	if (poller_try_request(socket_poller(ss, pa->request.id), &request, 'I', sizeof(request.u.accept))) {
+		return -1;
+	}
+	p->pending = NULL;
+	struct socket *s = &ss->slot[HASH_ID(pa->listen_id)];
+	if (!socket_invalid(s, pa->listen_id)) {
+		stat_accept(ss,s);
+	}
+
+	result->opaque = pa->request.opaque;
+	result->id = pa->listen_id;
+	result->ud = pa->request.id;
+	result->data = NULL;
+
+	if (getname(&pa->addr, p->buffer, sizeof(p->buffer))) {
+		result->data = p->buffer;
+	}
+	FREE(pa);
+
+	return SOCKET_ACCEPT;
+}
+
 static inline void 
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_poller *p, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=p->event_index; i<p->event_n; i++) {
+			struct event *e = &p->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (socket_invalid(s, id) && s->id == id) {
@@ -1704,29 +2539,74 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 
 // return type
 int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+socket_server_poll(struct socket_server *ss, int poller, struct socket_message * result, int * more) {
+	assert(poller >= 0 && poller < ss->poller_n);
+	struct socket_poller *p = &ss->poller[poller];
 	for (;;) {
-		if (ss->checkctrl) {
-			if (has_cmd(ss)) {
-				int type = ctrl_cmd(ss, result);
+		if (p->multi) {
+			int type = send_multi(ss, p, p->multi, result);
+			if (type != -1) {
+				clear_closed_event(p, result, type);
+				return type;
+			}
+			continue;
+		}
+#ifdef SP_COMPLETION
+		if (p->held) {
+			int type = forward_held(ss, p, result);
+			if (type != -1) {
+				clear_closed_event(p, result, type);
+				return type;
+			}
+			continue;
+		}
+#endif
+		if (p->pending) {
+			int type = forward_pending(ss, p, result);
+			if (type != -1) {
+				return type;
+			}
+			// Don't poll the events until it's forwarded, but dispatch the commands, the other poller may wait for them.
+			if (has_cmd(p)) {
+				type = ctrl_cmd(ss, p, result);
 				if (type != -1) {
-					clear_closed_event(ss, result, type);
+					clear_closed_event(p, result, type);
+					return type;
+				}
+			} else {
+				sched_yield();
+			}
+			continue;
+		}
+		if (p->checkctrl) {
+			if (has_cmd(p)) {
+				int type = ctrl_cmd(ss, p, result);
+				if (type != -1) {
+					clear_closed_event(p, result, type);
 					return type;
 				} else
 					continue;
 			} else {
-				ss->checkctrl = 0;
+				p->checkctrl = 0;
 			}
 		}
-		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
-			ss->checkctrl = 1;
+		if (p->event_index == p->event_n) {
+			// The producers signal the wake fd after sleeping is set, check the commands again before waiting.
+			ATOM_STORE(&p->sleeping, 1);
+			if (has_cmd(p)) {
+				ATOM_STORE(&p->sleeping, 0);
+				p->checkctrl = 1;
+				continue;
+			}
+			p->event_n = sp_wait(p->event_fd, p->ev, MAX_EVENT);
+			ATOM_STORE(&p->sleeping, 0);
+			p->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
-			ss->event_index = 0;
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			p->event_index = 0;
+			if (p->event_n <= 0) {
+				p->event_n = 0;
 				int err = errno;
 				if (err != EINTR) {
 					skynet_error(NULL, "socket-server error: %s", strerror(err));
@@ -1734,10 +2614,14 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				continue;
 			}
 		}
-		struct event *e = &ss->ev[ss->event_index++];
+		struct event *e = &p->ev[p->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// wake fd (the commands are dispatched at beginning), or the event of a closed socket
+			drain_wake(p);
+#ifdef SP_COMPLETION
+			sp_drop(p->event_fd, e);
+#endif
 			continue;
 		}
 		struct socket_lock l;
@@ -1746,7 +2630,7 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_CONNECTING:
 			return report_connect(ss, s, &l, result);
 		case SOCKET_TYPE_LISTEN: {
-			int ok = report_accept(ss, s, result);
+			int ok = report_accept(ss, s, e, result);
 			if (ok > 0) {
 				return SOCKET_ACCEPT;
 			} if (ok < 0 ) {
@@ -1757,28 +2641,40 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		}
 		case SOCKET_TYPE_INVALID:
 			skynet_error(NULL, "socket-server error: invalid socket");
+#ifdef SP_COMPLETION
+			sp_drop(p->event_fd, e);
+#endif
 			break;
 		default:
+#ifdef SP_COMPLETION
+			if (e->completed) {
+				int type = forward_completion(ss, s, &l, e, result);
+				sp_drop(p->event_fd, e);
+				if (type == -1)
+					break;
+				return type;
+			}
+#endif
 			if (e->read) {
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, &l, result);
 					if (type == SOCKET_MORE) {
-						--ss->event_index;
+						--p->event_index;
 						return SOCKET_DATA;
 					}
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
-					if (type == SOCKET_UDP) {
+					if (type == SOCKET_UDP || type == SOCKET_UDP_BATCH) {
 						// try read again
-						--ss->event_index;
-						return SOCKET_UDP;
+						--p->event_index;
+						return type;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERR) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--p->event_index;
 				}
 				if (type == -1)
 					break;				
@@ -1818,24 +2714,6 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
-static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	const char * req = (const char *)request + offsetof(struct request_package, header[6]);
-	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, req, len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
-			}
-			continue;
-		}
-		assert(n == len+2);
-		return;
-	}
-}
-
 static int
 open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
 	int len = strlen(addr);
@@ -1861,7 +2739,7 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	int len = open_request(ss, &request, opaque, addr, port);
 	if (len < 0)
 		return -1;
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	send_request(ss, request.u.open.id, &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
 
@@ -1903,6 +2781,7 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 				}
 				n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
 			}
+			++s->stat.wcall;
 			if (n<0) {
 				// ignore error, let socket thread try again
 				n = 0;
@@ -1926,7 +2805,7 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 			request.u.send.buffer = NULL;
 
 			// let socket thread enable write event
-			send_request(ss, &request, 'W', sizeof(request.u.send));
+			send_request(ss, id, &request, 'W', sizeof(request.u.send));
 
 			return 0;
 		}
@@ -1939,7 +2818,7 @@ socket_server_send(struct socket_server *ss, struct socket_sendbuffer *buf) {
 	request.u.send.id = id;
 	request.u.send.buffer = clone_buffer(buf, &request.u.send.sz);
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+	send_request(ss, id, &request, 'D', sizeof(request.u.send));
 	return 0;
 }
 
@@ -1960,14 +2839,65 @@ socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffe
 	request.u.send.id = id;
 	request.u.send.buffer = clone_buffer(buf, &request.u.send.sz);
 
-	send_request(ss, &request, 'P', sizeof(request.u.send));
+	send_request(ss, id, &request, 'P', sizeof(request.u.send));
 	return 0;
 }
 
+static int
+send_multi_request(struct socket_server *ss, const int ids[], int n, const void *object, int priority) {
+	struct send_multi *m[ss->poller_n];
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		m[i] = NULL;
+	}
+	int count = 0;
+	for (i=0;i<n;i++) {
+		int id = ids[i];
+		struct socket * s = &ss->slot[HASH_ID(id)];
+		if (socket_invalid(s, id) || s->closing) {
+			ss->soi.free((void *)object);
+			continue;
+		}
+		int k = (unsigned)id % ss->poller_n;
+		if (m[k] == NULL) {
+			// the rest ids may be all in this poller
+			m[k] = MALLOC(sizeof(struct send_multi) + (n - i - 1) * sizeof(int));
+			m[k]->priority = priority;
+			m[k]->n = 0;
+			m[k]->index = 0;
+			m[k]->buffer = object;
+		}
+		inc_sending_ref(s, id);
+		m[k]->id[m[k]->n++] = id;
+		++count;
+	}
+	for (i=0;i<ss->poller_n;i++) {
+		if (m[i]) {
+			struct request_package request;
+			request.u.send_multi.m = m[i];
+			poller_request(&ss->poller[i], &request, 'M', sizeof(request.u.send_multi));
+		}
+	}
+	return count;
+}
+
+int
+socket_server_send_multi(struct socket_server *ss, const int ids[], int n, const void *object) {
+	return send_multi_request(ss, ids, n, object, PRIORITY_HIGH);
+}
+
+int
+socket_server_send_multi_lowpriority(struct socket_server *ss, const int ids[], int n, const void *object) {
+	return send_multi_request(ss, ids, n, object, PRIORITY_LOW);
+}
+
 void
 socket_server_exit(struct socket_server *ss) {
-	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		struct request_package request;
+		poller_request(&ss->poller[i], &request, 'X', 0);
+	}
 }
 
 void
@@ -1976,7 +2906,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 0;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, id, &request, 'K', sizeof(request.u.close));
 }
 
 
@@ -1986,13 +2916,13 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 1;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, id, &request, 'K', sizeof(request.u.close));
 }
 
 // return -1 means failed
 // or return AF_INET or AF_INET6
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, bool reuseport, int *family) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -2025,6 +2955,15 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+			goto _failed;
+		}
+#else
+		goto _failed;
+#endif
+	}
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -2039,9 +2978,9 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, bool reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, reuseport, &family);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -2054,7 +2993,7 @@ do_listen(const char * host, int port, int backlog) {
 
 int 
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+	int fd = do_listen(addr, port, backlog, false);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2067,10 +3006,117 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen));
+	send_request(ss, id, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
 
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+
+// select the listener by the cpu which handles the incoming packet (cpu % n)
+static int
+reuseport_cpu(int fd, int n) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)n },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+#else
+
+static int
+reuseport_cpu(int fd, int n) {
+	(void)fd;
+	(void)n;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+#endif
+
+static inline void
+release_id(struct socket_server *ss, int id) {
+	ATOM_STORE(&ss->slot[HASH_ID(id)].type, SOCKET_TYPE_INVALID);
+}
+
+// reserve n ids belong to different pollers as far as possible
+static int
+reserve_ids(struct socket_server *ss, int n, int ids[]) {
+	int i,j;
+	for (i=0;i<n;i++) {
+		int retry = ss->poller_n;
+		int id;
+		for (;;) {
+			id = reserve_id(ss);
+			if (id < 0) {
+				for (j=0;j<i;j++) {
+					release_id(ss, ids[j]);
+				}
+				return -1;
+			}
+			if (--retry <= 0 || i >= ss->poller_n)
+				break;
+			int p = (unsigned)id % ss->poller_n;
+			for (j=0;j<i;j++) {
+				if ((unsigned)ids[j] % ss->poller_n == p)
+					break;
+			}
+			if (j == i)
+				break;
+			release_id(ss, id);
+		}
+		ids[i] = id;
+	}
+	return 0;
+}
+
+int
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, int n, int policy, int ids[]) {
+	if (n <= 0 || n > MAX_REUSEPORT)
+		return -1;
+	int fds[MAX_REUSEPORT];
+	int i;
+	for (i=0;i<n;i++) {
+		fds[i] = do_listen(addr, port, backlog, true);
+		if (fds[i] < 0)
+			goto _failed;
+		if (port == 0) {
+			// the others share the port picked by the kernel
+			union sockaddr_all u;
+			socklen_t len = sizeof(u);
+			if (getsockname(fds[i], &u.s, &len) != 0) {
+				++i;
+				goto _failed;
+			}
+			port = ntohs(u.s.sa_family == AF_INET ? u.v4.sin_port : u.v6.sin6_port);
+		}
+	}
+	// the group is complete, the program indexes the listeners in the order they joined it.
+	if (policy == SOCKET_REUSEPORT_CPU && reuseport_cpu(fds[0], n)) {
+		skynet_error(NULL, "socket-server: attach reuseport cbpf failed: %s", strerror(errno));
+		goto _failed;
+	}
+	if (reserve_ids(ss, n, ids))
+		goto _failed;
+	for (i=0;i<n;i++) {
+		struct request_package request;
+		request.u.listen.opaque = opaque;
+		request.u.listen.id = ids[i];
+		request.u.listen.fd = fds[i];
+		send_request(ss, ids[i], &request, 'L', sizeof(request.u.listen));
+	}
+	return n;
+_failed:
+	while (--i >= 0) {
+		close(fds[i]);
+	}
+	return -1;
+}
+
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	struct request_package request;
@@ -2080,7 +3126,7 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	send_request(ss, id, &request, 'B', sizeof(request.u.bind));
 	return id;
 }
 
@@ -2089,7 +3135,7 @@ socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.resumepause.id = id;
 	request.u.resumepause.opaque = opaque;
-	send_request(ss, &request, 'R', sizeof(request.u.resumepause));
+	send_request(ss, id, &request, 'R', sizeof(request.u.resumepause));
 }
 
 void
@@ -2097,7 +3143,7 @@ socket_server_pause(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.resumepause.id = id;
 	request.u.resumepause.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.resumepause));
+	send_request(ss, id, &request, 'S', sizeof(request.u.resumepause));
 }
 
 void
@@ -2106,7 +3152,39 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	send_request(ss, id, &request, 'T', sizeof(request.u.setopt));
+}
+
+void
+socket_server_watermark(struct socket_server *ss, int id, int64_t high, int64_t low) {
+	struct request_package request;
+	if (high <= 0) {
+		high = 0;
+		low = 0;
+	} else if (low < 0) {
+		low = 0;
+	} else if (low > high) {
+		low = high;
+	}
+	request.u.watermark.id = id;
+	request.u.watermark.high = high;
+	request.u.watermark.low = low;
+	send_request(ss, id, &request, 'H', sizeof(request.u.watermark));
+}
+
+void
+socket_server_histogram(struct socket_server *ss, uint64_t histogram[SOCKET_HISTOGRAM]) {
+	int i,j;
+	for (i=0;i<SOCKET_HISTOGRAM;i++) {
+		histogram[i] = 0;
+	}
+	// the counters are increased by the socket threads, read them without lock
+	for (i=0;i<ss->poller_n;i++) {
+		ATOM_ULONG *h = ss->poller[i].histogram;
+		for (j=0;j<SOCKET_HISTOGRAM;j++) {
+			histogram[j] += ATOM_LOAD(&h[j]);
+		}
+	}
 }
 
 void 
@@ -2122,7 +3200,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, false, &family);
 		if (fd < 0) {
 			return -1;
 		}
@@ -2146,7 +3224,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));	
+	send_request(ss, id, &request, 'U', sizeof(request.u.udp));	
 	return id;
 }
 
@@ -2159,7 +3237,7 @@ socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const char*
 
 	int family;
 	// bind
-	fd = do_bind(addr, port, IPPROTO_UDP, &family);
+	fd = do_bind(addr, port, IPPROTO_UDP, false, &family);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2177,7 +3255,7 @@ socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const char*
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));
+	send_request(ss, id, &request, 'U', sizeof(request.u.udp));
 	return id;
 }
 
@@ -2232,7 +3310,7 @@ socket_server_udp_dial(struct socket_server *ss, uintptr_t opaque, const char* a
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'N', sizeof(request.u.dial_udp) - sizeof(request.u.dial_udp.address) + addrsz);
+	send_request(ss, id, &request, 'N', sizeof(request.u.dial_udp) - sizeof(request.u.dial_udp.address) + addrsz);
 	return id;
 }
 
@@ -2276,6 +3354,7 @@ socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address
 				return -1;
 			}
 			int n = sendto(s->fd, so.buffer, so.sz, 0, &sa.s, sasz);
+			++s->stat.wcall;
 			if (n >= 0) {
 				// sendto succ
 				stat_write(ss,s,n);
@@ -2294,7 +3373,7 @@ socket_server_udp_send(struct socket_server *ss, const struct socket_udp_address
 
 	memcpy(request.u.send_udp.address, udp_address, addrsz);
 
-	send_request(ss, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
+	send_request(ss, id, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
 	return 0;
 }
 
@@ -2345,11 +3424,27 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
+	send_request(ss, id, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
 
 	return 0;
 }
 
+const char *
+socket_server_udp_batch(const char *buffer, int size, int *offset, int *sz, const struct socket_udp_address **address, int *addrsz) {
+	const uint8_t * ptr = (const uint8_t *)buffer + *offset;
+	if (*offset + 3 > size)
+		return NULL;
+	uint16_t len;
+	memcpy(&len, ptr, sizeof(len));
+	ptr += sizeof(len);
+	int n = ptr[0] == PROTOCOL_UDP ? udp_address_size(PROTOCOL_UDP) : udp_address_size(PROTOCOL_UDPv6);
+	*address = (const struct socket_udp_address *)ptr;
+	*addrsz = n;
+	*sz = len;
+	*offset += sizeof(len) + n + len;
+	return (const char *)(ptr + n);
+}
+
 const struct socket_udp_address *
 socket_server_udp_address(struct socket_server *ss, struct socket_message *msg, int *addrsz) {
 	uint8_t * address = (uint8_t *)(msg->data + msg->ud);
@@ -2386,7 +3481,7 @@ socket_info_release(struct socket_info *si) {
 }
 
 static int
-query_info(struct socket *s, struct socket_info *si) {
+query_info(struct socket_server *ss, struct socket *s, struct socket_info *si) {
 	union sockaddr_all u;
 	socklen_t slen = sizeof(u);
 	int closing = 0;
@@ -2426,6 +3521,19 @@ query_info(struct socket *s, struct socket_info *si) {
 	si->write = s->stat.write;
 	si->rtime = s->stat.rtime;
 	si->wtime = s->stat.wtime;
+	si->rcall = s->stat.rcall;
+	si->wcall = s->stat.wcall;
+	si->arate = 0;
+	if (si->type == SOCKET_INFO_LISTEN) {
+		// the accepts in the last whole second
+		uint64_t sec = ss->time / 100;
+		if (sec == s->stat.asec) {
+			si->arate = s->stat.arate;
+		} else if (sec == s->stat.asec + 1) {
+			si->arate = s->stat.acount;
+		}
+	}
+	si->drop = s->stat.drop;
 	si->wbuffer = s->wb_size;
 	si->reading = s->reading;
 	si->writing = s->writing;
@@ -2441,7 +3549,7 @@ socket_server_info(struct socket_server *ss) {
 		struct socket * s = &ss->slot[i];
 		int id = s->id;
 		struct socket_info temp;
-		if (query_info(s, &temp) && s->id == id) {
+		if (query_info(ss, s, &temp) && s->id == id) {
 			// socket_server_info may call in different thread, so check socket id again
 			si = socket_info_create(si);
 			temp.next = si->next;
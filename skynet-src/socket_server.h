@@ -13,11 +13,20 @@
 #define SOCKET_EXIT 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_UDP_BATCH 10	// several udp packages, see socket_server_udp_batch
 
 // Only for internal use
 #define SOCKET_RST 8
 #define SOCKET_MORE 9
 
+// policy of socket_server_listen_reuseport
+#define SOCKET_REUSEPORT_HASH 0
+#define SOCKET_REUSEPORT_CPU 1
+#define MAX_REUSEPORT 64
+
+// the buckets of socket_server_histogram
+#define SOCKET_HISTOGRAM 16
+
 struct socket_server;
 
 struct socket_message {
@@ -27,10 +36,11 @@ struct socket_message {
 	char * data;
 };
 
-struct socket_server * socket_server_create(uint64_t time);
+// poller_n is the number of socket threads, each thread calls socket_server_poll with its own poller index
+struct socket_server * socket_server_create(uint64_t time, int poller_n);
 void socket_server_release(struct socket_server *);
 void socket_server_updatetime(struct socket_server *, uint64_t time);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_poll(struct socket_server *, int poller, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
@@ -41,14 +51,29 @@ void socket_server_pause(struct socket_server *, uintptr_t opaque, int id);
 // return -1 when error
 int socket_server_send(struct socket_server *, struct socket_sendbuffer *buffer);
 int socket_server_send_lowpriority(struct socket_server *, struct socket_sendbuffer *buffer);
+// send a SOCKET_BUFFER_OBJECT to n sockets with one ctrl command per socket thread, soi.free is called once for each id,
+// so the object should be refcounted and hold n references. return the number of the valid ids.
+int socket_server_send_multi(struct socket_server *, const int ids[], int n, const void *object);
+int socket_server_send_multi_lowpriority(struct socket_server *, const int ids[], int n, const void *object);
 
 // ctrl command below returns id
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+// listen n sockets on the same port with SO_REUSEPORT, the ids are returned by ids[] and spread over the socket threads.
+// SOCKET_REUSEPORT_HASH lets the kernel select the listener by the hash of the connection,
+// SOCKET_REUSEPORT_CPU selects it by the cpu which handles the connection (linux only).
+// return n, or -1 when error
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog, int n, int policy, int ids[]);
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
 int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
 // for tcp
 void socket_server_nodelay(struct socket_server *, int id);
+// when the write buffer reaches high, drop the low priority packages and pause reading until it drains to low.
+// high = 0 turns it off.
+void socket_server_watermark(struct socket_server *, int id, int64_t high, int64_t low);
+// the write buffer sizes sampled when the packages are queued, bucket i counts [512 << i, 1024 << i) bytes,
+// the first one is [0, 1K) and the last one has no upper bound.
+void socket_server_histogram(struct socket_server *, uint64_t histogram[SOCKET_HISTOGRAM]);
 
 struct socket_udp_address;
 
@@ -66,6 +91,9 @@ int socket_server_udp_listen(struct socket_server *ss, uintptr_t opaque, const c
 // If the socket_udp_address is NULL, use last call socket_server_udp_connect address instead
 // You can also use socket_server_send 
 int socket_server_udp_send(struct socket_server *, const struct socket_udp_address *, struct socket_sendbuffer *buffer);
+// iterate the packages of a SOCKET_UDP_BATCH message, *offset should be 0 at the beginning.
+// return the data of next package (size in *sz, address in *address and *addrsz), or NULL at the end.
+const char * socket_server_udp_batch(const char *buffer, int size, int *offset, int *sz, const struct socket_udp_address **address, int *addrsz);
 // extract the address of the message, struct socket_message * should be SOCKET_UDP
 const struct socket_udp_address * socket_server_udp_address(struct socket_server *, struct socket_message *, int *addrsz);
 
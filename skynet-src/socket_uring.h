@@ -0,0 +1,575 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+/*
+	io_uring poller (linux 6.0+), build with USE_IO_URING .
+
+	Each fd has a handle. A stream socket (SP_RECV) has a multishot recv with the provided buffer ring,
+	so the data comes with the event, and a listen socket (SP_ACCEPT) has a multishot accept.
+	A multishot poll reports the writable event (and the readable event for SP_READ).
+
+	The changes of the handles are queued, and submitted by sp_wait with the waiting in one syscall.
+
+	There is at most one event of a handle in one sp_wait, as epoll does. The rest are left in the
+	completion queue for the next sp_wait, so socket_server can close a socket in the batch safely.
+	The handle lives until all its requests finish, the completions of a deleted handle are dropped.
+ */
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUFFER_N 512	// must be power of 2
+#define URING_BUFFER_SIZE 8192
+#define URING_BGID 0
+
+#define URING_OP_POLL 0
+#define URING_OP_RECV 1
+#define URING_OP_ACCEPT 2
+#define URING_OP_MASK 3
+
+struct sp_handle {
+	struct sp_handle *prev;
+	struct sp_handle *next;
+	struct sp_handle *dirty_next;
+	void *ud;
+	int fd;
+	int mode;
+	int ref;	// alive + requests + dirty
+	unsigned mask;	// the events of poll
+	unsigned batch;	// the last sp_wait which reports it
+	bool read;
+	bool write;
+	bool dead;
+	bool dirty;
+	bool eof;	// recv finished, don't recv again
+	bool poll_armed;
+	bool poll_cancel;
+	bool op_armed;	// recv or accept
+	bool op_cancel;
+};
+
+struct sp_uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned sq_tail;
+	unsigned *ksq_head;
+	unsigned *ksq_tail;
+	unsigned *ksq_mask;
+	unsigned *ksq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *kcq_head;
+	unsigned *kcq_tail;
+	unsigned *kcq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned br_tail;
+	char *buffer;
+	unsigned batch;
+	int handle_n;
+	struct sp_handle **handle;	// index by fd
+	struct sp_handle *all;
+	struct sp_handle *dirty;
+};
+
+static inline int
+uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static inline int
+uring_register(int fd, unsigned op, void *arg, unsigned n) {
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static inline uint64_t
+uring_data(struct sp_handle *h, int op) {
+	return (uint64_t)(uintptr_t)h | op;
+}
+
+static inline void
+uring_buffer_add(struct sp_uring *u, int bid) {
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFFER_N - 1)];
+	b->addr = (uintptr_t)(u->buffer + (size_t)bid * URING_BUFFER_SIZE);
+	b->len = URING_BUFFER_SIZE;
+	b->bid = bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, (uint16_t)u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+uring_submit(struct sp_uring *u, unsigned wait) {
+	__atomic_store_n(u->ksq_tail, u->sq_tail, __ATOMIC_RELEASE);
+	unsigned submit = u->sq_tail - __atomic_load_n(u->ksq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return 0;
+	return uring_enter(u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct sp_uring *u) {
+	while (u->sq_tail - __atomic_load_n(u->ksq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		// submission queue is full
+		uring_submit(u, 0);
+	}
+	unsigned index = u->sq_tail & *u->ksq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->ksq_array[index] = index;
+	++u->sq_tail;
+	return sqe;
+}
+
+static void
+uring_cancel(struct sp_uring *u, struct sp_handle *h, int op) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = uring_data(h, op);
+	sqe->user_data = 0;
+}
+
+static void
+uring_poll(struct sp_uring *u, struct sp_handle *h, unsigned mask) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (h->poll_armed) {
+		// update the events of the armed poll
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = uring_data(h, URING_OP_POLL);
+		sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+		sqe->user_data = 0;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = h->fd;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = uring_data(h, URING_OP_POLL);
+		h->poll_armed = true;
+		h->poll_cancel = false;
+		++h->ref;
+	}
+	sqe->poll32_events = mask;
+	h->mask = mask;
+}
+
+static void
+uring_read(struct sp_uring *u, struct sp_handle *h) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->fd = h->fd;
+	if (h->mode == SP_RECV) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = uring_data(h, URING_OP_RECV);
+	} else {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = uring_data(h, URING_OP_ACCEPT);
+	}
+	h->op_armed = true;
+	h->op_cancel = false;
+	++h->ref;
+}
+
+// make the requests of a handle match its mode and read/write enable
+static void
+uring_update(struct sp_uring *u, struct sp_handle *h) {
+	unsigned mask = h->write ? POLLOUT : 0;
+	if (h->mode == SP_READ && h->read)
+		mask |= POLLIN;
+	if (h->poll_armed) {
+		if (mask == 0) {
+			if (!h->poll_cancel) {
+				uring_cancel(u, h, URING_OP_POLL);
+				h->poll_cancel = true;
+			}
+		} else if (!h->poll_cancel && mask != h->mask) {
+			uring_poll(u, h, mask);
+		}
+		// or wait for the end of the canceled poll, see uring_event
+	} else if (mask != 0) {
+		uring_poll(u, h, mask);
+	}
+	if (h->mode == SP_READ)
+		return;
+	if (h->read) {
+		if (!h->op_armed && !h->eof) {
+			uring_read(u, h);
+		}
+	} else if (h->op_armed && !h->op_cancel) {
+		uring_cancel(u, h, h->mode == SP_RECV ? URING_OP_RECV : URING_OP_ACCEPT);
+		h->op_cancel = true;
+	}
+}
+
+static void
+uring_unref(struct sp_uring *u, struct sp_handle *h) {
+	if (--h->ref > 0)
+		return;
+	if (h->prev) {
+		h->prev->next = h->next;
+	} else {
+		u->all = h->next;
+	}
+	if (h->next) {
+		h->next->prev = h->prev;
+	}
+	skynet_free(h);
+}
+
+static void
+uring_dirty(struct sp_uring *u, struct sp_handle *h) {
+	if (h->dirty)
+		return;
+	h->dirty = true;
+	++h->ref;
+	h->dirty_next = u->dirty;
+	u->dirty = h;
+}
+
+static void
+uring_flush(struct sp_uring *u) {
+	while (u->dirty) {
+		struct sp_handle *h = u->dirty;
+		u->dirty = h->dirty_next;
+		h->dirty = false;
+		if (!h->dead) {
+			uring_update(u, h);
+		}
+		uring_unref(u, h);
+	}
+}
+
+static struct sp_handle *
+uring_handle(struct sp_uring *u, int fd) {
+	if (fd < 0 || fd >= u->handle_n)
+		return NULL;
+	return u->handle[fd];
+}
+
+static bool
+sp_invalid(poll_fd u) {
+	return u == NULL;
+}
+
+static void
+sp_release(poll_fd u) {
+	while (u->all) {
+		struct sp_handle *h = u->all;
+		u->all = h->next;
+		skynet_free(h);
+	}
+	if (u->fd >= 0)
+		close(u->fd);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr)
+		munmap(u->sq_ptr, u->sq_size);
+	if (u->br)
+		munmap(u->br, u->br_size);
+	skynet_free(u->buffer);
+	skynet_free(u->handle);
+	skynet_free(u);
+}
+
+static poll_fd
+sp_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = URING_CQ_ENTRIES;
+	int fd = uring_setup(URING_ENTRIES, &p);
+	if (fd < 0)
+		return NULL;
+	struct sp_uring *u = skynet_malloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	// the completions must not be dropped
+	if (!(p.features & IORING_FEAT_NODROP))
+		goto _failed;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+	void *ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto _failed;
+	u->sq_ptr = ptr;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto _failed;
+		u->cq_ptr = ptr;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto _failed;
+	u->sqes = ptr;
+
+	char *sq = u->sq_ptr;
+	char *cq = u->cq_ptr;
+	u->sq_entries = p.sq_entries;
+	u->ksq_head = (unsigned *)(sq + p.sq_off.head);
+	u->ksq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->ksq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->ksq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_tail = *u->ksq_tail;
+	u->kcq_head = (unsigned *)(cq + p.cq_off.head);
+	u->kcq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->kcq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// provided buffer ring for recv
+	u->br_size = URING_BUFFER_N * sizeof(struct io_uring_buf);
+	ptr = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		goto _failed;
+	u->br = ptr;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_BUFFER_N;
+	reg.bgid = URING_BGID;
+	if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		goto _failed;
+	u->buffer = skynet_malloc((size_t)URING_BUFFER_N * URING_BUFFER_SIZE);
+	int i;
+	for (i=0;i<URING_BUFFER_N;i++) {
+		uring_buffer_add(u, i);
+	}
+	return u;
+_failed:
+	sp_release(u);
+	return NULL;
+}
+
+static int
+sp_add(poll_fd u, int sock, void *ud) {
+	if (sock < 0)
+		return 1;
+	if (sock >= u->handle_n) {
+		int n = u->handle_n == 0 ? 1024 : u->handle_n;
+		while (n <= sock)
+			n *= 2;
+		u->handle = skynet_realloc(u->handle, n * sizeof(struct sp_handle *));
+		memset(u->handle + u->handle_n, 0, (n - u->handle_n) * sizeof(struct sp_handle *));
+		u->handle_n = n;
+	}
+	struct sp_handle *h = skynet_malloc(sizeof(*h));
+	memset(h, 0, sizeof(*h));
+	h->fd = sock;
+	h->ud = ud;
+	h->mode = SP_READ;
+	h->read = true;
+	h->ref = 1;
+	h->next = u->all;
+	if (u->all)
+		u->all->prev = h;
+	u->all = h;
+	u->handle[sock] = h;
+	uring_dirty(u, h);
+	return 0;
+}
+
+static void
+sp_del(poll_fd u, int sock) {
+	struct sp_handle *h = uring_handle(u, sock);
+	if (h == NULL)
+		return;
+	u->handle[sock] = NULL;
+	h->dead = true;
+	if (h->poll_armed && !h->poll_cancel)
+		uring_cancel(u, h, URING_OP_POLL);
+	if (h->op_armed && !h->op_cancel)
+		uring_cancel(u, h, h->mode == SP_RECV ? URING_OP_RECV : URING_OP_ACCEPT);
+	uring_unref(u, h);
+}
+
+static int
+sp_enable(poll_fd u, int sock, void *ud, bool read_enable, bool write_enable) {
+	struct sp_handle *h = uring_handle(u, sock);
+	if (h == NULL)
+		return 1;
+	h->ud = ud;
+	h->read = read_enable;
+	h->write = write_enable;
+	uring_dirty(u, h);
+	return 0;
+}
+
+static void
+sp_mode(poll_fd u, int sock, int mode) {
+	struct sp_handle *h = uring_handle(u, sock);
+	if (h == NULL)
+		return;
+	h->mode = mode;
+	uring_dirty(u, h);
+}
+
+static void
+sp_drop(poll_fd u, struct event *e) {
+	if (!e->completed)
+		return;
+	if (e->bid >= 0) {
+		uring_buffer_add(u, e->bid);
+		e->bid = -1;
+		e->data = NULL;
+	}
+	if (e->accept && e->result >= 0) {
+		close(e->result);
+		e->result = -EBADF;
+	}
+}
+
+// return 1 for an event, 0 for nothing, -1 when the handle has an event already in this batch
+static int
+uring_event(struct sp_uring *u, struct io_uring_cqe *cqe, struct event *e) {
+	uint64_t data = cqe->user_data;
+	if (data == 0) {
+		// the result of cancel or update
+		return 0;
+	}
+	struct sp_handle *h = (struct sp_handle *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	int op = (int)(data & URING_OP_MASK);
+	if (!h->dead && h->batch == u->batch)
+		return -1;
+	int res = cqe->res;
+	int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	int ret = 0;
+	memset(e, 0, sizeof(*e));
+	e->s = h->ud;
+	e->bid = -1;
+	switch (op) {
+	case URING_OP_POLL:
+		if (!more)
+			h->poll_armed = false;
+		if (h->dead || h->poll_cancel || res <= 0)
+			break;
+		if (h->mode == SP_READ) {
+			e->read = (res & POLLIN) != 0;
+			e->write = (res & POLLOUT) != 0;
+			e->error = (res & POLLERR) != 0;
+			e->eof = (res & POLLHUP) != 0;
+			ret = 1;
+		} else if (h->write) {
+			// recv or accept reports the error and eof, so write it only.
+			e->write = true;
+			ret = 1;
+		}
+		break;
+	case URING_OP_RECV:
+		if (!more)
+			h->op_armed = false;
+		if (h->dead || res == -ECANCELED || res == -ENOBUFS) {
+			if (bid >= 0)
+				uring_buffer_add(u, bid);
+			break;
+		}
+		if (res <= 0)
+			h->eof = true;
+		e->read = true;
+		e->completed = true;
+		e->result = res;
+		if (bid >= 0) {
+			e->data = u->buffer + (size_t)bid * URING_BUFFER_SIZE;
+			e->bid = bid;
+		}
+		ret = 1;
+		break;
+	case URING_OP_ACCEPT:
+		if (!more)
+			h->op_armed = false;
+		if (h->dead || res == -ECANCELED) {
+			if (res >= 0)
+				close(res);
+			break;
+		}
+		e->read = true;
+		e->completed = true;
+		e->accept = true;
+		e->result = res;
+		ret = 1;
+		break;
+	}
+	if (ret)
+		h->batch = u->batch;
+	if (!more) {
+		// the request is finished, arm it again if it's still needed
+		if (!h->dead)
+			uring_dirty(u, h);
+		uring_unref(u, h);
+	}
+	return ret;
+}
+
+static int
+sp_wait(poll_fd u, struct event *e, int max) {
+	++u->batch;
+	for (;;) {
+		uring_flush(u);
+		unsigned head = *u->kcq_head;
+		unsigned tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+		// submit the changes, and wait if there is no completion
+		if (uring_submit(u, head == tail) < 0) {
+			if (errno == EINTR && head == tail)
+				return -1;
+		}
+		tail = __atomic_load_n(u->kcq_tail, __ATOMIC_ACQUIRE);
+		int n = 0;
+		while (head != tail && n < max) {
+			int r = uring_event(u, &u->cqes[head & *u->kcq_mask], &e[n]);
+			if (r < 0)
+				break;
+			++head;
+			n += r;
+		}
+		__atomic_store_n(u->kcq_head, head, __ATOMIC_RELEASE);
+		if (n > 0)
+			return n;
+	}
+}
+
+static void
+sp_nonblocking(int fd) {
+	int flag = fcntl(fd, F_GETFL, 0);
+	if ( -1 == flag ) {
+		return;
+	}
+
+	fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+#endif
@@ -0,0 +1,68 @@
+local skynet = require "skynet"
+
+-- The messages are popped in batches of DISPATCH_BATCH (32), they must still be dispatched one by one in order.
+-- The receiver is blocked while the senders fill its queue, so each dispatch takes several batches.
+
+local mode = ...
+
+local SENDER = 4
+local N = 1000
+
+if mode == "receiver" then
+
+local last = {}
+local count = 0
+local max_mqlen = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, source, cmd, i)
+		if cmd == "wait" then
+			-- block the service so the senders fill its queue
+			local start = skynet.hpc()
+			while skynet.hpc() - start < 200000000 do end
+			return
+		end
+		if cmd == "query" then
+			skynet.ret(skynet.pack(count, max_mqlen))
+			return
+		end
+		assert(i == (last[source] or 0) + 1, "out of order")
+		last[source] = i
+		count = count + 1
+		max_mqlen = math.max(max_mqlen, skynet.mqlen())
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, receiver)
+		for i = 1, N do
+			skynet.send(receiver, "lua", "msg", i)
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local receiver = skynet.newservice(SERVICE_NAME, "receiver")
+	local senders = {}
+	for i = 1, SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	skynet.send(receiver, "lua", "wait")
+	for i = 1, SENDER do
+		skynet.send(senders[i], "lua", receiver)
+	end
+	local count, mqlen
+	repeat
+		skynet.sleep(10)
+		count, mqlen = skynet.call(receiver, "lua", "query")
+	until count == SENDER * N
+	skynet.error(string.format("%d messages from %d senders dispatched in order, max queue length %d", count, SENDER, mqlen))
+	assert(mqlen > 32)
+	skynet.exit()
+end)
+
+end
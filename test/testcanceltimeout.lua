@@ -0,0 +1,36 @@
+local skynet = require "skynet"
+
+local N = 20000
+
+skynet.start(function()
+	local fired = {}
+	local sessions = {}
+	for i = 1, N do
+		local _, session = skynet.timeout(i % 100 + 1, function()
+			fired[i] = true
+		end)
+		sessions[i] = session
+	end
+	-- cancel the odd ones
+	for i = 1, N, 2 do
+		assert(skynet.cancel_timeout(sessions[i]))
+	end
+	skynet.sleep(150)
+	for i = 1, N do
+		assert((fired[i] == true) == (i % 2 == 0), i)
+	end
+	-- dispatched already
+	assert(not skynet.cancel_timeout(sessions[2]))
+	-- cancel twice
+	assert(not skynet.cancel_timeout(sessions[1]))
+
+	-- the timer message may be on the way when cancelling, the function must not be called either
+	local called = false
+	local _, session = skynet.timeout(0, function() called = true end)
+	assert(skynet.cancel_timeout(session))
+	skynet.sleep(10)
+	assert(not called)
+
+	skynet.error("cancel timeout ok")
+	skynet.exit()
+end)
@@ -0,0 +1,67 @@
+local skynet = require "skynet"
+require "skynet.manager"
+
+-- Senders look up and post to the services while the master creates, names and kills them.
+
+local mode = ...
+
+local N = 2000
+local SENDER = 4
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function() end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, name, addrs)
+		if cmd == "sync" then
+			skynet.ret()
+			return
+		end
+		-- the services may be killed already, the messages are dropped then
+		for _, addr in ipairs(addrs) do
+			skynet.send(addr, "lua", "ping")
+			if skynet.localname(name) then
+				skynet.send(name, "lua", "ping")
+			end
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local senders = {}
+	for i = 1, SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local start = skynet.now()
+	for i = 1, N do
+		local name = ".slave" .. i
+		local addrs = {}
+		for j = 1, 4 do
+			addrs[j] = skynet.newservice(SERVICE_NAME, "slave")
+		end
+		skynet.name(name, addrs[1])
+		for _, s in ipairs(senders) do
+			skynet.send(s, "lua", "ping", name, addrs)
+		end
+		assert(skynet.localname(name) == addrs[1])
+		for _, addr in ipairs(addrs) do
+			skynet.kill(addr)
+		end
+		assert(skynet.localname(name) == nil)
+	end
+	for _, s in ipairs(senders) do
+		skynet.call(s, "lua", "sync")
+		skynet.kill(s)
+	end
+	skynet.error(string.format("create, name and kill %d services in %.2fs", N * 4, (skynet.now() - start) / 100))
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,61 @@
+local skynet = require "skynet"
+
+-- Many producers push to one service at the same time, check the message order of each producer.
+
+local mode, consumer = ...
+
+local PRODUCER = 16
+local MESSAGE = 20000
+
+if mode == "producer" then
+
+skynet.start(function()
+	consumer = tonumber(consumer)
+	for i = 1, MESSAGE do
+		skynet.send(consumer, "lua", "push", i)
+		if i % 1000 == 0 then
+			skynet.yield()
+		end
+	end
+	skynet.exit()
+end)
+
+elseif mode == "consumer" then
+
+local last = {}
+local total = 0
+local main
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, source, cmd, n)
+		if cmd == "wait" then
+			if total == PRODUCER * MESSAGE then
+				skynet.ret(skynet.pack(total))
+			else
+				main = skynet.response()
+			end
+			return
+		end
+		local expect = (last[source] or 0) + 1
+		assert(n == expect, string.format("message from %08x out of order : %d (expect %d)", source, n, expect))
+		last[source] = n
+		total = total + 1
+		if total == PRODUCER * MESSAGE and main then
+			main(true, total)
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local c = skynet.newservice(SERVICE_NAME, "consumer")
+	for i = 1, PRODUCER do
+		skynet.newservice(SERVICE_NAME, "producer", c)
+	end
+	local total = skynet.call(c, "lua", "wait")
+	skynet.error("mq test ok", total)
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,144 @@
+local skynet = require "skynet"
+
+-- The cost of skynet.pack / skynet.unpack for the typical payloads of a game server.
+-- skynet.packcompact packs the repeated strings and records by reference, skynet.unpack unpacks both.
+
+local function item(i)
+	return { item_id = 10000 + i, count = i % 99 + 1, bind = i % 3 == 0, expire = 1700000000 + i }
+end
+
+local function items(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = item(i)
+	end
+	return t
+end
+
+local function player()
+	local attrs = {}
+	for i = 1, 30 do
+		attrs["attr_" .. i] = i * 1.5
+	end
+	local skills = {}
+	for i = 1, 20 do
+		skills[i] = { skill_id = 2000 + i, level = i % 10 + 1, cooldown = i * 0.25 }
+	end
+	local quests = {}
+	for i = 1, 10 do
+		quests[i] = { quest_id = 3000 + i, state = "accepted", progress = { kill = i, collect = { i, i + 1, i + 2 } } }
+	end
+	return {
+		player_id = 123456789,
+		name = "player_name",
+		level = 60,
+		exp = 1234567890123,
+		pos = { x = 100.5, y = 200.25, z = 0 },
+		attrs = attrs,
+		bag = items(60),
+		skills = skills,
+		quests = quests,
+	}
+end
+
+local PAYLOAD = {
+	{ "rpc", 200000, { "move", 1001, { x = 1.5, y = 2.5, z = 0 }, true } },
+	{ "items100", 20000, { items(100) } },
+	{ "player", 5000, { player() } },
+	{ "items1000", 1000, { items(1000) } },
+}
+
+local function equal(a, b)
+	if type(a) ~= "table" or type(b) ~= "table" then
+		return a == b
+	end
+	for k, v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function bench_pack(pack, n, args)
+	local unpack, trash = skynet.unpack, skynet.trash
+	local msg, sz = pack(table.unpack(args))
+	assert(equal(args, { unpack(msg, sz) }))
+	local start = skynet.hpc()
+	for i = 1, n do
+		trash(pack(table.unpack(args)))
+	end
+	local t_pack = (skynet.hpc() - start) / n
+	start = skynet.hpc()
+	for i = 1, n do
+		unpack(msg, sz)
+	end
+	local t_unpack = (skynet.hpc() - start) / n
+	trash(msg, sz)
+	return sz, t_pack, t_unpack
+end
+
+local function bench(name, n, args)
+	local sz, t_pack, t_unpack = bench_pack(skynet.pack, n, args)
+	local start = skynet.hpc()
+	for i = 1, n do
+		skynet.packstring(table.unpack(args))
+	end
+	local t_packstring = (skynet.hpc() - start) / n
+	skynet.error(string.format("%-10s %6d bytes  pack %8.0fns  unpack %8.0fns  packstring %8.0fns",
+		name, sz, t_pack, t_unpack, t_packstring))
+	sz, t_pack, t_unpack = bench_pack(skynet.packcompact, n, args)
+	skynet.error(string.format("%-10s %6d bytes  pack %8.0fns  unpack %8.0fns  (compact)",
+		name, sz, t_pack, t_unpack))
+end
+
+-- The __pairs metamethod drops the strings packed already and runs the gc, then returns the new strings.
+-- The new strings may reuse the addresses of the collected ones, packcompact must not pack them by reference.
+local function test_gc_pairs()
+	local N = 1000
+	local holder = {}
+	local old = {}
+	for i = 1, N do
+		local s = "old_string_" .. i
+		old[i * 2 - 1] = s
+		old[i * 2] = s
+	end
+	holder[1] = old
+	old = nil
+	local new = {}
+	holder[3] = new	-- packed after __pairs
+	holder[2] = setmetatable({}, { __pairs = function()
+		holder[1] = nil
+		collectgarbage()
+		local i = 0
+		return function()
+			i = i + 1
+			if i <= N * 2 then
+				local s = "new_string_" .. (i + 1) // 2
+				new[i] = s
+				return i, s
+			end
+		end
+	end })
+	local msg, sz = skynet.packcompact(holder)
+	local t = skynet.unpack(msg, sz)
+	skynet.trash(msg, sz)
+	assert(#t[1] == N * 2)
+	for i = 1, N * 2 do
+		assert(t[2][i] == new[i] and t[3][i] == new[i], t[3][i])
+	end
+end
+
+skynet.start(function()
+	test_gc_pairs()
+	for _, p in ipairs(PAYLOAD) do
+		bench(p[1], p[2], p[3])
+		skynet.yield()	-- avoid the endless loop warning
+	end
+	skynet.exit()
+end)
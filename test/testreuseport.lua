@@ -0,0 +1,53 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- K listeners share one port with SO_REUSEPORT, run it with socket_thread > 1 to spread them over the socket threads.
+
+local mode = ...
+
+local K = 4
+local CONN = 2000
+local policy = mode == "cpu" and "cpu" or "hash"
+
+skynet.start(function()
+	local ids, addr, port = socket.listen_reuseport("127.0.0.1", 0, K, nil, policy)
+	skynet.error(string.format("listen %s:%d with %d sockets (%s)", addr, port, K, policy))
+	local accepts = {}
+	for _, id in ipairs(ids) do
+		accepts[id] = 0
+		socket.start(id, function(fd)
+			accepts[id] = accepts[id] + 1
+			socket.close(fd)
+		end)
+	end
+	for i = 1, CONN do
+		local fd = assert(socket.open("127.0.0.1", port))
+		socket.close(fd)
+	end
+	local total
+	repeat
+		skynet.sleep(10)
+		total = 0
+		for _, n in pairs(accepts) do
+			total = total + n
+		end
+	until total == CONN
+	-- arate is the accepts in the last whole second
+	skynet.sleep(110 - skynet.now() % 100)
+	for _, info in ipairs(socket.netstat()) do
+		if accepts[info.id] then
+			skynet.error(string.format("listener %d accept=%d arate=%d/s", info.id, info.accept, info.arate))
+			assert(info.accept == accepts[info.id])
+		end
+	end
+	for _, id in ipairs(ids) do
+		socket.close(id)
+	end
+	-- the port is taken by a listener without SO_REUSEPORT, listen_reuseport raises the error
+	local id, _, taken = socket.listen("127.0.0.1", 0)
+	local ok, err = pcall(socket.listen_reuseport, "127.0.0.1", taken, K, nil, policy)
+	assert(not ok)
+	skynet.error("listen_reuseport on a taken port:", err)
+	socket.close(id)
+	skynet.exit()
+end)
@@ -0,0 +1,68 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- Run it with different scheduler ("global" or "steal") and weight ("static" or "adaptive") in config to compare.
+
+local mode = ...
+
+if mode == "node" then
+
+local next_handle
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, ttl, reporter)
+		if cmd == "link" then
+			next_handle = ttl
+			skynet.ret()
+		elseif ttl > 0 then
+			skynet.send(next_handle, "lua", "pass", ttl - 1, reporter)
+		else
+			skynet.send(reporter, "lua", "done")
+		end
+	end)
+end)
+
+else
+
+local NODE = 64
+local TOKEN = 256
+local TTL = 2000
+
+skynet.start(function()
+	local nodes = {}
+	for i = 1, NODE do
+		nodes[i] = skynet.newservice(SERVICE_NAME, "node")
+	end
+	for i = 1, NODE do
+		skynet.call(nodes[i], "lua", "link", nodes[i % NODE + 1])
+	end
+	local done = 0
+	local co = coroutine.running()
+	skynet.dispatch("lua", function()
+		done = done + 1
+		if done == TOKEN then
+			skynet.wakeup(co)
+		end
+	end)
+	local scheduler = skynet.getenv "scheduler"
+	local start = skynet.now()
+	for i = 1, TOKEN do
+		skynet.send(nodes[i % NODE + 1], "lua", "pass", TTL, skynet.self())
+	end
+	skynet.wait(co)
+	local ti = (skynet.now() - start) / 100
+	local message, dispatch = 0, 0
+	for i = 1, NODE do
+		local stat = skynet.call(nodes[i], "debug", "STAT")
+		message = message + stat.message
+		dispatch = dispatch + stat.dispatch
+		skynet.kill(nodes[i])
+	end
+	skynet.error(string.format("scheduler=%s weight=%s messages=%d time=%.2fs (%.0f msg/s) messages per dispatch=%.2f",
+		scheduler, skynet.getenv "weight", TOKEN * TTL, ti, TOKEN * TTL / math.max(ti, 0.01), message / dispatch))
+	skynet.error(string.format("worker wakeup=%s average wakeup latency=%sus",
+		skynet.stat "wakeup", skynet.stat "wakeup_latency"))
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,113 @@
+local skynet = require "skynet"
+local sharemsg = require "skynet.sharemsg"
+
+-- Fan out a big snapshot to N services, compare skynet.send with sharemsg.send.
+
+local mode = ...
+
+local N = 50
+
+if mode == "slave" then
+
+local CMD = {}
+
+function CMD.snapshot(master, ptr)
+	local snapshot = sharemsg.open(ptr)
+	skynet.send(master, "lua", "ack", #snapshot, snapshot[1].name)
+end
+
+function CMD.plain(master, snapshot)
+	skynet.send(master, "lua", "ack", #snapshot, snapshot[1].name)
+end
+
+function CMD.raw(master, ptr)
+	local snapshot = sharemsg.open(ptr)
+	-- forward the packed message without decode
+	local sz = sharemsg.read(snapshot, function(msg, sz) return sz end)
+	skynet.send(master, "lua", "ack", sz)
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		CMD[cmd](...)
+	end)
+end)
+
+else
+
+local function snapshot()
+	local t = {}
+	for i = 1, 2000 do
+		t[i] = { rank = i, player_id = 100000 + i, name = "player_" .. i, score = 1000000 - i * 7, guild = "guild_" .. i % 20 }
+	end
+	return t
+end
+
+local co
+local acks = 0
+local last
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		assert(cmd == "ack")
+		last = ...
+		acks = acks + 1
+		if acks == N then
+			skynet.wakeup(co)
+		end
+	end)
+	local slaves = {}
+	for i = 1, N do
+		slaves[i] = skynet.newservice(SERVICE_NAME, "slave")
+	end
+	local data = snapshot()
+	local self = skynet.self()
+
+	local function wait()
+		co = coroutine.running()
+		skynet.wait(co)
+		acks = 0
+	end
+
+	local start = skynet.hpc()
+	for i = 1, N do
+		skynet.send(slaves[i], "lua", "plain", self, data)
+	end
+	local t_send = skynet.hpc() - start
+	wait()
+	local t_plain = skynet.hpc() - start
+	assert(last == #data)
+
+	start = skynet.hpc()
+	local obj = sharemsg.pack(data)
+	assert(sharemsg.send(slaves, "lua", obj, "snapshot", self) == N)
+	local t_share = skynet.hpc() - start
+	wait()
+	local t_shared = skynet.hpc() - start
+	assert(last == #data)
+
+	local sz = obj(function(msg, sz) return sz end)
+	skynet.error(string.format("fan out %d bytes to %d services: skynet.send %.2fms (done %.2fms), sharemsg.send %.2fms (done %.2fms)",
+		sz, N, t_send / 1e6, t_plain / 1e6, t_share / 1e6, t_shared / 1e6))
+
+	assert(sharemsg.send(slaves, "lua", obj, "raw", self) == N)
+	wait()
+	assert(last == sz)
+
+	-- the references to the invalid addresses are released
+	assert(sharemsg.send({ slaves[1], 0x7fffff }, "lua", obj, "raw", self) == 1)
+
+	-- the references are released if the send raises an error
+	assert(not pcall(sharemsg.send, slaves, "unknown", obj, "raw", self))
+
+	-- the other nodes get a copy of the message
+	local view = sharemsg.open(obj(skynet.tostring))
+	assert(#view == #data and view[1].name == data[1].name)
+	assert(sharemsg.read(view, function(msg, sz) return sz end) == sz)
+
+	obj = nil
+	collectgarbage()
+	skynet.exit()
+end)
+
+end
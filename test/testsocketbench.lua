@@ -0,0 +1,77 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"
+
+-- Loopback stream throughput, compare the epoll build with the io_uring build (make linux IO_URING=1).
+
+local mode, port = ...
+
+local CLIENT = 8
+local SIZE = 16 * 1024 * 1024	-- bytes per connection
+local BLOCK = string.rep("x", 64 * 1024)
+
+if mode == "client" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local id = assert(socket.open("127.0.0.1", tonumber(port)))
+		for i = 1, SIZE // #BLOCK do
+			socket.write(id, BLOCK)
+		end
+		assert(socket.readline(id) == "done")
+		socket.close(id)
+		skynet.ret()
+	end)
+end)
+
+else
+
+local function sink(id)
+	socket.start(id)
+	local n = 0
+	while n < SIZE do
+		local data = socket.read(id)
+		if not data then
+			socket.close(id)
+			return
+		end
+		n = n + #data
+	end
+	socket.write(id, "done\n")
+	socket.close(id)
+end
+
+skynet.start(function()
+	local port = 8004
+	local listen_id = socket.listen("127.0.0.1", port)
+	socket.start(listen_id, function(id)
+		skynet.fork(sink, id)
+	end)
+	local clients = {}
+	for i = 1, CLIENT do
+		clients[i] = skynet.newservice(SERVICE_NAME, "client", port)
+	end
+	local start = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, CLIENT do
+		skynet.fork(function()
+			skynet.call(clients[i], "lua")
+			done = done + 1
+			if done == CLIENT then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local ti = (skynet.hpc() - start) / 1000000000
+	local mb = CLIENT * SIZE / (1024 * 1024)
+	skynet.error(string.format("connections=%d size=%dMB time=%.2fs (%.1fMB/s)", CLIENT, mb, ti, mb / ti))
+	socket.close(listen_id)
+	for i = 1, CLIENT do
+		skynet.kill(clients[i])
+	end
+	skynet.exit()
+end)
+
+end
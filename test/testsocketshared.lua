@@ -0,0 +1,55 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- One shared buffer is written to many sockets (one by one, or by write_multi), the data is copied only once.
+
+local CLIENT = 100
+local TIMES = 100
+local PAYLOAD = string.rep("0123456789abcdef", 256)	-- 4K
+
+skynet.start(function()
+	local port = 8006
+	local listen_id = socket.listen("127.0.0.1", port)
+	local server = {}
+	local co
+	socket.start(listen_id, function(id)
+		socket.start(id)
+		server[#server+1] = id
+		if #server == CLIENT and co then
+			skynet.wakeup(co)
+		end
+	end)
+	local client = {}
+	for i = 1, CLIENT do
+		client[i] = assert(socket.open("127.0.0.1", port))
+	end
+	if #server < CLIENT then
+		co = coroutine.running()
+		skynet.wait(co)
+	end
+	local shared = socket.shared(PAYLOAD)
+	assert(#shared == #PAYLOAD)
+	for i = 1, TIMES do
+		if i % 2 == 0 then
+			for _, id in ipairs(server) do
+				socket.write(id, shared)
+			end
+		else
+			-- one request per socket thread
+			assert(socket.write_multi(server, shared) == CLIENT)
+		end
+	end
+	shared = nil
+	collectgarbage()
+	for _, id in ipairs(client) do
+		local data = assert(socket.read(id, #PAYLOAD * TIMES))
+		assert(data == string.rep(PAYLOAD, TIMES))
+	end
+	skynet.error(string.format("sent %d x %d bytes to %d sockets", TIMES, #PAYLOAD, CLIENT))
+	for i = 1, CLIENT do
+		socket.close(client[i])
+		socket.close(server[i])
+	end
+	socket.close(listen_id)
+	skynet.exit()
+end)
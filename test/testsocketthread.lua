@@ -0,0 +1,74 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"
+
+-- Run it with socket_thread = 4 in config, the connections are spread over the socket threads.
+
+local mode, port = ...
+
+local CLIENT = 64
+local N = 1000
+
+if mode == "client" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local id = assert(socket.open("127.0.0.1", tonumber(port)))
+		for i = 1, N do
+			local line = "ping " .. i
+			socket.write(id, line .. "\n")
+			assert(socket.readline(id) == line)
+		end
+		socket.close(id)
+		skynet.ret()
+	end)
+end)
+
+else
+
+local function echo(id)
+	socket.start(id)
+	while true do
+		local line = socket.readline(id)
+		if not line then
+			socket.close(id)
+			return
+		end
+		socket.write(id, line .. "\n")
+	end
+end
+
+skynet.start(function()
+	local port = 8003
+	local listen_id = socket.listen("127.0.0.1", port)
+	socket.start(listen_id, function(id)
+		skynet.fork(echo, id)
+	end)
+	local clients = {}
+	for i = 1, CLIENT do
+		clients[i] = skynet.newservice(SERVICE_NAME, "client", port)
+	end
+	local start = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, CLIENT do
+		skynet.fork(function()
+			skynet.call(clients[i], "lua")
+			done = done + 1
+			if done == CLIENT then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local ti = (skynet.hpc() - start) / 1000000000
+	skynet.error(string.format("socket_thread=%s connections=%d round trips=%d time=%.2fs (%.0f/s)",
+		skynet.getenv "socket_thread" or 1, CLIENT, CLIENT * N, ti, CLIENT * N / ti))
+	socket.close(listen_id)
+	for i = 1, CLIENT do
+		skynet.kill(clients[i])
+	end
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,260 @@
+local skynet = require "skynet"
+local sproto = require "sproto"
+
+-- Compare the compiled mode of sproto with the callback mode over the protocols in script/protocol.
+-- Both modes must produce the same bytes and the same tables.
+-- The validate mode (compile(true)) must give the same result as proto_builder.validate.
+
+local ROUND = 200
+
+package.path = (skynet.getenv "root" or "./") .. "script/?.lua;" .. package.path
+
+local function fill(sp, typename, default, depth)
+	local t = {}
+	for k, v in pairs(default) do
+		if k ~= "__type" and math.random(8) > 1 then
+			if type(v) == "table" then
+				if v.__array ~= nil then
+					local elem = v.__array
+					local a = {}
+					for i = 1, depth < 2 and math.random(0, 8) or 1 do
+						if type(elem) == "string" and sp:exist_type(elem) then
+							a[i] = fill(sp, elem, sp:default(elem), depth + 1)
+						elseif math.type(elem) == "integer" then
+							a[i] = math.random(-100, 100) * (math.random(4) == 1 and 0x100000000 or 1)
+						elseif math.type(elem) == "float" then
+							a[i] = math.random() * 1000
+						elseif type(elem) == "boolean" then
+							a[i] = math.random(2) == 1
+						else
+							a[i] = "elem" .. i
+						end
+					end
+					t[k] = a
+				elseif depth < 3 then
+					t[k] = fill(sp, v.__type, sp:default(v.__type), depth + 1)
+				end
+			elseif math.type(v) == "integer" then
+				local r = math.random(4)
+				t[k] = r == 1 and math.random(0, 100) or r == 2 and -math.random(1 << 40) or math.random(1 << 20)
+			elseif math.type(v) == "float" then
+				t[k] = math.random(1000000) / 100
+			elseif type(v) == "boolean" then
+				t[k] = math.random(2) == 1
+			else
+				t[k] = typename .. "." .. k
+			end
+		end
+	end
+	return t
+end
+
+local function equal(a, b)
+	if type(a) ~= "table" or type(b) ~= "table" then
+		return a == b
+	end
+	for k, v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+-- all the request and response of the protocols
+local function samples(bin)
+	local sp = sproto.new(bin)
+	local list = {}
+	for tag = 0, 0xffff do
+		if sp:exist_proto(tag) then
+			local p = sp:queryproto(tag)
+			for _, what in ipairs { "REQUEST", "RESPONSE" } do
+				local st = what == "REQUEST" and p.request or p.response
+				if st then
+					local default = sp:default(p.name, what)
+					for i = 1, 4 do
+						list[#list + 1] = { name = p.name, what = what, data = fill(sp, p.name, default, 0) }
+					end
+				end
+			end
+		end
+	end
+	return list
+end
+
+local function bench(name, bin)
+	local list = samples(bin)
+	local generic = sproto.new(bin)
+	local compiled = sproto.new(bin):compile()
+	local encode = { generic = {}, compiled = {} }
+	local bytes = 0
+	for i, s in ipairs(list) do
+		local enc = s.what == "REQUEST" and "request_encode" or "response_encode"
+		local dec = s.what == "REQUEST" and "request_decode" or "response_decode"
+		local a = generic[enc](generic, s.name, s.data)
+		local b = compiled[enc](compiled, s.name, s.data)
+		assert(a == b, s.name)
+		assert(equal(generic[dec](generic, s.name, a), compiled[dec](compiled, s.name, b)), s.name)
+		s.enc, s.dec, s.bin = enc, dec, a
+		bytes = bytes + #a
+	end
+	local function run(sp)
+		local start = skynet.hpc()
+		for r = 1, ROUND do
+			for _, s in ipairs(list) do
+				sp[s.enc](sp, s.name, s.data)
+			end
+		end
+		local t_encode = skynet.hpc() - start
+		start = skynet.hpc()
+		for r = 1, ROUND do
+			for _, s in ipairs(list) do
+				sp[s.dec](sp, s.name, s.bin)
+			end
+		end
+		return t_encode, skynet.hpc() - start
+	end
+	local n = #list * ROUND
+	local ge, gd = run(generic)
+	local ce, cd = run(compiled)
+	skynet.error(string.format("%s: %d messages (%d bytes avg), encode %.0fns -> %.0fns, decode %.0fns -> %.0fns",
+		name, #list, bytes // #list, ge / n, ce / n, gd / n, cd / n))
+end
+
+local function sorted_errors(msg)
+	local list = {}
+	for e in msg:gmatch "[^;]+" do
+		list[#list + 1] = e:match "^%s*(.-)%s*$"
+	end
+	table.sort(list)
+	return table.concat(list, "; ")
+end
+
+-- a wrong value for the first field, to check the type errors
+local function mutate(data)
+	local t = {}
+	for k, v in pairs(data) do
+		t[k] = v
+	end
+	local k = next(t)
+	if k then
+		local v = t[k]
+		if type(v) == "table" then
+			t[k] = next(v) and "table" or { x = 1 }
+		elseif type(v) == "string" then
+			t[k] = 1
+		else
+			t[k] = {}
+		end
+	end
+	return t
+end
+
+-- c2s: decode then validate the requests, s2c: validate then encode the requests
+local function bench_validate(name, bin, proto_builder)
+	local list = {}
+	for _, s in ipairs(samples(bin)) do
+		if s.what == "REQUEST" then
+			list[#list + 1] = s
+			if name == "s2c" then
+				list[#list + 1] = { name = s.name, data = mutate(s.data) }
+			end
+		end
+	end
+	local generic = sproto.new(bin)
+	local compiled = sproto.new(bin):compile(true)
+	local get_schema = name == "c2s" and proto_builder.get_receive_from_client_schema or proto_builder.get_send_to_client_schema
+	local invalid = 0
+	for _, s in ipairs(list) do
+		s.schema = get_schema(s.name)
+		local ok, err
+		if name == "c2s" then
+			s.bin = generic:request_encode(s.name, s.data)
+			ok, err = proto_builder.validate(s.name, generic:request_decode(s.name, s.bin), s.schema)
+		else
+			ok, err = proto_builder.validate(s.name, s.data, s.schema)
+		end
+		local cok, cerr = pcall(compiled[name == "c2s" and "request_decode" or "request_encode"], compiled, s.name, s.bin or s.data)
+		assert(ok == cok, s.name)
+		if not ok then
+			invalid = invalid + 1
+			assert(sorted_errors(err) == sorted_errors(proto_builder.format_errors(cerr)), s.name)
+		end
+	end
+	local validate = proto_builder.validate
+	local function lua_path()
+		for _, s in ipairs(list) do
+			if name == "c2s" then
+				validate(s.name, generic:request_decode(s.name, s.bin), s.schema)
+			elseif validate(s.name, s.data, s.schema) then
+				generic:request_encode(s.name, s.data)
+			end
+		end
+	end
+	local fused = compiled[name == "c2s" and "request_decode" or "request_encode"]
+	local function fused_path()
+		for _, s in ipairs(list) do
+			pcall(fused, compiled, s.name, s.bin or s.data)
+		end
+	end
+	local function run(f)
+		local start = skynet.hpc()
+		for r = 1, ROUND do
+			f()
+		end
+		return (skynet.hpc() - start) / (ROUND * #list)
+	end
+	skynet.error(string.format("%s validate: %d requests (%d invalid), proto_builder.validate %.0fns -> compile(true) %.0fns",
+		name, #list, invalid, run(lua_path), run(fused_path)))
+end
+
+-- a request with a main index array can't be validated in compiled mode, compile(true) raises the error
+local function test_uncompilable()
+	local sp = sproto.parse [[
+.item {
+	id 0 : integer
+	count 1 : integer
+}
+bag 1 {
+	request {
+		items 0 : *item(id)
+	}
+}
+]]
+	local ok, err = pcall(sp.compile, sp, true)
+	assert(not ok and err:find("bag.request", 1, true), err)
+	-- without validate, it falls back to the callback mode
+	sp = sproto.parse [[
+.item {
+	id 0 : integer
+}
+bag 1 {
+	request {
+		items 0 : *item(id)
+	}
+}
+]]
+	sp:compile()
+	local t = sp:request_decode("bag", sp:request_encode("bag", { items = { [1] = { id = 1 } } }))
+	assert(t.items[1].id == 1)
+end
+
+skynet.start(function()
+	math.randomseed(0)
+	test_uncompilable()
+	local proto_builder = require "utils.proto_builder"
+	local proto = require "protocol.proto"
+	bench("c2s", proto.c2s)
+	skynet.yield()
+	bench("s2c", proto.s2c)
+	skynet.yield()
+	bench_validate("c2s", proto.c2s, proto_builder)
+	skynet.yield()
+	bench_validate("s2c", proto.s2c, proto_builder)
+	skynet.exit()
+end)
@@ -0,0 +1,52 @@
+local skynet = require "skynet"
+local c = require "skynet.core"
+
+-- Every worker adds timers as fast as it can, to measure the contention of skynet_timeout.
+-- The timers expire after the benchmark (10 minutes later), so nobody receives them.
+
+local mode, count = ...
+local COUNT = 200000
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local n = tonumber(count)
+		local start = skynet.hpc()
+		for i = 1, n do
+			c.intcommand("TIMEOUT", 60000 + i % 1000)
+		end
+		skynet.ret(skynet.pack(skynet.hpc() - start))
+		skynet.exit()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local thread = tonumber(skynet.getenv "thread")
+	local slaves = {}
+	for i = 1, thread do
+		slaves[i] = skynet.newservice(SERVICE_NAME, "slave", COUNT)
+	end
+	local co = coroutine.running()
+	local done = 0
+	local total = 0
+	local start = skynet.hpc()
+	for i = 1, thread do
+		skynet.fork(function()
+			total = total + skynet.call(slaves[i], "lua")
+			done = done + 1
+			if done == thread then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local ti = (skynet.hpc() - start) / 1e9
+	skynet.error(string.format("%d workers add %d timers in %.3fs (%.0f timers/s), %.0fns per skynet_timeout",
+		thread, thread * COUNT, ti, thread * COUNT / ti, total / (thread * COUNT)))
+	skynet.exit()
+end)
+
+end
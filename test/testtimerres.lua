@@ -0,0 +1,64 @@
+local skynet = require "skynet"
+
+-- Run it with timer = "tickless" and timer_resolution = 1 in config, skynet.sleep(0.1) sleeps 1ms.
+
+local N = 2000
+
+-- the invalid timeouts raise an error, the negative ones expire at once
+local function test_invalid()
+	for _, ti in ipairs { 1e300, -1e300, math.huge, 0/0, 2^31 } do
+		assert(not pcall(skynet.timeout, ti, error), ti)
+	end
+	local co = coroutine.running()
+	local n = 0
+	for _, ti in ipairs { -1, -0.5, -2^31 + 1 } do
+		skynet.timeout(ti, function()
+			n = n + 1
+			if n == 3 then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+end
+
+skynet.start(function()
+	test_invalid()
+	local resolution = tonumber(skynet.getenv "timer_resolution") or 10
+	local tickless = skynet.getenv "timer" == "tickless"
+	-- the timer is rounded up to the resolution, and the wheel counts the whole ticks.
+	-- In tick mode, the wheel time falls behind for a poll interval (or more when the timer thread is busy).
+	local slack = tickless and resolution or resolution + 5
+	local done = 0
+	local early = 0
+	local late = 0
+	local co = coroutine.running()
+	for i = 1, N do
+		-- 1ms to 500ms
+		local ms = math.random(1, 500)
+		local start = skynet.hpc()
+		skynet.timeout(ms / 10, function()
+			local elapsed = (skynet.hpc() - start) / 1000000
+			if elapsed < ms - slack then
+				early = early + 1
+			end
+			late = late + elapsed - ms
+			done = done + 1
+			if done == N then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	assert(early == 0, "timer expires too early")
+
+	local start = skynet.hpc()
+	for i = 1, 100 do
+		skynet.sleep(0.1)
+	end
+	local ti = (skynet.hpc() - start) / 1000000
+
+	skynet.error(string.format("timer=%s resolution=%dms average late=%.2fms, 100 times sleep(0.1) in %.2fms",
+		skynet.getenv "timer", resolution, late / N, ti))
+	skynet.exit()
+end)
@@ -1,5 +1,84 @@
 local skynet = require "skynet"
 local socket = require "skynet.socket"
+require "skynet.manager"
+
+-- run with "bench" to measure the udp packets per second over loopback
+
+local mode, port = ...
+
+local BENCH_SENDER = 4
+local BENCH_PACKET = 200000	-- packets per sender
+local BENCH_SIZE = 64	-- bytes per packet
+
+if mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local c = socket.udp(function() end)
+		socket.udp_connect(c, "127.0.0.1", tonumber(port))
+		local packet = string.rep("x", BENCH_SIZE)
+		for i = 1, BENCH_PACKET do
+			socket.write(c, packet)
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		socket.close(c)
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "bench" then
+
+skynet.start(function()
+	local port = 8767
+	local n = 0
+	local first, last
+	local server = socket.udp(function(str, from)
+		n = n + 1
+		last = skynet.hpc()
+		first = first or last
+	end, "127.0.0.1", port)
+	local senders = {}
+	for i = 1, BENCH_SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender", port)
+	end
+	local co = coroutine.running()
+	local done = 0
+	for i = 1, BENCH_SENDER do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua")
+			done = done + 1
+			if done == BENCH_SENDER then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	-- wait the packets in flight
+	local count
+	repeat
+		count = n
+		skynet.sleep(20)
+	until count == n
+	local total = BENCH_SENDER * BENCH_PACKET
+	local ti = first and (last - first) / 1000000000 or 0
+	local info
+	for _, v in ipairs(socket.netstat()) do
+		if v.id == server then
+			info = v
+		end
+	end
+	skynet.error(string.format("packets=%d received=%d (%.1f%%) time=%.2fs (%.0f pps) read syscalls=%d",
+		total, n, n * 100 / total, ti, ti > 0 and n / ti or 0, info.rcall))
+	socket.close(server)
+	for i = 1, BENCH_SENDER do
+		skynet.kill(senders[i])
+	end
+	skynet.exit()
+end)
+
+else
 
 local function server()
 	local host
@@ -46,3 +125,5 @@ skynet.start(function()
 	skynet.fork(server_v6)
 	skynet.fork(client_v6)
 end)
+
+end
@@ -0,0 +1,126 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- A slow client (it doesn't read) : the low priority packages above the high watermark are dropped,
+-- and the server stops reading from it until the write buffer drains to the low watermark.
+
+-- A broadcast (write_multi) and the unicasts after it keep their order above the watermark.
+
+local N = 20000
+local HIGH = 64 * 1024
+local LOW = 16 * 1024
+local PACKET = string.rep("x", 1023) .. "\n"
+
+local function find_stat(id)
+	for _, info in ipairs(socket.netstat()) do
+		if info.id == id then
+			return info
+		end
+	end
+end
+
+local accepted, co
+
+-- a connected pair, the client side is paused (a slow client)
+local function slow_client()
+	accepted = nil
+	local client_id = assert(socket.open("127.0.0.1", 8007))
+	socket.pause(client_id)
+	if not accepted then
+		co = coroutine.running()
+		skynet.wait(co)
+		co = nil
+	end
+	return accepted, client_id
+end
+
+-- The broadcasts by write_multi are high priority : they are kept above the watermark,
+-- and a unicast sent after a broadcast arrives after it.
+local function test_order()
+	local server_id, client_id = slow_client()
+	socket.watermark(server_id, HIGH, LOW)
+	local M = 10000
+	local pad = string.rep("x", 1000)
+	for i = 1, M do
+		socket.write_multi({ server_id }, string.format("broadcast %d %s\n", i, pad))
+		socket.write(server_id, string.format("unicast %d\n", i))
+	end
+	skynet.sleep(10)
+	assert(find_stat(server_id).wbuffer > HIGH)
+	for i = 1, M do
+		assert(socket.readline(client_id) == string.format("broadcast %d %s", i, pad))
+		assert(socket.readline(client_id) == string.format("unicast %d", i))
+	end
+	assert(find_stat(server_id).drop == 0)
+	skynet.error(string.format("%d broadcasts and unicasts in order, nothing dropped", M))
+	socket.close(client_id)
+	socket.close(server_id)
+end
+
+-- Pause the client while the data is arriving : nothing is lost or reordered, and eof comes after the data.
+local function test_pause()
+	local server_id, client_id = slow_client()
+	local M = 20000
+	skynet.fork(function()
+		for i = 1, M do
+			socket.write(server_id, string.format("line %d\n", i))
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		socket.close(server_id)
+	end)
+	for i = 1, M do
+		assert(socket.readline(client_id) == string.format("line %d", i))
+		if i % 10 == 0 then
+			socket.pause(client_id)
+			skynet.yield()
+		end
+	end
+	assert(socket.readline(client_id) == false)
+	skynet.error(string.format("%d lines in order across pauses", M))
+	socket.close(client_id)
+end
+
+skynet.start(function()
+	local listen_id = socket.listen("127.0.0.1", 8007)
+	socket.start(listen_id, function(id)
+		socket.start(id)
+		accepted = id
+		if co then
+			skynet.wakeup(co)
+		end
+	end)
+	test_order()
+	test_pause()
+	local server_id, client_id = slow_client()
+	socket.watermark(server_id, HIGH, LOW)
+	for i = 1, N do
+		if i % 100 == 0 then
+			socket.write(server_id, PACKET)
+		else
+			socket.lwrite(server_id, PACKET)
+		end
+	end
+	skynet.sleep(10)
+	local info = find_stat(server_id)
+	skynet.error(string.format("queued=%d dropped=%d reading=%s", info.wbuffer, info.drop, info.reading))
+	assert(info.drop > 0 and info.drop % #PACKET == 0 and not info.reading)
+	-- the high priority packages are never dropped
+	local sz = N * #PACKET - info.drop
+	assert(#socket.read(client_id, sz) == sz)
+	skynet.sleep(10)
+	info = find_stat(server_id)
+	skynet.error(string.format("drained : queued=%d reading=%s", info.wbuffer, info.reading))
+	assert(info.wbuffer == 0 and info.reading)
+	local h = socket.histogram()
+	local s = {}
+	for i = 1, #h do
+		s[i] = h[i]
+	end
+	skynet.error("write buffer histogram (1K, 2K, 4K ...) : " .. table.concat(s, " "))
+	socket.close(client_id)
+	socket.close(server_id)
+	socket.close(listen_id)
+	skynet.exit()
+end)
@@ -0,0 +1,48 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+
+-- The small packets queued in the write buffer are coalesced into a few writev calls.
+
+local N = 100000
+local PACKET = string.rep("x", 99) .. "\n"
+
+local function find_stat(id)
+	for _, info in ipairs(socket.netstat()) do
+		if info.id == id then
+			return info
+		end
+	end
+end
+
+skynet.start(function()
+	local port = 8005
+	local listen_id = socket.listen("127.0.0.1", port)
+	local server_id, co
+	socket.start(listen_id, function(id)
+		socket.start(id)
+		server_id = id
+		if co then
+			skynet.wakeup(co)
+		end
+	end)
+	local client_id = assert(socket.open("127.0.0.1", port))
+	-- don't read until all the packets are queued, so the kernel buffer is full.
+	socket.pause(client_id)
+	if not server_id then
+		co = coroutine.running()
+		skynet.wait(co)
+	end
+	for i = 1, N do
+		socket.write(server_id, PACKET)
+	end
+	-- socket.read resumes the paused socket
+	local sz = N * #PACKET
+	assert(#socket.read(client_id, sz) == sz)
+	local info = find_stat(server_id)
+	skynet.error(string.format("packets=%d bytes=%d write syscalls=%d", N, info.write, info.wcall))
+	assert(info.write == sz and info.wcall < N)
+	socket.close(client_id)
+	socket.close(server_id)
+	socket.close(listen_id)
+	skynet.exit()
+end)